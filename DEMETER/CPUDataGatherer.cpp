@@ -30,6 +30,8 @@ static int number_of_processors;
 static std::map<DWORD, ULARGE_INTEGER> process_user_time_map;
 static std::map<DWORD, ULARGE_INTEGER> process_sys_time_map;
 static std::map<DWORD, ULARGE_INTEGER> process_time_map;
+static std::map<DWORD, UINT64> process_sample_time_map;
+static ULARGE_INTEGER last_system_idle_time, last_system_kernel_time, last_system_user_time;
 
 void init_cpu_getters() {
 	SYSTEM_INFO sys_info;
@@ -105,8 +107,11 @@ ULARGE_INTEGER get_sys_time(const DWORD pid) {
  * 
  * /!\ It is important to divide the result by the number of processors to get an accurate
  * percentage, otherwise, your percentage can be above 100%.
+ *
+ * window_begin and window_end receive the period the percentage covers, on the energy sampler clock
+ * (EnergySamplerNow), so that the energy of exactly this period can be attributed to the process.
  */
-float get_process_cpu_usage(const DWORD pid, const HANDLE process_handle) {
+float get_process_cpu_usage(const DWORD pid, const HANDLE process_handle, UINT64* window_begin, UINT64* window_end) {
 
 	FILETIME ftime, fsys, fuser;
 	ZeroMemory(&ftime, sizeof(FILETIME));
@@ -127,6 +132,11 @@ float get_process_cpu_usage(const DWORD pid, const HANDLE process_handle) {
 	memcpy(&now, &ftime, sizeof(FILETIME));
 
 	GetProcessTimes(process_handle, &ftime, &ftime, &fsys, &fuser);
+	const UINT64 sample_time = EnergySamplerNow();
+	const auto last_sample_time = process_sample_time_map.find(pid);
+	*window_begin = last_sample_time != process_sample_time_map.end() ? last_sample_time->second : sample_time;
+	*window_end = sample_time;
+	process_sample_time_map[pid] = sample_time;
 
 	memcpy(&sys, &fsys, sizeof(FILETIME));
 	memcpy(&user, &fuser, sizeof(FILETIME));
@@ -153,6 +163,59 @@ float get_process_cpu_usage(const DWORD pid, const HANDLE process_handle) {
 	return percent;
 }
 
+float get_process_cpu_usage(const DWORD pid, const HANDLE process_handle) {
+	UINT64 window_begin, window_end;
+	return get_process_cpu_usage(pid, process_handle, &window_begin, &window_end);
+}
+
 float get_process_cpu_usage() {
 	return get_process_cpu_usage(-1, nullptr);
+}
+
+/*
+ * Returns the CPU usage of the whole system since the last call (0 to 1).
+ *
+ * GetSystemTimes sums every processor, the kernel time includes the idle time.
+ */
+float get_system_cpu_usage() {
+	FILETIME fidle, fkernel, fuser;
+	if (!GetSystemTimes(&fidle, &fkernel, &fuser)) {
+		return 0;
+	}
+
+	ULARGE_INTEGER idle, kernel, user;
+	memcpy(&idle, &fidle, sizeof(FILETIME));
+	memcpy(&kernel, &fkernel, sizeof(FILETIME));
+	memcpy(&user, &fuser, sizeof(FILETIME));
+
+	const ULONGLONG idle_delta = idle.QuadPart - last_system_idle_time.QuadPart;
+	const ULONGLONG total_delta = (kernel.QuadPart - last_system_kernel_time.QuadPart) + (user.QuadPart - last_system_user_time.QuadPart);
+
+	last_system_idle_time = idle;
+	last_system_kernel_time = kernel;
+	last_system_user_time = user;
+
+	if (total_delta == 0 || idle_delta > total_delta) {
+		return 0;
+	}
+	return static_cast<float>(total_delta - idle_delta) / static_cast<float>(total_delta);
+}
+
+/*
+ * Forgets the processes that are not among the count running pids, so that the maps do not grow
+ * with every process that ever ran. The usage of the whole system (pid -1) is kept.
+ */
+void prune_cpu_tracked_pids(const DWORD* pids, const DWORD count) {
+	const std::unordered_set<DWORD> running(pids, pids + count);
+	for (auto entry = process_time_map.begin(); entry != process_time_map.end();) {
+		const DWORD pid = entry->first;
+		if (pid == static_cast<DWORD>(-1) || running.contains(pid)) {
+			++entry;
+			continue;
+		}
+		process_user_time_map.erase(pid);
+		process_sys_time_map.erase(pid);
+		process_sample_time_map.erase(pid);
+		entry = process_time_map.erase(entry);
+	}
 }
\ No newline at end of file
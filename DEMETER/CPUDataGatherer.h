@@ -21,6 +21,10 @@
 #include <psapi.h>
 #include <map>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "EnergySampler.h"
 
 void init_cpu_getters();
 
@@ -36,6 +40,12 @@ ULARGE_INTEGER get_time(DWORD);
 
 ULARGE_INTEGER get_sys_time(DWORD);
 
+float get_process_cpu_usage(DWORD, HANDLE, UINT64*, UINT64*);
+
 float get_process_cpu_usage(DWORD, HANDLE);
 
-float get_process_cpu_usage();
\ No newline at end of file
+float get_process_cpu_usage();
+
+float get_system_cpu_usage();
+
+void prune_cpu_tracked_pids(const DWORD*, DWORD);
\ No newline at end of file
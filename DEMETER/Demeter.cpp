@@ -30,31 +30,82 @@
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 
 #include <csignal>
+#include <cmath>
+#include <algorithm>
 #include <windows.h>
 #include <strsafe.h>
 #include <fstream>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <chrono>
 #include <ranges>
+#include <vector>
 #include <cxxopts.hpp>
 
 #include "misc.h" /* LoadNpcapDlls */
 #include "CPUDataGatherer.h"
 #include "RAMDataGatherer.h"
 #include "ProcessNetDataGatherer.h"
+#include "PacketReplay.h"
 #include "ProcessInfoGatherer.h"
 #include "DiskDataGatherer.h"
 #include "SystemInfoGatherer.h"
+#include "SocketDataGatherer.h"
 #include "DemeterLogger.h"
 #include "Demeter.h"
-#include "EnergyGatherer.h"
+#include "EnergySampler.h"
+#include "EnergySource.h"
+#include "PowerModel.h"
 #include "UsageWatchdogManager.h"
+#include "ProcessRecord.h"
+#include "MetricsExporter.h"
+#include "ProcessNameTable.h"
+#include "LiveSnapshot.h"
+#include "PowerTrace.h"
+#include "StreamServer.h"
+#include "Rollups.h"
+#include "StateFile.h"
 
 using namespace std;
 
 static ofstream printfile;
 
+// Rows that sum several processes, as opposed to rows of a single process name.
+static const unordered_set<string> aggregate_names = { "System Total", "Application Total", "Not recorded Total", "CPU Energy", "Idle Energy" };
+
+// Delta output: only rows with a value that changed by more than delta_epsilon (a fraction of the
+// value) since they were last written are written, every keyframe_interval ticks a keyframe writes
+// every row (0 disables the mode).
+static float delta_epsilon = 0;
+static int keyframe_interval = 60;
+static int ticks_until_keyframe = 0;
+static vector<process_record> last_written_records; // Indexed by name ID.
+
+// Top output: only the top_count heaviest processes by top_column get a row, the others are
+// summed in an "Other" row (0 disables the mode).
+static SIZE_T top_count = 0;
+static record_column top_column = RECORD_SUMC;
+
+// How the idle energy of a tick is attributed: the package power of the idle machine, measured at
+// calibration, over the tick. The rest of the package energy is dynamic and goes to the processes
+// by their share of the busy CPU time.
+typedef enum idle_policy {
+    IDLE_SEPARATE, // Reported in an "Idle Energy" row only.
+    IDLE_BY_SHARE, // Spread over the processes by their share of the busy CPU time.
+    IDLE_EVENLY    // Spread evenly over the processes.
+} idle_policy;
+
+static idle_policy idle_attribution = IDLE_SEPARATE;
+static float idle_baseline_watts = 0;
+static bool idle_baseline_calibrated = false;
+static UINT64 idle_baseline_time = 0; // When it was measured (FILETIME).
+static int idle_baseline_max_age_days = 30; // Age at which a restored baseline is measured again.
+constexpr int idle_baseline_min_samples = 10; // Below, a fit is mostly noise.
+
+// State file, see StateFile.cpp (empty disables it).
+static string state_file_path;
+
 uint64_t timestamp_now() {
     using namespace std::chrono;
     return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
@@ -83,14 +134,27 @@ void open_csv_file() {
         send_data_to_output("----RESTARTLINE----\n", false);
     }
     else {
-        send_data_to_output("TIME;NAME;CPU;CPUC;NetUP;NetUpC;NetDown;NetDownC;DiskR;DiskW;DirkRC;DiskWC;RAM;SumC\n", false);
+        send_data_to_output("TIME;NAME;CPU;CPUC;NetUP;NetUpC;NetDown;NetDownC;DiskR;DiskW;DirkRC;DiskWC;RAM;SumC;CoreC;GpuC;UncoreC;DramC\n", false);
     }
+    ticks_until_keyframe = 0; // A file must be readable on its own.
+}
+
+void save_demeter_state() {
+    if (state_file_path.empty()) return;
+    save_state_file(state_file_path, { idle_baseline_calibrated ? TRUE : FALSE, idle_baseline_watts, idle_baseline_time });
 }
 
 void sigtrap(int signo) {
     spdlog::info("SIGTRAP! {}", signo);
+    save_demeter_state();
     delete_usage_watchdog();
-    CloseScaphandre();
+    stop_metrics_exporter();
+    close_live_snapshot_segment();
+    stop_stream_server();
+    flush_rollups();
+    stop_power_trace();
+    StopEnergySampler();
+    CloseEnergySource();
     SIZE_T opened_handles_count;
     pcap_t** opened_handles = get_pcap_handle(&opened_handles_count);
     for (int i = 0; i < opened_handles_count; i++) {
@@ -100,7 +164,7 @@ void sigtrap(int signo) {
     exit(0);
 }
 
-void initialize_demeter(bool console, bool watchdog, bool localloop, bool std_output, bool force_use_platform, float disk_r_cost, float disk_w_cost) {
+void initialize_demeter(bool console, bool watchdog, bool localloop, bool std_output, bool force_use_platform, float disk_r_cost, float disk_w_cost, int metrics_port, bool live_snapshot, const string& stream_socket) {
     ::ShowWindow(::GetConsoleWindow(), console ? SW_NORMAL : SW_HIDE);
     if (watchdog) {
         enable_watchdog();
@@ -111,6 +175,9 @@ void initialize_demeter(bool console, bool watchdog, bool localloop, bool std_ou
         spdlog::critical("Couldn't load Npcap");
         exit(1);
     }
+    if (!check_capture_exclude()) {
+        exit(1);
+    }
     map_ports_to_pid();
     if (start_packet_sniffing() == 1) {
         spdlog::info("Successfully started sniffing");
@@ -121,11 +188,21 @@ void initialize_demeter(bool console, bool watchdog, bool localloop, bool std_ou
     if (!std_output) {
         open_csv_file();
     }
-    if (LoadScaphandreDriver(force_use_platform)) {
-        spdlog::critical("Couldn't load Scaphandre Driver.");
+    if (LoadEnergySource(force_use_platform)) {
+        spdlog::critical("Couldn't load the energy source ({}).", GetEnergySource()->name);
         exit(1);
     }
     init_cpu_getters();
+    init_socket_topology();
+    if (metrics_port > 0 && !start_metrics_exporter(static_cast<u_short>(metrics_port))) {
+        spdlog::error("Failed to start the metrics exporter");
+    }
+    if (live_snapshot && !open_live_snapshot_segment()) {
+        spdlog::error("Failed to open the live snapshot segment");
+    }
+    if (!stream_socket.empty() && !start_stream_server(stream_socket)) {
+        spdlog::error("Failed to start the stream server");
+    }
 }
 
 void setup_signal_handlers() {
@@ -134,9 +211,33 @@ void setup_signal_handlers() {
     signal(SIGSEGV, sigtrap);
 }
 
-void collect_data(unordered_map<string, float>& CPU_usage_map, unordered_map<string, SIZE_T>& RAM_usage_map, unordered_map<string, DWORD>& net_up_usage_map, unordered_map<string, DWORD>& net_down_usage_map, unordered_map<string, ULONGLONG>& disk_read_usage_map, unordered_map<string, ULONGLONG>& disk_write_usage_map, unordered_map<string, int>& process_name_count_map) {
+// CPU usage of one process and the window it covers, see get_process_cpu_usage.
+typedef struct process_cpu_window {
+    string name;
+    bool recorded; // Counted in its own row and in "Application Total", otherwise in "Not recorded Total".
+    float cpu_usage;
+    UINT64 begin;
+    UINT64 end;
+    UINT32 socket_mask; // Sockets its affinity allows, see get_process_socket_mask.
+} process_cpu_window;
+
+// CPU usage of a row on every socket, as a fraction of the machine.
+typedef struct socket_usage {
+    float usage[ENERGY_MAX_SOCKETS];
+} socket_usage;
+
+// Energy of the domains shared by CPU usage.
+typedef struct cpu_energy {
+    float package;
+    float core;
+    float gpu;
+    float uncore;
+} cpu_energy;
+
+void collect_data(unordered_map<string, float>& CPU_usage_map, unordered_map<string, SIZE_T>& RAM_usage_map, unordered_map<string, ULONGLONG>& net_up_usage_map, unordered_map<string, ULONGLONG>& net_down_usage_map, unordered_map<string, ULONGLONG>& disk_read_usage_map, unordered_map<string, ULONGLONG>& disk_write_usage_map, unordered_map<string, int>& process_name_count_map, vector<process_cpu_window>& cpu_windows) {
     constexpr double infinity = std::numeric_limits<double>::infinity();
     DWORD all_processes_pids[1024], returned_processes_count;
+    harvest_packet_counters(); // Closes the network window of this tick.
     if (EnumProcesses(all_processes_pids, sizeof(all_processes_pids), &returned_processes_count)) {
         DWORD processes_count = returned_processes_count / sizeof(DWORD);
         refresh_services();
@@ -145,17 +246,20 @@ void collect_data(unordered_map<string, float>& CPU_usage_map, unordered_map<str
             HANDLE process_handle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ | PROCESS_TERMINATE, FALSE, pid);
             string process_name = get_process_name(pid, process_handle);
             SIZE_T process_ram = get_working_set(process_handle);
-            float process_cpu_usage = get_process_cpu_usage(pid, process_handle);
-            DWORD process_net_up = get_packet_sent_weight(pid);
-            DWORD process_net_down = get_packet_received_weight(pid);
+            UINT64 cpu_window_begin, cpu_window_end;
+            float process_cpu_usage = get_process_cpu_usage(pid, process_handle, &cpu_window_begin, &cpu_window_end);
+            ULONGLONG process_net_up = get_packet_sent_weight(pid);
+            ULONGLONG process_net_down = get_packet_received_weight(pid);
             ULONGLONG process_disk_read = 0;
             ULONGLONG process_disk_write = 0;
             get_disk_stats(pid, process_handle, &process_disk_read, &process_disk_write);
             if (infinity <= process_cpu_usage) {
                 process_cpu_usage = 0;
             }
+            const bool recorded = !is_process_service(pid) && process_name != "<unknown>";
+            cpu_windows.push_back({ process_name, recorded, process_cpu_usage, cpu_window_begin, cpu_window_end, get_process_socket_mask(process_handle) });
             record_measurements(CPU_usage_map, "System Total", RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, process_cpu_usage, process_ram, process_net_up, process_net_down, process_disk_read, process_disk_write);
-            if (!is_process_service(pid) && process_name != "<unknown>") {
+            if (recorded) {
                 record_measurements(CPU_usage_map, process_name, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, process_cpu_usage, process_ram, process_net_up, process_net_down, process_disk_read, process_disk_write);
                 record_measurements(CPU_usage_map, "Application Total", RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, process_cpu_usage, process_ram, process_net_up, process_net_down, process_disk_read, process_disk_write);
             }
@@ -168,19 +272,422 @@ void collect_data(unordered_map<string, float>& CPU_usage_map, unordered_map<str
             CloseHandle(process_handle);
         }
         record_measurements(CPU_usage_map, "CPU Energy", RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, 1, 0, 0, 0, 0, 0);
-        reset_packet_bandwith();
+        prune_cpu_tracked_pids(all_processes_pids, processes_count);
     }
     else {
         spdlog::critical("Can't enum processes!");
     }
 }
 
-void process_data(unordered_map<string, float>& CPU_usage_map, unordered_map<string, SIZE_T>& RAM_usage_map, unordered_map<string, DWORD>& net_up_usage_map, unordered_map<string, DWORD>& net_down_usage_map, unordered_map<string, ULONGLONG>& disk_read_usage_map, unordered_map<string, ULONGLONG>& disk_write_usage_map, unordered_map<string, int>& process_name_count_map, float energy_consumption, float disk_r_cost, float disk_w_cost, bool std_output, time_t process_data_gathering_duration) {
+/*
+ * Splits the package energy of a reading into the domains shared by CPU usage. Uncore is what the
+ * package spent outside of PP0 and PP1 (all of it goes to cores if PP0 is unknown).
+ */
+cpu_energy split_cpu_energy(const energy_reading& energy) {
+    cpu_energy split;
+    split.package = energy.package;
+    split.core = energy.available[ENERGY_DOMAIN_PP0] ? energy.domains[ENERGY_DOMAIN_PP0] : energy.package;
+    split.gpu = energy.domains[ENERGY_DOMAIN_PP1];
+    // PSYS already covers DRAM, it is not uncore.
+    const float dram_in_package = IsEnergySourcePlatformUsed() ? energy.domains[ENERGY_DOMAIN_DRAM] : 0.0f;
+    split.uncore = max(0.0f, energy.package - split.core - split.gpu - dram_in_package);
+    return split;
+}
+
+void add_cpu_energy(cpu_energy& total, const cpu_energy& energy, const float cpu_usage) {
+    total.package += energy.package * cpu_usage;
+    total.core += energy.core * cpu_usage;
+    total.gpu += energy.gpu * cpu_usage;
+    total.uncore += energy.uncore * cpu_usage;
+}
+
+/*
+ * Splits CPU energy into the idle baseline over seconds and the dynamic rest. Every domain is split
+ * in the same proportion as the package.
+ */
+void split_idle_energy(const cpu_energy& energy, const double seconds, cpu_energy* idle, cpu_energy* dynamic) {
+    const double idle_package = idle_baseline_watts * seconds / 3.6; // Joules to milliwatt-hour.
+    const float idle_fraction = energy.package > 0 ? static_cast<float>(min(1.0, idle_package / energy.package)) : 0.0f;
+    *idle = {};
+    *dynamic = {};
+    add_cpu_energy(*idle, energy, idle_fraction);
+    add_cpu_energy(*dynamic, energy, 1.0f - idle_fraction);
+}
+
+/*
+ * Returns the share of the idle energy given to a row holding cpu_share of the busy CPU time and
+ * process_count of the total_process_count processes.
+ */
+float get_idle_share(const float cpu_share, const int process_count, const int total_process_count) {
+    switch (idle_attribution) {
+    case IDLE_BY_SHARE:
+        return cpu_share;
+    case IDLE_EVENLY:
+        return total_process_count > 0 ? static_cast<float>(process_count) / static_cast<float>(total_process_count) : 0.0f;
+    default:
+        return 0.0f;
+    }
+}
+
+/*
+ * Spreads the CPU usage of a process over the sockets it may run on, in proportion of their busy
+ * time. Windows does not tell where the threads of a process ran, but a process pinned to a socket
+ * can only have run there. For a process allowed on every socket, get_cpu_share then comes down to
+ * its share of the busy CPU time of the machine, as with a single socket.
+ */
+socket_usage spread_socket_usage(const process_cpu_window& window, const float* socket_cpu_usage, const int sockets_count) {
+    const UINT32 socket_mask = window.socket_mask != 0 ? window.socket_mask : ~0u;
+    float allowed_busy_usage = 0;
+    int allowed_sockets = 0;
+    for (int socket = 0; socket < sockets_count; socket++) {
+        if (socket_mask & (1u << socket)) {
+            allowed_busy_usage += socket_cpu_usage[socket];
+            allowed_sockets++;
+        }
+    }
+
+    socket_usage usage = {};
+    for (int socket = 0; socket < sockets_count; socket++) {
+        if (socket_mask & (1u << socket)) {
+            usage.usage[socket] = allowed_busy_usage > 0 ? window.cpu_usage * socket_cpu_usage[socket] / allowed_busy_usage : window.cpu_usage / static_cast<float>(allowed_sockets);
+        }
+    }
+    return usage;
+}
+
+void add_socket_usage(socket_usage& total, const socket_usage& usage) {
+    for (int socket = 0; socket < ENERGY_MAX_SOCKETS; socket++) {
+        total.usage[socket] += usage.usage[socket];
+    }
+}
+
+/*
+ * Returns the share of the CPU energy of a reading given to a row. With a single socket it is the
+ * row's share of the busy CPU time. With several, the energy of each socket is shared by the usage
+ * on that socket, against the usage of every process on it (system_usage).
+ */
+float get_cpu_share(const energy_reading& energy, const float cpu_usage, const float busy_usage, const socket_usage& usage, const socket_usage& system_usage) {
+    float sockets_energy = 0;
+    for (int socket = 0; socket < energy.sockets_count; socket++) {
+        sockets_energy += energy.sockets[socket];
+    }
+    if (energy.sockets_count <= 1 || sockets_energy <= 0) {
+        return busy_usage > 0 ? cpu_usage / busy_usage : 0.0f;
+    }
+
+    float cpu_share = 0;
+    for (int socket = 0; socket < energy.sockets_count; socket++) {
+        if (system_usage.usage[socket] > 0) {
+            cpu_share += energy.sockets[socket] / sockets_energy * usage.usage[socket] / system_usage.usage[socket];
+        }
+    }
+    return cpu_share;
+}
+
+/*
+ * Returns the CPU shared energy of a row holding cpu_share of the busy CPU time (see get_cpu_share).
+ */
+cpu_energy attribute_cpu_energy(const cpu_energy& energy, const double seconds, const float cpu_share, const int process_count, const int total_process_count) {
+    cpu_energy idle, dynamic;
+    split_idle_energy(energy, seconds, &idle, &dynamic);
+
+    cpu_energy attributed = {};
+    add_cpu_energy(attributed, dynamic, cpu_share);
+    add_cpu_energy(attributed, idle, get_idle_share(cpu_share, process_count, total_process_count));
+    return attributed;
+}
+
+/*
+ * Returns the share of the uncore energy given to a row. Uncore (caches, memory controller, I/O
+ * fabric) works for the whole machine rather than for the cores, so it is shared as overhead: the
+ * mean of the row's shares of the busy CPU time, of resident memory and of I/O traffic, over the
+ * drivers the system used.
+ */
+float get_overhead_share(const float cpu_usage, const float busy_usage, const double ram, const double total_ram, const double io, const double total_io) {
+    double share = 0;
+    int drivers = 0;
+    if (busy_usage > 0) {
+        share += cpu_usage / busy_usage;
+        drivers++;
+    }
+    if (total_ram > 0) {
+        share += ram / total_ram;
+        drivers++;
+    }
+    if (total_io > 0) {
+        share += io / total_io;
+        drivers++;
+    }
+    return drivers > 0 ? static_cast<float>(share / drivers) : 0.0f;
+}
+
+/*
+ * Gives every process the energy spent during its own CPU measurement window, rather than during
+ * the tick: processes are measured one after the other, so on large hosts their windows drift far
+ * from the tick's. Returns the CPU shared energy of every process row and of the totals.
+ *
+ * Processes measured together share a window, its energy is read once. The CPU Energy and Idle
+ * Energy rows are summed over the same windows, so that they reconcile with the System Total:
+ * every window contributes its dynamic energy by CPU share and its idle energy by idle share
+ * (by CPU share with the share policy, evenly otherwise).
+ */
+unordered_map<string, cpu_energy> attribute_cpu_windows(const vector<process_cpu_window>& cpu_windows, const float busy_usage, const float* socket_cpu_usage, const socket_usage& system_usage) {
+    const int total_process_count = static_cast<int>(cpu_windows.size());
+    unordered_map<string, cpu_energy> cpu_energy_map;
+    map<pair<UINT64, UINT64>, energy_reading> window_energy_map;
+    for (const auto& window : cpu_windows) {
+        auto window_energy = window_energy_map.find({ window.begin, window.end });
+        if (window_energy == window_energy_map.end()) {
+            window_energy = window_energy_map.emplace(pair<UINT64, UINT64>(window.begin, window.end), energy_reading()).first;
+            ReadEnergyBetween(window.begin, window.end, &window_energy->second);
+        }
+        const double seconds = static_cast<double>(window.end - window.begin) / 1000000000.0;
+        const socket_usage usage = spread_socket_usage(window, socket_cpu_usage, window_energy->second.sockets_count);
+        const float cpu_share = get_cpu_share(window_energy->second, window.cpu_usage, busy_usage, usage, system_usage);
+        cpu_energy idle, dynamic;
+        split_idle_energy(split_cpu_energy(window_energy->second), seconds, &idle, &dynamic);
+        const float idle_share = idle_attribution == IDLE_BY_SHARE ? cpu_share : 1.0f / static_cast<float>(total_process_count);
+
+        cpu_energy energy = {};
+        add_cpu_energy(energy, dynamic, cpu_share);
+        add_cpu_energy(energy, idle, get_idle_share(cpu_share, 1, total_process_count));
+        add_cpu_energy(cpu_energy_map["CPU Energy"], dynamic, cpu_share);
+        add_cpu_energy(cpu_energy_map["CPU Energy"], idle, idle_share);
+        add_cpu_energy(cpu_energy_map["Idle Energy"], idle, idle_share);
+
+        add_cpu_energy(cpu_energy_map["System Total"], energy, 1.0f);
+        if (window.recorded) {
+            add_cpu_energy(cpu_energy_map[window.name], energy, 1.0f);
+            add_cpu_energy(cpu_energy_map["Application Total"], energy, 1.0f);
+        }
+        else {
+            add_cpu_energy(cpu_energy_map["Not recorded Total"], energy, 1.0f);
+        }
+    }
+    return cpu_energy_map;
+}
+
+/*
+ * Measures the idle baseline, the package power of the machine without CPU load. The package power
+ * and the system CPU usage are sampled every second for seconds, idle_baseline_min_samples times at
+ * least; the baseline is the power extrapolated to no usage by a least squares line, or the lowest
+ * power seen when the usage did not vary enough to fit one.
+ */
+float measure_idle_baseline(const int seconds, const bool energy_sampler) {
+    vector<double> usages, watts;
+    energy_reading energy;
+    if (!energy_sampler) {
+        ReadEnergySource(&energy);
+    }
+    get_system_cpu_usage();
+    UINT64 sample_begin = EnergySamplerNow();
+
+    for (int second = 0; second < max(seconds, idle_baseline_min_samples); second++) {
+        Sleep(1000);
+        const UINT64 sample_end = EnergySamplerNow();
+        if (energy_sampler) {
+            ReadEnergyBetween(sample_begin, sample_end, &energy);
+        }
+        else {
+            ReadEnergySource(&energy);
+        }
+        usages.push_back(get_system_cpu_usage());
+        watts.push_back(energy.package * 3.6 / (static_cast<double>(sample_end - sample_begin) / 1000000000.0));
+        sample_begin = sample_end;
+    }
+
+    const double count = static_cast<double>(usages.size());
+    double mean_usage = 0, mean_watts = 0, min_usage = 1, max_usage = 0, min_watts = watts[0];
+    for (SIZE_T i = 0; i < usages.size(); i++) {
+        mean_usage += usages[i] / count;
+        mean_watts += watts[i] / count;
+        min_usage = min(min_usage, usages[i]);
+        max_usage = max(max_usage, usages[i]);
+        min_watts = min(min_watts, watts[i]);
+    }
+
+    double baseline = min_watts;
+    if (max_usage - min_usage >= 0.05) {
+        double covariance = 0, variance = 0;
+        for (SIZE_T i = 0; i < usages.size(); i++) {
+            covariance += (usages[i] - mean_usage) * (watts[i] - mean_watts);
+            variance += (usages[i] - mean_usage) * (usages[i] - mean_usage);
+        }
+        const double slope = covariance / variance;
+        if (slope > 0) {
+            baseline = mean_watts - slope * mean_usage;
+        }
+    }
+    // Never above what was measured, a noisy fit must not leave nothing dynamic.
+    return static_cast<float>(max(0.0, min(baseline, min_watts)));
+}
+
+void set_idle_policy(const idle_policy policy) {
+    idle_attribution = policy;
+}
+
+void set_calibration_max_age(const int days) {
+    idle_baseline_max_age_days = days;
+}
+
+bool parse_idle_policy(const string& name, idle_policy* policy) {
+    if (name == "separate") {
+        *policy = IDLE_SEPARATE;
+    }
+    else if (name == "share") {
+        *policy = IDLE_BY_SHARE;
+    }
+    else if (name == "even") {
+        *policy = IDLE_EVENLY;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+string format_record(const process_record& record, const time_t timestamp) {
+    return to_string(timestamp) + ";" + record.name + ";" + to_string(record.cpu_usage) + ";" + to_string(record.cpu_consumption) + ";" + to_string(record.net_up_bandwidth) + ";" + to_string(record.net_up_consumption) + ";" + to_string(record.net_down_bandwidth) + ";" + to_string(record.net_down_consumption) + ";" + to_string(record.disk_read_speed) + ";" + to_string(record.disk_write_speed) + ";" + to_string(record.disk_read_consumption) + ";" + to_string(record.disk_write_consumption) + ";" + to_string(record.ram) + ";" + to_string(record.sum_consumption) + ";" + to_string(record.core_consumption) + ";" + to_string(record.gpu_consumption) + ";" + to_string(record.uncore_consumption) + ";" + to_string(record.dram_consumption) + "\n";
+}
+
+void set_top_output(const SIZE_T count, const record_column column) {
+    top_count = count;
+    top_column = column;
+}
+
+void set_delta_output(const float epsilon, const int interval) {
+    delta_epsilon = epsilon;
+    keyframe_interval = interval > 0 ? interval : 1;
+}
+
+/*
+ * Returns true when a value of the row changed by more than delta_epsilon relatively, so that the
+ * same epsilon fits columns in different units (%, mWh, MB/s, bytes). Changes below the precision
+ * written (6 decimals) are not changes.
+ */
+bool has_record_changed(const process_record& last, const process_record& record) {
+    const auto changed = [](const double a, const double b) {
+        const double delta = fabs(a - b);
+        return delta >= 0.0000005 && delta > delta_epsilon * max(fabs(a), fabs(b));
+    };
+    return changed(last.cpu_usage, record.cpu_usage)
+        || changed(last.cpu_consumption, record.cpu_consumption)
+        || changed(last.net_up_bandwidth, record.net_up_bandwidth)
+        || changed(last.net_up_consumption, record.net_up_consumption)
+        || changed(last.net_down_bandwidth, record.net_down_bandwidth)
+        || changed(last.net_down_consumption, record.net_down_consumption)
+        || changed(last.disk_read_speed, record.disk_read_speed)
+        || changed(last.disk_write_speed, record.disk_write_speed)
+        || changed(last.disk_read_consumption, record.disk_read_consumption)
+        || changed(last.disk_write_consumption, record.disk_write_consumption)
+        || changed(last.sum_consumption, record.sum_consumption)
+        || changed(last.core_consumption, record.core_consumption)
+        || changed(last.gpu_consumption, record.gpu_consumption)
+        || changed(last.uncore_consumption, record.uncore_consumption)
+        || changed(last.dram_consumption, record.dram_consumption)
+        || changed(static_cast<double>(last.ram), static_cast<double>(record.ram));
+}
+
+/*
+ * Writes the rows of a tick in delta mode.
+ *
+ * A keyframe starts with a "----KEYFRAME----" line and holds every row. Between keyframes, a row is
+ * only written when it changed by more than delta_epsilon since it was last written (see
+ * has_record_changed). A name missing from the tick counts as an all-zero row, so a process that
+ * exited gets one zero row. Readers rebuild every tick by carrying the last row of each name
+ * forward from the last keyframe, a name without a row since the keyframe being all zero.
+ */
+void write_delta_records(const vector<process_record>& records, const time_t timestamp, const bool std_output) {
+    const bool keyframe = ticks_until_keyframe <= 0;
+    ticks_until_keyframe = keyframe ? keyframe_interval - 1 : ticks_until_keyframe - 1;
+
+    vector<bool> present(get_interned_process_names_count(), false);
+    if (last_written_records.size() < present.size()) {
+        last_written_records.resize(present.size());
+    }
+
+    if (keyframe) {
+        send_data_to_output("----KEYFRAME----\n", std_output);
+    }
+    for (const auto& record : records) {
+        present[record.name_id] = true;
+        process_record& last = last_written_records[record.name_id];
+        if (keyframe || last.name.empty() || has_record_changed(last, record)) {
+            send_data_to_output(format_record(record, timestamp), std_output);
+            last = record;
+        }
+    }
+
+    for (UINT32 name_id = 0; name_id < last_written_records.size(); name_id++) {
+        process_record& last = last_written_records[name_id];
+        if (present[name_id] || last.name.empty()) continue;
+
+        process_record zero = {};
+        zero.name = last.name;
+        zero.name_id = name_id;
+        zero.aggregate = last.aggregate;
+        if (keyframe) {
+            last = zero; // Not written, absent from a keyframe already means zero.
+        }
+        else if (has_record_changed(last, zero)) {
+            send_data_to_output(format_record(zero, timestamp), std_output);
+            last = zero;
+        }
+    }
+}
+
+void process_data(unordered_map<string, float>& CPU_usage_map, unordered_map<string, SIZE_T>& RAM_usage_map, unordered_map<string, ULONGLONG>& net_up_usage_map, unordered_map<string, ULONGLONG>& net_down_usage_map, unordered_map<string, ULONGLONG>& disk_read_usage_map, unordered_map<string, ULONGLONG>& disk_write_usage_map, unordered_map<string, int>& process_name_count_map, const vector<process_cpu_window>& cpu_windows, const energy_reading& energy, double energy_seconds, const float* socket_cpu_usage, float disk_r_cost, float disk_w_cost, bool std_output, time_t process_data_gathering_duration, time_t timestamp) {
+    // Cores and graphics energy are shared by CPU usage like the package energy. With the energy
+    // sampler, each process gets the energy of its own measurement window. Uncore is then taken
+    // back out of the package and shared as overhead (see get_overhead_share).
+    const float busy_usage = CPU_usage_map["System Total"];
+    const int total_process_count = process_name_count_map["System Total"];
+    const cpu_energy tick_cpu_energy = split_cpu_energy(energy);
+    cpu_energy tick_idle_energy, tick_dynamic_energy;
+    split_idle_energy(tick_cpu_energy, energy_seconds, &tick_idle_energy, &tick_dynamic_energy);
+
+    // On several sockets, processes pinned to some sockets are charged from those only.
+    unordered_map<string, socket_usage> socket_usage_map;
+    for (const auto& window : cpu_windows) {
+        const socket_usage usage = spread_socket_usage(window, socket_cpu_usage, energy.sockets_count);
+        add_socket_usage(socket_usage_map["System Total"], usage);
+        add_socket_usage(socket_usage_map[window.recorded ? window.name : "Not recorded Total"], usage);
+        if (window.recorded) {
+            add_socket_usage(socket_usage_map["Application Total"], usage);
+        }
+    }
+    const socket_usage system_usage = socket_usage_map["System Total"];
+
+    const unordered_map<string, cpu_energy> cpu_energy_map = IsEnergySamplerRunning() ? attribute_cpu_windows(cpu_windows, busy_usage, socket_cpu_usage, system_usage) : unordered_map<string, cpu_energy>();
+    if (idle_attribution == IDLE_SEPARATE) {
+        record_measurements(CPU_usage_map, "Idle Energy", RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, max(0.0f, 1.0f - busy_usage), 0, 0, 0, 0, 0);
+    }
+    unordered_map<string, int> socket_rows;
+    const float socket_energy_share = idle_attribution == IDLE_SEPARATE && tick_cpu_energy.package > 0 ? tick_dynamic_energy.package / tick_cpu_energy.package : 1.0f;
+    for (int socket = 0; energy.sockets_count > 1 && socket < energy.sockets_count; socket++) {
+        const string name = "Socket " + to_string(socket) + " Total";
+        socket_rows[name] = socket;
+        record_measurements(CPU_usage_map, name, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, socket_cpu_usage[socket], 0, 0, 0, 0, 0);
+    }
+    const float dram_energy = energy.domains[ENERGY_DOMAIN_DRAM];
+    // PSYS already covers DRAM, it must not be counted twice.
+    const bool dram_in_package = IsEnergySourcePlatformUsed();
+
+    // DRAM energy is shared half by resident memory, half by I/O traffic (RAM only when the system
+    // did no I/O), against the system totals.
+    const double total_ram = static_cast<double>(RAM_usage_map["System Total"]);
+    const double total_io = static_cast<double>(net_up_usage_map["System Total"]) + net_down_usage_map["System Total"] + static_cast<double>(disk_read_usage_map["System Total"]) + static_cast<double>(disk_write_usage_map["System Total"]);
+
+    // The uncore energy the System Total row gets by CPU usage, shared again as overhead.
+    const float system_uncore = cpu_energy_map.contains("System Total") ? cpu_energy_map.at("System Total").uncore : attribute_cpu_energy(tick_cpu_energy, energy_seconds, 1.0f, total_process_count, total_process_count).uncore;
+
+    vector<process_record> records;
+    records.reserve(CPU_usage_map.size());
     for (const auto& process_name : CPU_usage_map | views::keys) {
         float process_cpu_usage = CPU_usage_map[process_name];
         SIZE_T process_ram = RAM_usage_map[process_name];
-        DWORD process_net_up = net_up_usage_map[process_name];
-        DWORD process_net_down = net_down_usage_map[process_name];
+        ULONGLONG process_net_up = net_up_usage_map[process_name];
+        ULONGLONG process_net_down = net_down_usage_map[process_name];
         ULONGLONG process_disk_read = disk_read_usage_map[process_name];
         ULONGLONG process_disk_write = disk_write_usage_map[process_name];
         float process_bandwidth_up = (process_net_up / 1000000.0f) / (process_data_gathering_duration * 1.0f);
@@ -188,31 +695,117 @@ void process_data(unordered_map<string, float>& CPU_usage_map, unordered_map<str
         const float milli_wh_conversion = 0.068f;
         float process_net_up_consumption = milli_wh_conversion * process_bandwidth_up;
         float process_net_down_consumption = milli_wh_conversion * process_bandwidth_down;
-        float process_cpu_consumption = static_cast<float>(energy_consumption) * process_cpu_usage;
+        cpu_energy process_cpu_energy = {};
+        const auto windowed_cpu_energy = cpu_energy_map.find(process_name);
+        if (windowed_cpu_energy != cpu_energy_map.end()) {
+            process_cpu_energy = windowed_cpu_energy->second;
+        }
+        else if (process_name == "CPU Energy") {
+            process_cpu_energy = tick_cpu_energy;
+        }
+        else if (process_name == "Idle Energy") {
+            process_cpu_energy = tick_idle_energy;
+        }
+        else if (socket_rows.contains(process_name)) {
+            // Like the other totals, without the idle energy when it is reported separately.
+            process_cpu_energy.package = energy.sockets[socket_rows[process_name]] * socket_energy_share;
+        }
+        else {
+            const float cpu_share = get_cpu_share(energy, process_cpu_usage, busy_usage, socket_usage_map[process_name], system_usage);
+            process_cpu_energy = attribute_cpu_energy(tick_cpu_energy, energy_seconds, cpu_share, process_name_count_map[process_name], total_process_count);
+        }
+        const double process_io = static_cast<double>(process_net_up) + process_net_down + static_cast<double>(process_disk_read) + static_cast<double>(process_disk_write);
+        if (process_name != "CPU Energy" && process_name != "Idle Energy" && !socket_rows.contains(process_name)) {
+            const float process_uncore = system_uncore * get_overhead_share(process_cpu_usage, busy_usage, static_cast<double>(process_ram), total_ram, process_io, total_io);
+            process_cpu_energy.package += process_uncore - process_cpu_energy.uncore;
+            process_cpu_energy.uncore = process_uncore;
+        }
+        float process_cpu_consumption = process_cpu_energy.package;
+        float process_core_consumption = process_cpu_energy.core;
+        float process_gpu_consumption = process_cpu_energy.gpu;
+        float process_uncore_consumption = process_cpu_energy.uncore;
+        const double ram_share = total_ram > 0 ? static_cast<double>(process_ram) / total_ram : 0.0;
+        const double dram_share = total_io > 0 ? 0.5 * ram_share + 0.5 * (process_io / total_io) : ram_share;
+        float process_dram_consumption = static_cast<float>(dram_energy * dram_share);
         process_cpu_usage *= 100.0f;
         float process_disk_read_speed = (process_disk_read / 1000000.0f) / (1.0f * process_data_gathering_duration);
         float process_disk_write_speed = (process_disk_write / 1000000.0f) / (1.0f * process_data_gathering_duration);
         float process_disk_read_consumption = (process_disk_read_speed * disk_r_cost) / 3600.0f;
         float process_disk_write_consumption = (process_disk_write_speed * disk_w_cost) / 3600.0f;
         float sum_consumption = process_disk_read_consumption + process_disk_write_consumption + process_net_up_consumption + process_net_down_consumption + process_cpu_consumption;
-        string data = to_string(time(nullptr)) + ";" + process_name + ";" + to_string(process_cpu_usage) + ";" + to_string(process_cpu_consumption) + ";" + to_string(process_bandwidth_up) + ";" + to_string(process_net_up_consumption) + ";" + to_string(process_bandwidth_down) + ";" + to_string(process_net_down_consumption) + ";" + to_string(process_disk_read_speed) + ";" + to_string(process_disk_write_speed) + ";" + to_string(process_disk_read_consumption) + ";" + to_string(process_disk_write_consumption) + ";" + to_string(process_ram) + ";" + to_string(sum_consumption) + "\n";
-        send_data_to_output(data, std_output);
+        if (!dram_in_package) {
+            sum_consumption += process_dram_consumption;
+        }
+        records.push_back({ process_name, intern_process_name(process_name), aggregate_names.contains(process_name) || socket_rows.contains(process_name), process_cpu_usage, process_cpu_consumption, process_bandwidth_up, process_net_up_consumption, process_bandwidth_down, process_net_down_consumption, process_disk_read_speed, process_disk_write_speed, process_disk_read_consumption, process_disk_write_consumption, process_ram, sum_consumption, process_core_consumption, process_gpu_consumption, process_uncore_consumption, process_dram_consumption, process_net_up, process_net_down, process_disk_read, process_disk_write });
+    }
+
+    push_rollups(records, timestamp, process_data_gathering_duration);
+
+    if (top_count > 0) {
+        process_record other = {};
+        other.name = "Other";
+        other.name_id = intern_process_name(other.name);
+        other.aggregate = true;
+        keep_top_records(records, top_count, top_column, other);
+    }
+
+    if (delta_epsilon > 0) {
+        write_delta_records(records, timestamp, std_output);
+    }
+    else {
+        for (const auto& record : records) {
+            send_data_to_output(format_record(record, timestamp), std_output);
+        }
+    }
+    publish_metrics(records);
+    publish_live_snapshot(records, timestamp);
+    publish_stream_tick(records, timestamp);
+
+    // Names gone for an hour are evicted and their IDs given to new names, drop what was kept by ID.
+    for (const UINT32 name_id : evict_process_names(timestamp)) {
+        if (name_id < last_written_records.size()) {
+            last_written_records[name_id] = {};
+        }
+        forget_live_snapshot_name(name_id);
+    }
+}
+
+/*
+ * Starts the CPU and disk counters of every running process, and the system CPU usage, from their
+ * current values, so that the first tick reports the usage of its own window rather than nothing
+ * (or the whole downtime of a restart).
+ */
+void prime_process_counters() {
+    DWORD all_processes_pids[1024], returned_processes_count;
+    if (!EnumProcesses(all_processes_pids, sizeof(all_processes_pids), &returned_processes_count)) {
+        return;
+    }
+    const DWORD processes_count = returned_processes_count / sizeof(DWORD);
+    for (unsigned int i = 0; i < processes_count; i++) {
+        const DWORD pid = all_processes_pids[i];
+        const HANDLE process_handle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid);
+        get_process_cpu_usage(pid, process_handle);
+        rebase_disk_counters(pid);
+        if (process_handle != nullptr) {
+            CloseHandle(process_handle);
+        }
     }
+    get_system_cpu_usage();
 }
 
 void record_measurements(
     std::unordered_map<std::string, float>& cpu_usage_map,
     const std::string& name,
     std::unordered_map<std::string, SIZE_T>& ram_usage_map,
-    std::unordered_map<std::string, DWORD>& net_up_usage_map,
-    std::unordered_map<std::string, DWORD>& net_down_usage_map,
+    std::unordered_map<std::string, ULONGLONG>& net_up_usage_map,
+    std::unordered_map<std::string, ULONGLONG>& net_down_usage_map,
     std::unordered_map<std::string, ULONGLONG>& disk_read_usage_map,
     std::unordered_map<std::string, ULONGLONG>& disk_write_usage_map,
     std::unordered_map<std::string, int>& process_name_count_map,
     const float process_cpu_usage,
     const SIZE_T& process_ram,
-    const DWORD& process_net_up,
-    const DWORD& process_net_down,
+    const ULONGLONG& process_net_up,
+    const ULONGLONG& process_net_down,
     const ULONGLONG& process_disk_read,
     const ULONGLONG& process_disk_write)
 {
@@ -234,18 +827,57 @@ void record_measurements(
     process_name_count_map[name] += 1;
 }
 
-int start_demeter(const int loop_interval, bool console, bool watchdog, bool localloop, bool std_output, float disk_r_cost, float disk_w_cost, bool force_use_platform, bool calibrate) {
-    initialize_demeter(console, watchdog, localloop, std_output, force_use_platform, disk_r_cost, disk_w_cost);
+int start_demeter(const int loop_interval, bool console, bool watchdog, bool localloop, bool std_output, float disk_r_cost, float disk_w_cost, bool force_use_platform, bool calibrate, int metrics_port, bool live_snapshot, const string& stream_socket, const string& power_trace, const string& power_trace_markers, const string& state_file) {
+    initialize_demeter(console, watchdog, localloop, std_output, force_use_platform, disk_r_cost, disk_w_cost, metrics_port, live_snapshot, stream_socket);
     setup_signal_handlers();
 
     int current_day = -1;
 
-    if (calibrate)
+    // The sampler keeps twice the interval, so that a slow tick still finds its whole window.
+    const bool energy_sampler = StartEnergySampler(static_cast<UINT64>(loop_interval) * 2 + 10);
+    UINT64 energy_window_start = EnergySamplerNow();
+    if (!power_trace.empty() && !start_power_trace(power_trace, power_trace_markers)) {
+        spdlog::error("Failed to start the power trace");
+    }
+
+    // The idle baseline of the previous run spares the calibration until it is older than
+    // --calibration-max-age (the machine may have changed: drivers, firmware, background services).
+    state_file_path = state_file;
+    energy_state restored_energy = {};
+    if (!state_file_path.empty() && load_state_file(state_file_path, &restored_energy) && restored_energy.calibrated) {
+        constexpr UINT64 file_time_per_day = 864000000000ULL; // 100 ns units.
+        const UINT64 now = get_file_time_now();
+        const UINT64 age_days = now > restored_energy.calibration_time ? (now - restored_energy.calibration_time) / file_time_per_day : 0;
+        if (calibrate && age_days >= static_cast<UINT64>(max(idle_baseline_max_age_days, 0))) {
+            spdlog::info("Restored idle baseline measured {} day(s) ago, measuring it again.", age_days);
+        }
+        else {
+            idle_baseline_watts = restored_energy.idle_baseline_watts;
+            idle_baseline_time = restored_energy.calibration_time;
+            idle_baseline_calibrated = true;
+            spdlog::info("Idle baseline restored: {:.2f} W, measured {} day(s) ago", idle_baseline_watts, age_days);
+        }
+    }
+
+    if (!calibrate && !idle_baseline_calibrated) {
+        spdlog::warn("Calibration disabled and no idle baseline restored: all the package energy is counted as dynamic, Idle Energy reads 0.");
+    }
+    if (calibrate && !idle_baseline_calibrated)
     {
         spdlog::info("Calibrating energy probe...");
-        ReadEnergyConsumption();
-        Sleep(static_cast<long long>(loop_interval) * 1000);
+        idle_baseline_watts = measure_idle_baseline(loop_interval, energy_sampler);
+        idle_baseline_time = get_file_time_now();
+        idle_baseline_calibrated = true;
+        spdlog::info("Idle baseline: {:.2f} W", idle_baseline_watts);
+        save_demeter_state();
+    }
+    else if (!energy_sampler) {
+        // The first reading only starts the counters, the first tick gets the next one.
+        energy_reading energy;
+        ReadEnergySource(&energy);
     }
+    prime_process_counters();
+    energy_window_start = EnergySamplerNow();
 
     spdlog::info("Started with interval {} second(s).", loop_interval);
     while (true) {
@@ -253,7 +885,6 @@ int start_demeter(const int loop_interval, bool console, bool watchdog, bool loc
             spdlog::warn("Watchdog triggered at {}, DEMETER under lockdown for 1 minute", time(nullptr));
             Sleep(60000);
         }
-        float energy_consumption = ReadEnergyConsumption();
         time_t process_data_loop_start = time(nullptr);
         const tm* local_time = localtime(&process_data_loop_start);
         int today = local_time->tm_mday;
@@ -271,18 +902,35 @@ int start_demeter(const int loop_interval, bool console, bool watchdog, bool loc
 
         unordered_map<string, float> CPU_usage_map;
         unordered_map<string, SIZE_T> RAM_usage_map;
-        unordered_map<string, DWORD> net_up_usage_map;
-        unordered_map<string, DWORD> net_down_usage_map;
+        unordered_map<string, ULONGLONG> net_up_usage_map;
+        unordered_map<string, ULONGLONG> net_down_usage_map;
         unordered_map<string, ULONGLONG> disk_read_usage_map;
         unordered_map<string, ULONGLONG> disk_write_usage_map;
         unordered_map<string, int> process_name_count_map;
+        vector<process_cpu_window> cpu_windows;
 
-        collect_data(CPU_usage_map, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map);
+        collect_data(CPU_usage_map, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, cpu_windows);
+        float socket_cpu_usage[ENERGY_MAX_SOCKETS] = {};
+        get_socket_cpu_usage(socket_cpu_usage);
+
+        // Read once every process was measured, so that the tick window covers every process window.
+        energy_reading energy;
+        const UINT64 energy_window_begin = energy_window_start;
+        energy_window_start = EnergySamplerNow();
+        if (energy_sampler) {
+            ReadEnergyBetween(energy_window_begin, energy_window_start, &energy);
+        }
+        else {
+            ReadEnergySource(&energy);
+        }
+        const double energy_seconds = static_cast<double>(energy_window_start - energy_window_begin) / 1000000000.0;
         time_t process_data_gathering_end = time(nullptr);
         time_t process_data_gathering_duration = (process_data_gathering_end - process_data_loop_start);
         process_data_gathering_duration = process_data_gathering_duration < loop_interval ? loop_interval : process_data_gathering_duration;
 
-        process_data(CPU_usage_map, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, energy_consumption, disk_r_cost, disk_w_cost, std_output, process_data_gathering_duration);
+        const time_t tick_timestamp = time(nullptr);
+        mark_power_trace_tick(energy_window_begin, energy_window_start, tick_timestamp);
+        process_data(CPU_usage_map, RAM_usage_map, net_up_usage_map, net_down_usage_map, disk_read_usage_map, disk_write_usage_map, process_name_count_map, cpu_windows, energy, energy_seconds, socket_cpu_usage, disk_r_cost, disk_w_cost, std_output, process_data_gathering_duration, tick_timestamp);
 
         spdlog::debug("Logged");
         time_t process_data_loop_end = time(nullptr);
@@ -310,23 +958,118 @@ int main(const int argc, char* argv[]) {
         ("drcost", "Sets the disc reading cost (mW/MB)", cxxopts::value<float>()->default_value("0.78f"))
         ("dwcost", "Sets disk write cost (mW/MB)", cxxopts::value<float>()->default_value("0.98f"))
         ("l,no-loopbackcap", "Disables local loop packet capture")
+        ("capture-exclude", "Traffic not captured, as a BPF expression (e.g. \"port 445 or net 10.0.0.0/8\")", cxxopts::value<string>()->default_value(""))
         ("stdoutput", "Redirects data writing to the console")
         ("use-platform", "Force the use of the MSR_PLATFORM_ENERGY_COUNTER register")
+        ("power-trace", "Writes every energy sample to the binary file <path>, see PowerTrace.cpp for the format", cxxopts::value<string>()->default_value(""))
+        ("power-trace-rate", "Energy sampling rate in Hz while tracing", cxxopts::value<int>()->default_value("1000"))
+        ("power-trace-markers", "Timestamps in the trace every line received on the Unix domain socket <path>", cxxopts::value<string>()->default_value(""))
+        ("power-model", "Power model profile used when the energy counters cannot be read", cxxopts::value<string>()->default_value(POWER_MODEL_DEFAULT_PROFILE))
+        ("calibrate-model", "Fits the power model against the energy counters, loading the CPU in steps of <seconds>, then exits", cxxopts::value<int>())
+        ("energy-sample-rate", "Reads the energy counters <hz> times per second in the background (0 reads them once per interval)", cxxopts::value<int>()->default_value("20"))
+        ("metrics-port", "Serves the last measurements as OpenMetrics on 127.0.0.1:<port> (0 disables)", cxxopts::value<int>()->default_value("0"))
+        ("metrics-max-series", "Maximum number of processes exported, the others are folded into \"other\"", cxxopts::value<size_t>()->default_value("200"))
+        ("live-snapshot", "Publishes the last measurements in a shared memory segment for local readers")
+        ("stream-socket", "Streams every measurement to the subscribers of the Unix domain socket <path>", cxxopts::value<string>()->default_value(""))
+        ("stream-max-pending", "Ticks queued per stream subscriber before the oldest is dropped", cxxopts::value<size_t>()->default_value("4"))
+        ("delta-epsilon", "Only writes rows with a value that changed by more than the fraction <epsilon> since last written (0 writes every row)", cxxopts::value<float>()->default_value("0"))
+        ("keyframe-interval", "Ticks between two keyframes holding every row, in delta mode", cxxopts::value<int>()->default_value("60"))
+        ("top", "Only writes the <K> heaviest processes of each measurement, the others are summed in \"Other\" (0 writes every process)", cxxopts::value<size_t>()->default_value("0"))
+        ("top-by", "Column ranking the processes for --top (CPU, CPUC, NetUp, NetUpC, NetDown, NetDownC, DiskR, DiskW, DiskRC, DiskWC, RAM, SumC, CoreC, GpuC, UncoreC, DramC)", cxxopts::value<string>()->default_value("SumC"))
+        ("idle-policy", "Attribution of the idle baseline energy: separate (\"Idle Energy\" row), share (by CPU share) or even (evenly per process)", cxxopts::value<string>()->default_value("separate"))
+        ("state-file", "Keeps the calibration in <path> across restarts (disabled by default)", cxxopts::value<string>()->default_value(""))
+        ("calibration-max-age", "Days a restored idle baseline is reused before the calibration runs again (0 runs it at every start)", cxxopts::value<int>()->default_value("30"))
+        ("rollups", "Writes per minute and per hour rollups of every process alongside the measurements")
+        ("bench-snapshot", "Benchmarks live snapshot reads under concurrent writes with <rows> rows, then exits", cxxopts::value<size_t>())
+        ("bench-parser", "Benchmarks the packet parser over the packets of the pcap file <path>, then exits", cxxopts::value<string>())
+        ("record-ports", "Records the owners of the TCP and UDP sockets and the interface addresses to <path> for --replay-ports, then exits", cxxopts::value<string>())
+        ("replay", "Replays the packets of the pcap or pcapng <files> (comma separated) through the network attribution, then exits", cxxopts::value<vector<string>>())
+        ("replay-ports", "Socket owners recorded with --record-ports, used by --replay", cxxopts::value<string>()->default_value(""))
+        ("replay-timing", "Replays the packets at their original timing instead of as fast as possible")
         ("h,help", "Displays help");
     const auto result = options.parse(argc, argv);
     if (result.count("help")) {
         printf("%s\n", options.help().c_str());
         exit(0);
     }
+    if (result.count("bench-snapshot")) {
+        run_live_snapshot_benchmark(result["bench-snapshot"].as<size_t>(), 5000);
+        exit(0);
+    }
+    if (result.count("bench-parser")) {
+        if (!load_npcap_dlls()) {
+            spdlog::critical("Couldn't load Npcap");
+            exit(1);
+        }
+        run_packet_parser_benchmark(result["bench-parser"].as<string>());
+        exit(0);
+    }
+    if (result.count("record-ports")) {
+        if (!load_npcap_dlls()) {
+            spdlog::critical("Couldn't load Npcap");
+            exit(1);
+        }
+        exit(record_port_snapshot(result["record-ports"].as<string>()) ? 0 : 1);
+    }
+    if (result.count("replay")) {
+        if (result["replay-ports"].as<string>().empty()) {
+            spdlog::critical("--replay needs the socket owners of --replay-ports");
+            exit(1);
+        }
+        if (!load_npcap_dlls()) {
+            spdlog::critical("Couldn't load Npcap");
+            exit(1);
+        }
+        run_packet_replay(result["replay"].as<vector<string>>(), result["replay-ports"].as<string>(), result["replay-timing"].as<bool>());
+        exit(0);
+    }
+    SetPowerModelProfile(result["power-model"].as<string>());
+    if (result.count("calibrate-model")) {
+        // The model is fitted against real counters, it cannot stand in for them here.
+        if (LoadEnergySource(result["use-platform"].as<bool>(), false)) {
+            spdlog::critical("Couldn't load the energy source ({}), the power model needs it for calibration.", GetEnergySource()->name);
+            exit(1);
+        }
+        const int status = CalibratePowerModel(max(1, result["calibrate-model"].as<int>()));
+        CloseEnergySource();
+        exit(status);
+    }
     const bool console = !result["hide-console"].as<bool>();
     const bool watchdog = !result["no-watchdog"].as<bool>();
     const int interval = result["interval"].as<int>();
     const bool localloop = !result["no-loopbackcap"].as<bool>();
+    set_capture_exclude(result["capture-exclude"].as<string>());
     const bool force_use_platform = result["use-platform"].as<bool>();
     const bool std_output = result["stdoutput"].as<bool>();
     const float disk_r_cost = result["drcost"].as<float>();
     const float disk_w_cost = result["dwcost"].as<float>();
     const bool calibrate = !result["no-calibrate"].as<bool>();
+    const string power_trace = result["power-trace"].as<string>();
+    const string power_trace_markers = result["power-trace-markers"].as<string>();
+    const string state_file = result["state-file"].as<string>();
+    SetEnergySamplerRate(power_trace.empty() ? result["energy-sample-rate"].as<int>() : result["power-trace-rate"].as<int>());
+    const int metrics_port = result["metrics-port"].as<int>();
+    set_metrics_series_limit(result["metrics-max-series"].as<size_t>());
+    const bool live_snapshot = result["live-snapshot"].as<bool>();
+    const string stream_socket = result["stream-socket"].as<string>();
+    set_stream_max_pending_ticks(result["stream-max-pending"].as<size_t>());
+    set_delta_output(result["delta-epsilon"].as<float>(), result["keyframe-interval"].as<int>());
+    record_column top_column;
+    if (!parse_record_column(result["top-by"].as<string>(), &top_column)) {
+        printf("Unknown column for --top-by: %s\n", result["top-by"].as<string>().c_str());
+        exit(1);
+    }
+    set_top_output(result["top"].as<size_t>(), top_column);
+    idle_policy policy;
+    if (!parse_idle_policy(result["idle-policy"].as<string>(), &policy)) {
+        printf("Unknown idle policy: %s\n", result["idle-policy"].as<string>().c_str());
+        exit(1);
+    }
+    set_idle_policy(policy);
+    set_calibration_max_age(result["calibration-max-age"].as<int>());
+    if (result["rollups"].as<bool>()) {
+        enable_rollups();
+    }
 
-    return start_demeter(interval, console, watchdog, localloop, std_output, disk_r_cost, disk_w_cost, force_use_platform, calibrate);
+    return start_demeter(interval, console, watchdog, localloop, std_output, disk_r_cost, disk_w_cost, force_use_platform, calibrate, metrics_port, live_snapshot, stream_socket, power_trace, power_trace_markers, state_file);
 }
@@ -21,14 +21,14 @@ void record_measurements(
 	std::unordered_map<std::string, float>& cpu_usage_map,
 	const std::string& name,
 	cxxopts::NameHashMap& ram_usage_map,
-	std::unordered_map<std::string, DWORD>& net_up_usage_map,
-	std::unordered_map<std::string, DWORD>& net_down_usage_map,
+	std::unordered_map<std::string, ULONGLONG>& net_up_usage_map,
+	std::unordered_map<std::string, ULONGLONG>& net_down_usage_map,
 	cxxopts::NameHashMap& disk_read_usage_map,
 	cxxopts::NameHashMap& disk_write_usage_map,
 	std::unordered_map<std::string, int>& process_name_count_map,
 	float process_cpu_usage,
 	const SIZE_T& process_ram,
-	const DWORD& process_net_up,
-	const DWORD& process_net_down,
+	const ULONGLONG& process_net_up,
+	const ULONGLONG& process_net_down,
 	const ULONGLONG& process_disk_read,
 	const ULONGLONG& process_disk_write);
\ No newline at end of file
@@ -77,4 +77,22 @@ int get_disk_stats(const DWORD pid, const HANDLE process_handle, ULONGLONG* byte
 	}
 	free(pioc);
 	return 0;
+}
+
+/*
+ * Starts the byte counts of a running process from its current counters, so that its first delta
+ * covers the time since this call rather than being 0 (see prime_process_counters).
+ */
+void rebase_disk_counters(const DWORD pid) {
+	const HANDLE process_handle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+	if (process_handle == nullptr) {
+		return;
+	}
+
+	IO_COUNTERS counters;
+	if (GetProcessIoCounters(process_handle, &counters)) {
+		bytes_read_map[pid] = counters.ReadTransferCount;
+		bytes_write_map[pid] = counters.WriteTransferCount;
+	}
+	CloseHandle(process_handle);
 }
\ No newline at end of file
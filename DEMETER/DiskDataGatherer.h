@@ -27,4 +27,6 @@ using namespace std;
 
 int get_disk_stats(DWORD, HANDLE, ULONGLONG*, ULONGLONG*);
 
-void get_whole_disk_stats(DWORD*, DWORD*);
\ No newline at end of file
+void get_whole_disk_stats(DWORD*, DWORD*);
+
+void rebase_disk_counters(DWORD);
\ No newline at end of file
@@ -16,8 +16,10 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include "EnergyGatherer.h"
+#include <intrin.h>
 #include <map>
 #include "DemeterLogger.h"
+#include "SocketDataGatherer.h"
 
 const DWORD RAPL_CTL_CODE = CTL_CODE(
     FILE_DEVICE_UNKNOWN, 
@@ -29,10 +31,72 @@ const DWORD RAPL_CTL_CODE = CTL_CODE(
 HANDLE driver_handle;
 
 float power_unit, energy_unit, time_unit;
+static float dram_energy_unit;
 static std::map<UINT64, UINT32> total_energy_consumed;
 time_t last_sample_time;
 bool use_platform_register = false;
 
+static const UINT64 energy_domain_msrs[ENERGY_DOMAIN_COUNT] = {
+    MSR_PKG_ENERGY_STATUS,
+    MSR_PP0_ENERGY_STATUS,
+    MSR_PP1_ENERGY_STATUS,
+    MSR_DRAM_ENERGY_STATUS,
+    MSR_PLATFORM_ENERGY_STATUS
+};
+static const char* energy_domain_names[ENERGY_DOMAIN_COUNT] = { "PKG", "PP0", "PP1", "DRAM", "PSYS" };
+static bool energy_domain_available[ENERGY_DOMAIN_COUNT];
+
+// Intel server models (family 6) whose DRAM counter counts in 2^-16 J (15.3 uJ) whatever the
+// energy unit of MSR_RAPL_POWER_UNIT: Haswell-EP and later Xeons, Broadwell-DE, Xeon Phi and the
+// Atom servers.
+static const int fixed_dram_unit_models[] = {
+    0x3F, // Haswell-EP
+    0x4F, // Broadwell-EP
+    0x56, // Broadwell-DE
+    0x55, // Skylake-SP, Cascade Lake, Cooper Lake
+    0x57, // Knights Landing
+    0x85, // Knights Mill
+    0x6A, // Ice Lake-SP
+    0x6C, // Ice Lake-D
+    0x8F, // Sapphire Rapids
+    0xCF, // Emerald Rapids
+    0xAD, // Granite Rapids
+    0xAE, // Granite Rapids-D
+    0xAF, // Sierra Forest
+};
+
+/**
+ * @brief Tells whether the DRAM counter of this CPU has its own fixed energy unit.
+ *
+ * @return Returns true on the Intel server models listed in fixed_dram_unit_models.
+ */
+bool hasFixedDramEnergyUnit()
+{
+    int registers[4];
+    __cpuid(registers, 0);
+    const bool intel = registers[1] == 0x756E6547 && registers[3] == 0x49656E69 && registers[2] == 0x6C65746E; // "GenuineIntel"
+    if (!intel)
+    {
+        return false;
+    }
+
+    __cpuid(registers, 1);
+    const int family = (registers[0] >> 8) & 0xF;
+    const int model = ((registers[0] >> 4) & 0xF) | ((registers[0] >> 12) & 0xF0);
+    if (family != 6)
+    {
+        return false;
+    }
+    for (const int fixed_model : fixed_dram_unit_models)
+    {
+        if (model == fixed_model)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * @brief Reads data from the driver.
  *
@@ -100,6 +164,27 @@ void loadEnergyConversionUnits()
     constexpr UINT64 power_mask = 0xF;
     const UINT64 power_val = res & power_mask;
     power_unit = 1.0f / (pow(2.0f, static_cast<float>(power_val)));
+
+    // DRAM Units
+    dram_energy_unit = hasFixedDramEnergyUnit() ? 1.0f / 65536.0f : energy_unit;
+}
+
+/**
+ * @brief Detects the RAPL domains available on this machine.
+ *
+ * A domain is available when its MSR can be read and its counter is running (a counter stuck at 0
+ * means the domain is not implemented by the CPU).
+ */
+void probeEnergyDomains()
+{
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        UINT64 res = 0;
+        DWORD bytes_returned;
+        energy_domain_available[domain] = readData(energy_domain_msrs[domain], &res, &bytes_returned)
+            && (res & 0xFFFFFFFF) != 0;
+        spdlog::info("RAPL domain {}: {}", energy_domain_names[domain], energy_domain_available[domain] ? "available" : "unavailable");
+    }
 }
 
 /**
@@ -134,6 +219,8 @@ int LoadScaphandreDriver(BOOL force_use_platform)
     }
 
     loadEnergyConversionUnits();
+    probeEnergyDomains();
+    init_socket_topology();
 
     if(force_use_platform)
     {
@@ -148,11 +235,14 @@ int LoadScaphandreDriver(BOOL force_use_platform)
  * @brief Reads energy consumption from the specified MSR.
  *
  * This function reads energy consumption from the specified Model Specific Register (MSR).
+ * The driver reads the MSR of the processor the calling thread runs on, the caller pins the thread
+ * to a socket to read that socket's counter.
  *
  * @param msr MSR to read energy consumption from.
+ * @param socket Socket the thread runs on, each socket keeps its own last counter value.
  * @return Returns the energy consumption in Joules.
  */
-float readEnergyConsumption(UINT64 msr)
+float readEnergyConsumption(UINT64 msr, int socket = 0)
 {
     if (driver_handle == NULL)
     {
@@ -169,18 +259,19 @@ float readEnergyConsumption(UINT64 msr)
         return-1.0f;
     }
 
-    if(total_energy_consumed.find(msr) == total_energy_consumed.end())
+    const UINT64 counter = static_cast<UINT64>(socket) << 32 | msr;
+    if(total_energy_consumed.find(counter) == total_energy_consumed.end())
     {
-        total_energy_consumed[msr] = 0;
+        total_energy_consumed[counter] = 0;
     }
-    const UINT32 old_consumption = total_energy_consumed[msr];
+    const UINT32 old_consumption = total_energy_consumed[counter];
 
     // Get new cumulated energy consumption
     const UINT32 new_consumption = res & 0xFFFFFFFF;
     const UINT32 delta_consumption = new_consumption - old_consumption;
-    total_energy_consumed[msr] = new_consumption;
+    total_energy_consumed[counter] = new_consumption;
 
-    const float energy_consumption = static_cast<float>(delta_consumption) * energy_unit;
+    const float energy_consumption = static_cast<float>(delta_consumption) * (msr == MSR_DRAM_ENERGY_STATUS ? dram_energy_unit : energy_unit);
 
     return energy_consumption;
 }
@@ -243,6 +334,85 @@ float ReadEnergyConsumption(BOOL update_time)
     return energy_consumption / 3.6f;
 }
 
+/**
+ * @brief Reads the energy consumption of every available RAPL domain.
+ *
+ * Every domain is read back to back in this single call, so that all of them cover the same
+ * window. The driver only exposes one MSR per request, hence one request per domain.
+ *
+ * On machines with several sockets, the thread visits every socket and the domains of the sockets
+ * are summed, PKG being also reported per socket. PSYS covers the whole platform, it is only read
+ * once.
+ *
+ * @param reading Receives the energy consumed by each domain since the previous reading, in
+ * milliwatt-hour.
+ * @param update_time Boolean flag indicating whether to update the last sample time.
+ * @return Returns TRUE if the package (or platform) domain could be read, otherwise FALSE.
+ */
+BOOL ReadEnergyDomains(energy_reading* reading, BOOL update_time)
+{
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        reading->domains[domain] = 0.0f;
+        reading->available[domain] = false;
+    }
+    const int sockets_count = get_sockets_count() > 1 ? get_sockets_count() : 1;
+    reading->sockets_count = get_sockets_count() > 1 ? sockets_count : 0;
+
+    for (int socket = 0; socket < sockets_count; socket++)
+    {
+        reading->sockets[socket] = 0.0f;
+        GROUP_AFFINITY previous_affinity;
+        if (sockets_count > 1 && !pin_thread_to_socket(socket, &previous_affinity))
+        {
+            continue;
+        }
+
+        for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+        {
+            if (!energy_domain_available[domain] || (domain == ENERGY_DOMAIN_PSYS && socket > 0))
+            {
+                continue;
+            }
+
+            const float energy_consumption = readEnergyConsumption(energy_domain_msrs[domain], socket);
+            if (energy_consumption <= -1.0f)
+            {
+                spdlog::error("Couldn't read {} energy consumption. See previous error.", energy_domain_names[domain]);
+                continue;
+            }
+
+            reading->domains[domain] += energy_consumption / 3.6f;
+            reading->available[domain] = true;
+            if (domain == ENERGY_DOMAIN_PKG)
+            {
+                reading->sockets[socket] = energy_consumption / 3.6f;
+            }
+        }
+
+        if (sockets_count > 1)
+        {
+            restore_thread_affinity(&previous_affinity);
+        }
+    }
+
+    const energy_domain package_domain = use_platform_register ? ENERGY_DOMAIN_PSYS : ENERGY_DOMAIN_PKG;
+    reading->package = reading->domains[package_domain];
+
+    if (update_time)
+    {
+        const time_t actual_time = time(nullptr);
+        last_sample_time = actual_time;
+    }
+
+    return reading->available[package_domain];
+}
+
+BOOL IsPlatformRegisterUsed()
+{
+    return use_platform_register;
+}
+
 /**
  * @brief Closes the Scaphandre driver.
  *
@@ -19,6 +19,8 @@
 
 #include <Windows.h>
 
+#include "EnergySource.h"
+
 
 // Intel MSRs
 constexpr UINT64 MSR_RAPL_POWER_UNIT = 0x606;
@@ -34,4 +36,8 @@ float ReadEnergyConsumption(UINT64, BOOL = true);
 
 float ReadEnergyConsumption(BOOL = true);
 
+BOOL ReadEnergyDomains(energy_reading*, BOOL = true);
+
+BOOL IsPlatformRegisterUsed();
+
 void CloseScaphandre();
\ No newline at end of file
@@ -0,0 +1,346 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the energy sampler: a thread reading the energy source at a fixed rate and
+ * accumulating every domain into 64-bit microjoule totals.
+ *
+ * The 32-bit RAPL counters wrap after a few minutes on high TDP parts, so a long interval can see
+ * several wraps between two readings of the main loop. Read every few tens of milliseconds, a
+ * counter wraps at most once between two samples, which the backends handle.
+ *
+ * The totals are kept in a ring of timestamped samples. ReadEnergyBetween interpolates the totals
+ * at both ends of a window without locking: each slot is protected by its own sequence, like the
+ * live snapshot segment, and a reader retries when the slot it read was rewritten meanwhile.
+ */
+#include "EnergySampler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <thread>
+
+#include "DemeterLogger.h"
+
+typedef struct energy_sample_slot {
+    std::atomic<uint64_t> sequence; // Index + 1 of the sample held, 0 while it is written.
+    energy_totals totals;
+} energy_sample_slot;
+
+static int sample_rate = 20;
+static std::unique_ptr<energy_sample_slot[]> samples;
+static uint64_t samples_capacity = 0; // Power of 2.
+static std::atomic<uint64_t> samples_count = 0;
+static std::atomic<bool> sampler_running = false;
+static std::thread sampler_thread;
+
+/**
+ * @brief Sets the sampling rate in Hz, 0 disables the sampler.
+ *
+ * Sleeps are bounded by the timer resolution of the system (about 15.6 ms by default on Windows),
+ * so rates above 64 Hz are not reached exactly.
+ */
+void SetEnergySamplerRate(const int rate)
+{
+    sample_rate = rate;
+}
+
+int GetEnergySamplerRate()
+{
+    return sample_rate;
+}
+
+/**
+ * @brief Returns the clock of the samples, in nanoseconds.
+ */
+uint64_t EnergySamplerNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void publishSample(const energy_totals& totals)
+{
+    const uint64_t index = samples_count.load(std::memory_order_relaxed);
+    energy_sample_slot& slot = samples[index & (samples_capacity - 1)];
+
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.totals = totals;
+    slot.sequence.store(index + 1, std::memory_order_release);
+
+    samples_count.store(index + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Copies the sample of the given index.
+ *
+ * @return Returns false if the slot does not hold this sample anymore, or was rewritten during the
+ * copy.
+ */
+static bool loadSample(const uint64_t index, energy_totals* totals)
+{
+    const energy_sample_slot& slot = samples[index & (samples_capacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != index + 1)
+    {
+        return false;
+    }
+    *totals = slot.totals;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == index + 1;
+}
+
+/**
+ * @brief Interpolates the totals at the given time between the two samples around it.
+ *
+ * Times outside of the ring are clamped to its oldest or newest sample.
+ */
+static bool totalsAt(const uint64_t time_ns, energy_totals* totals)
+{
+    const uint64_t count = samples_count.load(std::memory_order_acquire);
+    if (count == 0)
+    {
+        return false;
+    }
+
+    // The oldest slot is left out, the next sample may already be overwriting it.
+    uint64_t low = count > samples_capacity ? count - samples_capacity + 1 : 0;
+    uint64_t high = count - 1;
+    energy_totals before, after;
+    if (!loadSample(low, &before) || !loadSample(high, &after))
+    {
+        return false;
+    }
+    if (time_ns <= before.time_ns)
+    {
+        *totals = before;
+        return true;
+    }
+    if (time_ns >= after.time_ns)
+    {
+        *totals = after;
+        return true;
+    }
+
+    // Sample low is at or before time_ns, sample high is after it.
+    while (high - low > 1)
+    {
+        const uint64_t middle = low + (high - low) / 2;
+        energy_totals sample;
+        if (!loadSample(middle, &sample))
+        {
+            return false;
+        }
+        if (sample.time_ns <= time_ns)
+        {
+            low = middle;
+            before = sample;
+        }
+        else
+        {
+            high = middle;
+            after = sample;
+        }
+    }
+
+    const double fraction = static_cast<double>(time_ns - before.time_ns) / static_cast<double>(after.time_ns - before.time_ns);
+    totals->time_ns = time_ns;
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        const uint64_t delta_uj = after.energy_uj[domain] - before.energy_uj[domain];
+        totals->energy_uj[domain] = before.energy_uj[domain] + static_cast<uint64_t>(llround(static_cast<double>(delta_uj) * fraction));
+        totals->available[domain] = after.available[domain];
+    }
+    for (int socket = 0; socket < ENERGY_MAX_SOCKETS; socket++)
+    {
+        const uint64_t delta_uj = after.socket_energy_uj[socket] - before.socket_energy_uj[socket];
+        totals->socket_energy_uj[socket] = before.socket_energy_uj[socket] + static_cast<uint64_t>(llround(static_cast<double>(delta_uj) * fraction));
+    }
+    totals->sockets_count = after.sockets_count;
+    return true;
+}
+
+/**
+ * @brief Returns the number of samples taken since the sampler started.
+ */
+uint64_t GetEnergySampleCount()
+{
+    return samples_count.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Copies the sample of the given index, for consumers following the ring (see PowerTrace).
+ *
+ * @return Returns false if the sample was not taken yet or was already overwritten.
+ */
+bool GetEnergySample(const uint64_t index, energy_totals* totals)
+{
+    return index < samples_count.load(std::memory_order_acquire) && loadSample(index, totals);
+}
+
+static uint64_t newestSampleTime()
+{
+    const uint64_t count = samples_count.load(std::memory_order_acquire);
+    energy_totals totals;
+    if (count == 0 || !loadSample(count - 1, &totals))
+    {
+        return 0;
+    }
+    return totals.time_ns;
+}
+
+static void samplerLoop()
+{
+    const auto period = std::chrono::nanoseconds(1000000000 / sample_rate);
+    energy_totals totals = {};
+    energy_reading reading;
+
+    // Discards what was consumed before the sampler started, every total starts at 0 from now.
+    ReadEnergySource(&reading, false);
+    totals.time_ns = EnergySamplerNow();
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        totals.available[domain] = reading.available[domain];
+    }
+    totals.sockets_count = reading.sockets_count;
+    publishSample(totals);
+
+    auto next_sample = std::chrono::steady_clock::now() + period;
+    while (sampler_running.load(std::memory_order_relaxed))
+    {
+        std::this_thread::sleep_until(next_sample);
+        next_sample += period;
+
+        // A failed domain keeps its total, the backend reports its energy on the next reading.
+        ReadEnergySource(&reading, false);
+        totals.time_ns = EnergySamplerNow();
+        for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+        {
+            if (reading.available[domain])
+            {
+                totals.energy_uj[domain] += static_cast<uint64_t>(llround(static_cast<double>(reading.domains[domain]) * 3600000.0));
+            }
+            totals.available[domain] = reading.available[domain];
+        }
+        for (int socket = 0; socket < reading.sockets_count; socket++)
+        {
+            totals.socket_energy_uj[socket] += static_cast<uint64_t>(llround(static_cast<double>(reading.sockets[socket]) * 3600000.0));
+        }
+        totals.sockets_count = reading.sockets_count;
+        publishSample(totals);
+
+        // Late by more than a period (suspended machine, overloaded system): restart from now.
+        const auto now = std::chrono::steady_clock::now();
+        if (now > next_sample)
+        {
+            next_sample = now + period;
+        }
+    }
+}
+
+/**
+ * @brief Starts the sampler thread. The energy source must be loaded.
+ *
+ * @param history_seconds Duration kept in the ring, windows older than that are clamped.
+ * @return Returns false if the sampler is disabled or already running.
+ */
+bool StartEnergySampler(const uint64_t history_seconds)
+{
+    if (sample_rate <= 0 || sampler_running.load())
+    {
+        return false;
+    }
+
+    uint64_t capacity = 2;
+    while (capacity < history_seconds * static_cast<uint64_t>(sample_rate))
+    {
+        capacity <<= 1;
+    }
+    samples = std::make_unique<energy_sample_slot[]>(capacity);
+    samples_capacity = capacity;
+    samples_count.store(0);
+
+    sampler_running.store(true);
+    sampler_thread = std::thread(samplerLoop);
+    spdlog::info("Energy sampler started at {} Hz, {} samples kept.", sample_rate, capacity);
+    return true;
+}
+
+bool IsEnergySamplerRunning()
+{
+    return sampler_running.load();
+}
+
+/**
+ * @brief Reads the energy consumed by every domain between two times of EnergySamplerNow.
+ *
+ * Waits for a sample past the end of the window if there is none yet, at most a few periods.
+ *
+ * @param reading Receives the energy of each domain, in milliwatt-hour.
+ * @return Returns true if the package (or platform) domain is available.
+ */
+bool ReadEnergyBetween(const uint64_t begin_ns, const uint64_t end_ns, energy_reading* reading)
+{
+    *reading = {};
+    if (!sampler_running.load())
+    {
+        return false;
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(3000 / sample_rate + 10);
+    while (newestSampleTime() < end_ns && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (int attempt = 0; attempt < 8; attempt++)
+    {
+        energy_totals begin, end;
+        if (!totalsAt(begin_ns, &begin) || !totalsAt(end_ns, &end))
+        {
+            continue;
+        }
+
+        for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+        {
+            // 1 mWh = 3.6 J = 3600000 uJ.
+            reading->domains[domain] = static_cast<float>(static_cast<double>(end.energy_uj[domain] - begin.energy_uj[domain]) / 3600000.0);
+            reading->available[domain] = end.available[domain];
+        }
+        for (int socket = 0; socket < end.sockets_count; socket++)
+        {
+            reading->sockets[socket] = static_cast<float>(static_cast<double>(end.socket_energy_uj[socket] - begin.socket_energy_uj[socket]) / 3600000.0);
+        }
+        reading->sockets_count = end.sockets_count;
+        const energy_domain package_domain = IsEnergySourcePlatformUsed() ? ENERGY_DOMAIN_PSYS : ENERGY_DOMAIN_PKG;
+        reading->package = reading->domains[package_domain];
+        return reading->available[package_domain];
+    }
+
+    spdlog::error("Could not read the energy samples of the window.");
+    return false;
+}
+
+void StopEnergySampler()
+{
+    if (!sampler_running.load())
+    {
+        return;
+    }
+    sampler_running.store(false);
+    sampler_thread.join();
+}
\ No newline at end of file
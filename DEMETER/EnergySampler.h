@@ -0,0 +1,49 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstdint>
+
+#include "EnergySource.h"
+
+// Energy of every domain since the sampler started, in microjoule, at time_ns (EnergySamplerNow).
+typedef struct energy_totals {
+    uint64_t time_ns;
+    uint64_t energy_uj[ENERGY_DOMAIN_COUNT];
+    bool available[ENERGY_DOMAIN_COUNT];
+    uint64_t socket_energy_uj[ENERGY_MAX_SOCKETS]; // PKG of every socket.
+    int sockets_count;
+} energy_totals;
+
+void SetEnergySamplerRate(int);
+
+int GetEnergySamplerRate();
+
+bool StartEnergySampler(uint64_t);
+
+bool IsEnergySamplerRunning();
+
+uint64_t EnergySamplerNow();
+
+bool ReadEnergyBetween(uint64_t, uint64_t, energy_reading*);
+
+uint64_t GetEnergySampleCount();
+
+bool GetEnergySample(uint64_t, energy_totals*);
+
+void StopEnergySampler();
\ No newline at end of file
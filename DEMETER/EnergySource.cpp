@@ -0,0 +1,137 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "EnergySource.h"
+
+#ifdef _WIN32
+
+#include "EnergyGatherer.h"
+#include "PowerModel.h"
+#include "DemeterLogger.h"
+
+static int loadScaphandre(bool force_use_platform)
+{
+    return LoadScaphandreDriver(force_use_platform);
+}
+
+static bool readScaphandreDomains(energy_reading* reading, bool update_time)
+{
+    return ReadEnergyDomains(reading, update_time);
+}
+
+static bool isScaphandrePlatformUsed()
+{
+    return IsPlatformRegisterUsed();
+}
+
+static const energy_source hardware_source = {
+    "Scaphandre driver",
+    false,
+    loadScaphandre,
+    readScaphandreDomains,
+    isScaphandrePlatformUsed,
+    CloseScaphandre
+};
+
+// Used when the driver cannot be loaded (virtual machine, AMD CPU, driver not installed).
+static const energy_source fallback_source = {
+    "power model",
+    true,
+    LoadPowerModel,
+    ReadPowerModelDomains,
+    IsPowerModelPlatformUsed,
+    ClosePowerModel
+};
+
+static const energy_source* selected_source = &hardware_source;
+
+#elif defined(__linux__)
+
+#include "PowercapEnergy.h"
+
+static const energy_source hardware_source = {
+    "powercap",
+    false,
+    LoadPowercapZones,
+    ReadPowercapDomains,
+    IsPowercapPlatformUsed,
+    ClosePowercapZones
+};
+
+static const energy_source* selected_source = &hardware_source;
+
+#else
+#error "No energy source for this platform."
+#endif
+
+/**
+ * @brief Returns the energy source of this platform.
+ */
+const energy_source* GetEnergySource()
+{
+    return selected_source;
+}
+
+/**
+ * @brief Loads the energy source of this platform, or the power model when the hardware counters
+ * cannot be read and a model is available.
+ *
+ * @param force_use_platform Boolean flag indicating whether to force using the platform domain.
+ * @param allow_estimate Boolean flag indicating whether the power model may replace the counters.
+ * @return Returns 0 if successful, otherwise returns 1.
+ */
+int LoadEnergySource(bool force_use_platform, bool allow_estimate)
+{
+    selected_source = &hardware_source;
+    const int result = hardware_source.load(force_use_platform);
+#ifdef _WIN32
+    if (result != 0 && allow_estimate)
+    {
+        spdlog::warn("The {} cannot be loaded, the energy is estimated by the {}.", hardware_source.name, fallback_source.name);
+        selected_source = &fallback_source;
+        return fallback_source.load(force_use_platform);
+    }
+#else
+    (void)allow_estimate;
+#endif
+    return result;
+}
+
+/**
+ * @brief Reads the energy consumed by every domain since the previous reading.
+ *
+ * @param reading Receives the energy of each domain, in milliwatt-hour.
+ * @param update_time Boolean flag indicating whether to update the last sample time.
+ * @return Returns true if the package (or platform) domain could be read.
+ */
+bool ReadEnergySource(energy_reading* reading, bool update_time)
+{
+    return selected_source->read_domains(reading, update_time);
+}
+
+/**
+ * @brief Returns true when the package energy is read from the platform (PSYS) domain.
+ */
+bool IsEnergySourcePlatformUsed()
+{
+    return selected_source->is_platform_register_used();
+}
+
+void CloseEnergySource()
+{
+    selected_source->close();
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the energy source interface: the backend reading the RAPL counters of the
+ * machine. The Scaphandre driver (EnergyGatherer) is used on Windows, the powercap sysfs tree
+ * (PowercapEnergy) on Linux. On Windows, the power model (PowerModel) estimates the package energy
+ * when the driver cannot be loaded. This header must stay free of any platform dependency.
+ */
+#pragma once
+
+// RAPL domains, see energy_domain_msrs in EnergyGatherer.cpp.
+typedef enum energy_domain {
+    ENERGY_DOMAIN_PKG,
+    ENERGY_DOMAIN_PP0,
+    ENERGY_DOMAIN_PP1,
+    ENERGY_DOMAIN_DRAM,
+    ENERGY_DOMAIN_PSYS,
+    ENERGY_DOMAIN_COUNT
+} energy_domain;
+
+// Sockets whose package energy is read separately, the others are left out of the per-socket
+// energy (they are still counted in the domains).
+constexpr int ENERGY_MAX_SOCKETS = 8;
+
+// Energy consumed by every domain since the previous reading, in milliwatt-hour. A domain that is
+// not available on this machine reads 0.
+typedef struct energy_reading {
+    float domains[ENERGY_DOMAIN_COUNT];
+    bool available[ENERGY_DOMAIN_COUNT];
+    float package; // PKG, or PSYS when the platform register is forced.
+    float sockets[ENERGY_MAX_SOCKETS]; // PKG of every socket.
+    int sockets_count; // 0 when the source cannot tell the sockets apart.
+} energy_reading;
+
+typedef struct energy_source {
+    const char* name;
+    bool estimated; // Energy computed by a model rather than read from a counter.
+    int (*load)(bool force_use_platform); // Returns 0 if successful.
+    bool (*read_domains)(energy_reading*, bool update_time);
+    bool (*is_platform_register_used)();
+    void (*close)();
+} energy_source;
+
+const energy_source* GetEnergySource();
+
+int LoadEnergySource(bool = false, bool = true);
+
+bool ReadEnergySource(energy_reading*, bool = true);
+
+bool IsEnergySourcePlatformUsed();
+
+void CloseEnergySource();
\ No newline at end of file
@@ -0,0 +1,231 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the flow table: the bytes sent and received by each local socket, keyed by
+ * protocol and local and remote address and port, so that the traffic can be charged to the exact
+ * socket rather than to whoever owns the port number.
+ *
+ * The table is shared by every capture thread, without locks. It is open addressed with linear
+ * probing: a capture thread claims an empty slot with a CAS, writes the key and then publishes the
+ * tag of the key (its hash). Counting a known flow is two relaxed additions.
+ *
+ * The key of a slot is compared by the capture threads as a seqlock is read: its words are loaded,
+ * then the state is checked again, since the slot may have been freed and claimed by another flow
+ * meanwhile. The new owner writes the key only after its claim, so a compare that read any of the
+ * new words also sees the state change.
+ *
+ * Once per tick, the main thread takes the bytes of every flow (harvest_flow_table) and frees the
+ * flows that saw no packet for FLOW_IDLE_TICKS ticks. Freeing races with a capture thread counting
+ * into the same slot, both sides use a store then load handshake (sequentially consistent): the
+ * capture thread stamps the tick of the slot and then checks that the slot still holds its tag, the
+ * main thread locks the slot and then checks that the tick did not move. Either the capture thread
+ * sees the slot going and probes again, or the main thread sees the packet and keeps the slot.
+ *
+ * Freeing a slot can cut the probe chain of a flow stored further on, which then gets a second slot
+ * on its next packet. The bytes of both are taken by the tick and charged the same way, the totals
+ * are not changed.
+ */
+
+#include "FlowTable.h"
+
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+static flow_slot flow_slots[FLOW_TABLE_SLOTS];
+static atomic<uint32_t> flow_tick = 0;
+
+bool flow_key::operator==(const flow_key& other) const {
+	return memcmp(this, &other, sizeof(flow_key)) == 0;
+}
+
+size_t flow_key_hash::operator()(const flow_key& key) const {
+	return static_cast<size_t>(hash_flow_key(key));
+}
+
+/*
+ * Builds a key, remote_address may be nullptr for an unconnected socket and local_address for a
+ * socket bound to every address.
+ */
+flow_key make_flow_key(const uint8_t protocol, const uint8_t ip_version, const uint8_t* local_address, const uint16_t local_port, const uint8_t* remote_address, const uint16_t remote_port) {
+	flow_key key;
+	memset(&key, 0, sizeof(key));
+	key.protocol = protocol;
+	key.ip_version = ip_version;
+	key.local_port = local_port;
+	key.remote_port = remote_port;
+
+	const size_t address_size = ip_version == 4 ? 4 : 16;
+	if (local_address != nullptr) {
+		memcpy(key.local_address, local_address, address_size);
+	}
+	if (remote_address != nullptr) {
+		memcpy(key.remote_address, remote_address, address_size);
+	}
+	return key;
+}
+
+/*
+ * Returns the key of a slot. Only for the thread that claimed the slot, or the main thread while the
+ * slot holds a tag (it is the only one to free slots).
+ */
+flow_key get_flow_key(const flow_slot& slot) {
+	uint64_t words[FLOW_KEY_WORDS];
+	for (size_t word = 0; word < FLOW_KEY_WORDS; word++) {
+		words[word] = slot.key_words[word].load(memory_order_relaxed);
+	}
+	flow_key key;
+	memcpy(&key, words, sizeof(key));
+	return key;
+}
+
+static void store_flow_key(flow_slot& slot, const flow_key& key) {
+	uint64_t words[FLOW_KEY_WORDS];
+	memcpy(words, &key, sizeof(key));
+	for (size_t word = 0; word < FLOW_KEY_WORDS; word++) {
+		slot.key_words[word].store(words[word], memory_order_relaxed);
+	}
+}
+
+/*
+ * Compares the key of a slot that may be claimed again meanwhile. The caller checks the state of the
+ * slot again afterwards, the fence orders the loads of the key before that check.
+ */
+static bool flow_key_matches(const flow_slot& slot, const flow_key& key) {
+	uint64_t words[FLOW_KEY_WORDS];
+	memcpy(words, &key, sizeof(key));
+	bool matches = true;
+	for (size_t word = 0; word < FLOW_KEY_WORDS; word++) {
+		matches &= slot.key_words[word].load(memory_order_relaxed) == words[word];
+	}
+	atomic_thread_fence(memory_order_acquire);
+	return matches;
+}
+
+uint64_t hash_flow_key(const flow_key& key) {
+	// FNV-1a over the 8 byte words of the key, then a final mix of the high bits into the low ones
+	// used for the slot.
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t offset = 0; offset < sizeof(flow_key); offset += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, reinterpret_cast<const uint8_t*>(&key) + offset, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	return hash ^ (hash >> 29);
+}
+
+/*
+ * Counts the length of a packet in the flow of its local socket, the source one when local_source.
+ * Returns false when the flow has no slot within FLOW_PROBE_LIMIT probes (the caller counts the
+ * packet on its port instead).
+ */
+bool count_packet_flow(const parsed_packet& parsed, const bool local_source, const uint32_t length) {
+	const flow_key key = local_source
+		? make_flow_key(parsed.protocol, parsed.ip_version, parsed.src_address, parsed.src_port, parsed.dst_address, parsed.dst_port)
+		: make_flow_key(parsed.protocol, parsed.ip_version, parsed.dst_address, parsed.dst_port, parsed.src_address, parsed.src_port);
+	const uint64_t hash = hash_flow_key(key);
+	const uint64_t tag = hash | 2; // Never FLOW_SLOT_EMPTY or FLOW_SLOT_BUSY.
+	const uint32_t tick = flow_tick.load(memory_order_relaxed);
+
+	uint32_t index = static_cast<uint32_t>(hash) & (FLOW_TABLE_SLOTS - 1);
+	for (uint32_t probe = 0; probe < FLOW_PROBE_LIMIT;) {
+		flow_slot& slot = flow_slots[index];
+		uint64_t state = slot.state.load(memory_order_acquire);
+
+		if (state == FLOW_SLOT_EMPTY) {
+			if (!slot.state.compare_exchange_strong(state, FLOW_SLOT_BUSY)) {
+				continue; // Claimed meanwhile, look at it again.
+			}
+			atomic_thread_fence(memory_order_release); // The new key is not seen before the claim.
+			store_flow_key(slot, key);
+			slot.last_tick.store(tick);
+			slot.state.store(tag, memory_order_release);
+			state = tag;
+		}
+
+		if (state == FLOW_SLOT_BUSY) {
+			this_thread::yield(); // Being claimed or freed, a few instructions away from done.
+			continue;
+		}
+
+		if (state == tag && flow_key_matches(slot, key)) {
+			slot.last_tick.store(tick);
+			if (slot.state.load() != tag) {
+				continue; // Freed by the tick (and maybe claimed again) meanwhile.
+			}
+			if (local_source) {
+				slot.tx_bytes.fetch_add(length, memory_order_relaxed);
+			}
+			else {
+				slot.rx_bytes.fetch_add(length, memory_order_relaxed);
+			}
+			return true;
+		}
+
+		index = (index + 1) & (FLOW_TABLE_SLOTS - 1);
+		probe++;
+	}
+	return false;
+}
+
+/*
+ * Locks an idle slot for freeing. Returns false, leaving the slot as it was, when a capture thread
+ * counted into it meanwhile.
+ */
+static bool try_expire_flow(flow_slot* slot, uint64_t tag, const uint32_t tick) {
+	if (!slot->state.compare_exchange_strong(tag, FLOW_SLOT_BUSY)) {
+		return false;
+	}
+	if (tick - slot->last_tick.load() < FLOW_IDLE_TICKS) {
+		slot->state.store(tag, memory_order_release);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Calls visit(slot, tx_bytes, rx_bytes) for every flow with traffic since the previous call, then
+ * frees the flows idle for FLOW_IDLE_TICKS ticks. The owner fields of the slot are the caller's.
+ * Called from one thread only, once per tick.
+ */
+void harvest_flow_table(const function<void(flow_slot&, uint64_t, uint64_t)>& visit) {
+	const uint32_t tick = flow_tick.fetch_add(1) + 1;
+
+	for (flow_slot& slot : flow_slots) {
+		const uint64_t tag = slot.state.load(memory_order_acquire);
+		if (tag == FLOW_SLOT_EMPTY || tag == FLOW_SLOT_BUSY) {
+			continue;
+		}
+
+		const bool expired = tick - slot.last_tick.load(memory_order_relaxed) >= FLOW_IDLE_TICKS
+			&& try_expire_flow(&slot, tag, tick);
+
+		// Once expired, no capture thread can count into the slot: its bytes are final.
+		const uint64_t tx_bytes = slot.tx_bytes.exchange(0, memory_order_relaxed);
+		const uint64_t rx_bytes = slot.rx_bytes.exchange(0, memory_order_relaxed);
+		if (tx_bytes != 0 || rx_bytes != 0) {
+			visit(slot, tx_bytes, rx_bytes);
+		}
+
+		if (expired) {
+			slot.owner_known = false;
+			slot.state.store(FLOW_SLOT_EMPTY, memory_order_release);
+		}
+	}
+}
\ No newline at end of file
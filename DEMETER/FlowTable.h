@@ -0,0 +1,79 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "PacketParser.h"
+
+// Slots of the flow table, a power of 2. A flow takes a slot from its first packet until it has
+// been idle for FLOW_IDLE_TICKS ticks.
+constexpr uint32_t FLOW_TABLE_SLOTS = 1 << 16;
+constexpr uint32_t FLOW_IDLE_TICKS = 3;
+constexpr uint32_t FLOW_PROBE_LIMIT = 64; // Slots probed before a packet falls back to the port counters.
+
+constexpr uint64_t FLOW_SLOT_EMPTY = 0;
+constexpr uint64_t FLOW_SLOT_BUSY = 1;
+
+// A local socket seen from the host: protocol, local address and port, remote address and port.
+// IPv4 addresses take the first 4 bytes. A zero remote side stands for an unconnected socket, a zero
+// local address for a socket bound to every address.
+typedef struct flow_key {
+	uint8_t protocol;
+	uint8_t ip_version;
+	uint16_t local_port;
+	uint16_t remote_port;
+	uint8_t reserved[2]; // Zero, keys are compared as bytes.
+	uint8_t local_address[16];
+	uint8_t remote_address[16];
+
+	bool operator==(const flow_key&) const;
+} flow_key;
+
+typedef struct flow_key_hash {
+	size_t operator()(const flow_key&) const;
+} flow_key_hash;
+
+constexpr size_t FLOW_KEY_WORDS = sizeof(flow_key) / sizeof(uint64_t);
+static_assert(sizeof(flow_key) % sizeof(uint64_t) == 0, "flow keys are stored as 8 byte words");
+
+// A flow of the table. The key is written once by the capture thread that claims the slot, the
+// byte counters are added to by every capture thread and taken by the tick. The key is kept in
+// atomic words: a capture thread may compare it while the slot is freed and claimed again.
+typedef struct flow_slot {
+	std::atomic<uint64_t> state; // FLOW_SLOT_EMPTY, FLOW_SLOT_BUSY, or the tag of the key.
+	std::atomic<uint32_t> last_tick; // Tick of the last packet.
+	std::atomic<uint64_t> key_words[FLOW_KEY_WORDS]; // See get_flow_key.
+	std::atomic<uint64_t> tx_bytes;
+	std::atomic<uint64_t> rx_bytes;
+	uint32_t owner_pid; // Owner found by the tick, main thread only.
+	bool owner_known;
+} flow_slot;
+
+flow_key make_flow_key(uint8_t, uint8_t, const uint8_t*, uint16_t, const uint8_t*, uint16_t);
+
+uint64_t hash_flow_key(const flow_key&);
+
+flow_key get_flow_key(const flow_slot&);
+
+bool count_packet_flow(const parsed_packet&, bool, uint32_t);
+
+void harvest_flow_table(const std::function<void(flow_slot&, uint64_t, uint64_t)>&);
\ No newline at end of file
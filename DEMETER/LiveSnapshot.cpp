@@ -0,0 +1,346 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file publishes the rows of the last tick in a named shared memory segment, so that local
+ * consumers can map it and read the current consumption without going through the CSV file.
+ * See LiveSnapshotLayout.h for the layout and LiveSnapshotReader for the reader side.
+ */
+
+#include "LiveSnapshot.h"
+
+#include <algorithm>
+#include <string>
+
+#include "LiveSnapshotReader.h"
+#include "ProcessNameTable.h"
+
+using namespace std;
+
+constexpr UINT32 NAME_SLOT_NONE = 0xFFFFFFFF;
+
+static HANDLE writer_mutex = nullptr;
+static HANDLE segment_mapping = nullptr;
+static live_snapshot_segment* segment = nullptr;
+
+// Name slots of the segment: slot_of_name by interned name ID, the reverse in name_of_slot.
+static vector<UINT32> slot_of_name;
+static UINT32 name_of_slot[LIVE_SNAPSHOT_MAX_NAMES];
+static UINT64 slot_last_tick[LIVE_SNAPSHOT_MAX_NAMES]; // Last tick with a row of the slot.
+static vector<UINT32> free_slots;
+static UINT32 used_slots = 0; // Slots written so far.
+static UINT64 tick = 0;
+
+/*
+ * Takes the writer mutex of the segment. Returns FALSE if another instance of Demeter holds it. The
+ * mutex of a writer that exited without closing is abandoned, and taken over.
+ */
+static BOOL lock_live_snapshot_writer(const LPCWSTR segment_name) {
+	writer_mutex = CreateMutexW(nullptr, FALSE, (wstring(segment_name) + L"Writer").c_str());
+	if (writer_mutex == nullptr) {
+		spdlog::error("Could not create the live snapshot writer mutex. Error code: {}", GetLastError());
+		return FALSE;
+	}
+
+	const DWORD wait = WaitForSingleObject(writer_mutex, 0);
+	if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED) {
+		spdlog::error("The live snapshot segment is already published by another instance.");
+		CloseHandle(writer_mutex);
+		writer_mutex = nullptr;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Creates the segment, or takes over the segment of a previous writer that readers still map.
+ * Returns FALSE if it could not be created, or if another instance of Demeter already publishes
+ * under this name.
+ */
+BOOL open_live_snapshot_segment(const LPCWSTR segment_name) {
+	if (!lock_live_snapshot_writer(segment_name)) {
+		return FALSE;
+	}
+
+	segment_mapping = CreateFileMappingW(
+		INVALID_HANDLE_VALUE, // Backed by the paging file.
+		nullptr,
+		PAGE_READWRITE,
+		0,
+		sizeof(live_snapshot_segment),
+		segment_name
+	);
+
+	if (segment_mapping == nullptr) {
+		spdlog::error("Could not create the live snapshot segment. Error code: {}", GetLastError());
+		close_live_snapshot_segment();
+		return FALSE;
+	}
+	const bool stale = GetLastError() == ERROR_ALREADY_EXISTS; // Kept by a reader, its writer is gone.
+
+	segment = static_cast<live_snapshot_segment*>(
+		MapViewOfFile(segment_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(live_snapshot_segment)));
+
+	if (segment == nullptr) {
+		spdlog::error("Could not map the live snapshot segment. Error code: {}", GetLastError());
+		close_live_snapshot_segment();
+		return FALSE;
+	}
+
+	live_snapshot_header& header = segment->header;
+	if (stale && header.magic == LIVE_SNAPSHOT_MAGIC && header.version == LIVE_SNAPSHOT_VERSION) {
+		// Emptied under the sequence lock, the readers still mapping it see a snapshot without rows
+		// until the first tick. The sequence keeps increasing.
+		spdlog::info("Taking over the live snapshot segment of a previous instance.");
+		const UINT64 sequence = header.sequence.load(memory_order_relaxed) | 1;
+		header.sequence.store(sequence, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		memset(segment->names, 0, sizeof(segment->names));
+		header.timestamp = 0;
+		header.row_count = 0;
+		header.name_count = 0;
+		header.dropped_rows = 0;
+		header.sequence.store(sequence + 1, memory_order_release);
+	}
+	else {
+		// A new mapping is zero filled, which is a valid state for every field (sequence 0 means
+		// that nothing was published yet). One of another layout is cleared first.
+		if (stale) {
+			memset(static_cast<void*>(segment), 0, sizeof(live_snapshot_segment));
+		}
+		new (&header.sequence) atomic<UINT64>(0);
+		header.max_rows = LIVE_SNAPSHOT_MAX_ROWS;
+		header.max_names = LIVE_SNAPSHOT_MAX_NAMES;
+		header.version = LIVE_SNAPSHOT_VERSION;
+		header.magic = LIVE_SNAPSHOT_MAGIC;
+	}
+
+	slot_of_name.clear();
+	free_slots.clear();
+	used_slots = 0;
+	tick = 0;
+	return TRUE;
+}
+
+/*
+ * Returns the slot of an interned name, writing the name in a new slot if it has none. When every
+ * slot was written, the slots without row in this tick (processes that exited) are recycled.
+ * Called while the sequence is odd.
+ */
+static UINT32 get_name_slot(const UINT32 name_id) {
+	if (name_id >= slot_of_name.size()) {
+		slot_of_name.resize(get_interned_process_names_count(), NAME_SLOT_NONE);
+	}
+	UINT32 slot = slot_of_name[name_id];
+	if (slot != NAME_SLOT_NONE) {
+		slot_last_tick[slot] = tick;
+		return slot;
+	}
+
+	if (used_slots < LIVE_SNAPSHOT_MAX_NAMES) {
+		slot = used_slots++;
+	}
+	else {
+		if (free_slots.empty()) {
+			for (UINT32 candidate = 0; candidate < LIVE_SNAPSHOT_MAX_NAMES; candidate++) {
+				if (slot_last_tick[candidate] != tick && name_of_slot[candidate] != NAME_SLOT_NONE) {
+					slot_of_name[name_of_slot[candidate]] = NAME_SLOT_NONE;
+					name_of_slot[candidate] = NAME_SLOT_NONE;
+					free_slots.push_back(candidate);
+				}
+			}
+		}
+		slot = free_slots.back(); // Never empty: a tick has fewer rows than slots.
+		free_slots.pop_back();
+	}
+
+	// The last byte of a slot is never written so names are always terminated (longer names are
+	// truncated).
+	const string& name = get_interned_process_name(name_id);
+	memset(segment->names[slot], 0, LIVE_SNAPSHOT_NAME_SIZE);
+	memcpy(segment->names[slot], name.data(), min<SIZE_T>(name.size(), LIVE_SNAPSHOT_NAME_SIZE - 1));
+	slot_of_name[name_id] = slot;
+	name_of_slot[slot] = name_id;
+	slot_last_tick[slot] = tick;
+	return slot;
+}
+
+/*
+ * Frees the slot of an evicted name ID, which may be given to another name from now on. The name
+ * had no row for long, nor does it in the snapshot being read.
+ */
+void forget_live_snapshot_name(const UINT32 name_id) {
+	if (name_id >= slot_of_name.size() || slot_of_name[name_id] == NAME_SLOT_NONE) return;
+
+	const UINT32 slot = slot_of_name[name_id];
+	slot_of_name[name_id] = NAME_SLOT_NONE;
+	name_of_slot[slot] = NAME_SLOT_NONE;
+	free_slots.push_back(slot);
+}
+
+/*
+ * Publishes the rows of the tick. Called from the main loop once per tick.
+ */
+void publish_live_snapshot(const vector<process_record>& records, const time_t timestamp) {
+	if (segment == nullptr) return;
+
+	live_snapshot_header& header = segment->header;
+	const UINT64 sequence = header.sequence.load(memory_order_relaxed);
+	header.sequence.store(sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	tick++;
+	UINT32 row_count = 0;
+	UINT32 dropped_rows = 0;
+	for (const auto& record : records) {
+		if (row_count == LIVE_SNAPSHOT_MAX_ROWS) {
+			dropped_rows++;
+			continue;
+		}
+		live_snapshot_row& row = segment->rows[row_count++];
+		row.name_id = get_name_slot(record.name_id);
+		row.flags = record.aggregate ? LIVE_SNAPSHOT_ROW_AGGREGATE : 0;
+		row.ram = record.ram;
+		row.cpu_usage = record.cpu_usage;
+		row.cpu_consumption = record.cpu_consumption;
+		row.net_up_bandwidth = record.net_up_bandwidth;
+		row.net_up_consumption = record.net_up_consumption;
+		row.net_down_bandwidth = record.net_down_bandwidth;
+		row.net_down_consumption = record.net_down_consumption;
+		row.disk_read_speed = record.disk_read_speed;
+		row.disk_write_speed = record.disk_write_speed;
+		row.disk_read_consumption = record.disk_read_consumption;
+		row.disk_write_consumption = record.disk_write_consumption;
+		row.sum_consumption = record.sum_consumption;
+		row.core_consumption = record.core_consumption;
+		row.gpu_consumption = record.gpu_consumption;
+		row.uncore_consumption = record.uncore_consumption;
+		row.dram_consumption = record.dram_consumption;
+		row.reserved = 0;
+	}
+
+	header.timestamp = timestamp;
+	header.row_count = row_count;
+	header.name_count = used_slots;
+	header.dropped_rows = dropped_rows;
+
+	header.sequence.store(sequence + 2, memory_order_release);
+}
+
+void close_live_snapshot_segment() {
+	if (segment != nullptr) {
+		UnmapViewOfFile(segment);
+		segment = nullptr;
+	}
+	if (segment_mapping != nullptr) {
+		CloseHandle(segment_mapping);
+		segment_mapping = nullptr;
+	}
+	if (writer_mutex != nullptr) {
+		ReleaseMutex(writer_mutex);
+		CloseHandle(writer_mutex);
+		writer_mutex = nullptr;
+	}
+}
+
+// ----- Benchmark
+
+typedef struct benchmark_writer_data {
+	const vector<process_record>* records;
+	atomic<bool> running;
+	atomic<UINT64> writes;
+} benchmark_writer_data, *pbenchmark_writer_data;
+
+DWORD WINAPI benchmark_writer_loop(const LPVOID parameter) {
+	const auto data = static_cast<pbenchmark_writer_data>(parameter);
+	time_t timestamp = 0;
+	while (data->running.load(memory_order_relaxed)) {
+		publish_live_snapshot(*data->records, timestamp++);
+		data->writes.fetch_add(1, memory_order_relaxed);
+	}
+	return 0;
+}
+
+/*
+ * Measures the latency of read_live_snapshot while another thread publishes snapshots of
+ * rows_count rows back to back, which is far more contention than the one write per tick of a
+ * real run. Results are printed on the console.
+ */
+void run_live_snapshot_benchmark(const SIZE_T rows_count, const DWORD duration_ms) {
+	const LPCWSTR segment_name = L"Local\\DemeterLiveSnapshotBenchmark";
+	if (!open_live_snapshot_segment(segment_name)) {
+		printf("Could not create the benchmark segment, see logs.\n");
+		return;
+	}
+
+	vector<process_record> records(min<SIZE_T>(rows_count, LIVE_SNAPSHOT_MAX_ROWS));
+	for (SIZE_T i = 0; i < records.size(); i++) {
+		records[i].name = "process-" + to_string(i) + ".exe";
+		records[i].name_id = intern_process_name(records[i].name);
+		records[i].cpu_usage = static_cast<float>(i % 100);
+		records[i].sum_consumption = static_cast<float>(i);
+	}
+	publish_live_snapshot(records, 0);
+
+	live_snapshot_reader reader;
+	if (!open_live_snapshot_reader(&reader, segment_name)) {
+		printf("Could not open the benchmark segment.\n");
+		close_live_snapshot_segment();
+		return;
+	}
+
+	benchmark_writer_data writer_data;
+	writer_data.records = &records;
+	writer_data.running.store(true);
+	writer_data.writes.store(0);
+	const HANDLE writer_thread = CreateThread(nullptr, 0, benchmark_writer_loop, &writer_data, 0, nullptr);
+
+	LARGE_INTEGER frequency, begin, end, deadline;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&begin);
+	deadline.QuadPart = begin.QuadPart + frequency.QuadPart * duration_ms / 1000;
+
+	vector<live_snapshot_row> rows;
+	vector<UINT64> latencies_ns;
+	latencies_ns.reserve(1 << 20);
+	INT64 timestamp;
+	UINT64 sequence;
+
+	do {
+		QueryPerformanceCounter(&begin);
+		read_live_snapshot(&reader, rows, &timestamp, &sequence);
+		QueryPerformanceCounter(&end);
+		latencies_ns.push_back(static_cast<UINT64>((end.QuadPart - begin.QuadPart) * 1000000000LL / frequency.QuadPart));
+	} while (end.QuadPart < deadline.QuadPart);
+
+	writer_data.running.store(false);
+	WaitForSingleObject(writer_thread, INFINITE);
+	CloseHandle(writer_thread);
+
+	sort(latencies_ns.begin(), latencies_ns.end());
+	const auto percentile = [&latencies_ns](const double p) {
+		return latencies_ns[static_cast<SIZE_T>(p * static_cast<double>(latencies_ns.size() - 1))];
+	};
+
+	printf("Live snapshot benchmark: %zu rows, %lu ms\n", records.size(), duration_ms);
+	printf("  writes: %llu, reads: %zu\n", writer_data.writes.load(), latencies_ns.size());
+	printf("  read latency (ns): p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+		percentile(0.5), percentile(0.99), percentile(0.999), latencies_ns.back());
+
+	close_live_snapshot_reader(&reader);
+	close_live_snapshot_segment();
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+#include "DemeterLogger.h"
+#include "LiveSnapshotLayout.h"
+#include "ProcessRecord.h"
+
+BOOL open_live_snapshot_segment(LPCWSTR = LIVE_SNAPSHOT_SEGMENT_NAME);
+
+void publish_live_snapshot(const std::vector<process_record>&, time_t);
+
+void forget_live_snapshot_name(UINT32);
+
+void close_live_snapshot_segment();
+
+void run_live_snapshot_benchmark(SIZE_T, DWORD);
\ No newline at end of file
@@ -0,0 +1,87 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file describes the layout of the live snapshot shared memory segment. It is shared by the
+ * writer (LiveSnapshot) and by the readers (LiveSnapshotReader), and must stay free of any other
+ * Demeter dependency.
+ *
+ * The segment holds the rows of the last tick and the dictionary of the process names they refer
+ * to. It is protected by a sequence lock: the writer makes the sequence odd while it writes and
+ * even again once done, a reader retries whenever the sequence was odd or changed during its copy.
+ *
+ * Rows refer to the names by slot. The slots of the names that left the rows are recycled when the
+ * dictionary is full, so a name is only valid for the snapshot it was read with: readers copy the
+ * names of the rows along with them, under the same sequence check.
+ *
+ * One writer at a time holds the named mutex of the segment (its name followed by "Writer"). A
+ * segment still mapped by a reader after its writer exited is taken over and reset by the next one.
+ */
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+
+constexpr LPCWSTR LIVE_SNAPSHOT_SEGMENT_NAME = L"Local\\DemeterLiveSnapshot";
+constexpr UINT32 LIVE_SNAPSHOT_MAGIC = 0x524D5444; // "DTMR"
+constexpr UINT32 LIVE_SNAPSHOT_VERSION = 3;
+constexpr UINT32 LIVE_SNAPSHOT_MAX_ROWS = 4096;
+constexpr UINT32 LIVE_SNAPSHOT_MAX_NAMES = 8192;
+constexpr UINT32 LIVE_SNAPSHOT_NAME_SIZE = 64;
+constexpr UINT32 LIVE_SNAPSHOT_ROW_AGGREGATE = 0x1;
+
+typedef struct live_snapshot_row {
+	UINT32 name_id;
+	UINT32 flags;
+	UINT64 ram;
+	float cpu_usage;
+	float cpu_consumption;
+	float net_up_bandwidth;
+	float net_up_consumption;
+	float net_down_bandwidth;
+	float net_down_consumption;
+	float disk_read_speed;
+	float disk_write_speed;
+	float disk_read_consumption;
+	float disk_write_consumption;
+	float sum_consumption;
+	float core_consumption;
+	float gpu_consumption;
+	float uncore_consumption;
+	float dram_consumption;
+	float reserved;
+} live_snapshot_row;
+
+typedef struct live_snapshot_header {
+	UINT32 magic;
+	UINT32 version;
+	UINT32 max_rows;
+	UINT32 max_names;
+	alignas(64) std::atomic<UINT64> sequence;
+	INT64 timestamp;
+	UINT32 row_count;
+	UINT32 name_count; // Slots written so far, used or free.
+	UINT32 dropped_rows;
+} live_snapshot_header;
+
+typedef struct live_snapshot_segment {
+	live_snapshot_header header;
+	alignas(64) live_snapshot_row rows[LIVE_SNAPSHOT_MAX_ROWS];
+	char names[LIVE_SNAPSHOT_MAX_NAMES][LIVE_SNAPSHOT_NAME_SIZE];
+} live_snapshot_segment;
+
+static_assert(std::atomic<UINT64>::is_always_lock_free, "The sequence lock must be usable across processes.");
\ No newline at end of file
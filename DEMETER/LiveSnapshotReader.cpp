@@ -0,0 +1,121 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the reader of the live snapshot segment.
+ *
+ * Once the segment is mapped, reading a snapshot does not involve the kernel: the rows are copied
+ * straight from the mapping and validated against the sequence lock (see LiveSnapshotLayout.h).
+ */
+
+#include "LiveSnapshotReader.h"
+
+#include <cstring>
+
+using namespace std;
+
+/*
+ * Maps the segment published by a running Demeter. Returns FALSE if Demeter is not running, does
+ * not publish the live snapshot, or publishes an incompatible layout.
+ */
+BOOL open_live_snapshot_reader(live_snapshot_reader* reader, const LPCWSTR segment_name) {
+	reader->mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, segment_name);
+	reader->segment = nullptr;
+	if (reader->mapping == nullptr) {
+		return FALSE;
+	}
+
+	const auto segment = static_cast<const live_snapshot_segment*>(
+		MapViewOfFile(reader->mapping, FILE_MAP_READ, 0, 0, sizeof(live_snapshot_segment)));
+	if (segment == nullptr
+		|| segment->header.magic != LIVE_SNAPSHOT_MAGIC
+		|| segment->header.version != LIVE_SNAPSHOT_VERSION) {
+		if (segment != nullptr) {
+			UnmapViewOfFile(segment);
+		}
+		CloseHandle(reader->mapping);
+		reader->mapping = nullptr;
+		return FALSE;
+	}
+
+	reader->segment = segment;
+	return TRUE;
+}
+
+/*
+ * Returns the current sequence of the segment, a cheap way to poll for a new tick: the sequence
+ * only changes when a snapshot is published.
+ */
+UINT64 get_live_snapshot_sequence(const live_snapshot_reader* reader) {
+	return reader->segment->header.sequence.load(memory_order_acquire);
+}
+
+/*
+ * Copies a consistent snapshot of the rows in rows, retrying while the writer is publishing. When
+ * names is not null, it receives the name of each row (name slots are recycled between snapshots).
+ * Returns FALSE if nothing was published yet.
+ */
+BOOL read_live_snapshot(const live_snapshot_reader* reader, vector<live_snapshot_row>& rows, INT64* timestamp, UINT64* sequence, vector<string>* names) {
+	const live_snapshot_header& header = reader->segment->header;
+
+	while (true) {
+		const UINT64 sequence_begin = header.sequence.load(memory_order_acquire);
+		if (sequence_begin == 0) {
+			return FALSE;
+		}
+		if (sequence_begin & 1) {
+			YieldProcessor();
+			continue;
+		}
+
+		UINT32 row_count = header.row_count;
+		if (row_count > LIVE_SNAPSHOT_MAX_ROWS) {
+			row_count = LIVE_SNAPSHOT_MAX_ROWS; // Torn read, will be retried below.
+		}
+		rows.resize(row_count);
+		memcpy(rows.data(), reader->segment->rows, row_count * sizeof(live_snapshot_row));
+		if (names != nullptr) {
+			names->resize(row_count);
+			for (UINT32 row = 0; row < row_count; row++) {
+				const UINT32 name_id = rows[row].name_id;
+				if (name_id < LIVE_SNAPSHOT_MAX_NAMES) { // Otherwise torn, retried below.
+					const char* name = reader->segment->names[name_id];
+					(*names)[row].assign(name, strnlen(name, LIVE_SNAPSHOT_NAME_SIZE));
+				}
+			}
+		}
+		const INT64 snapshot_timestamp = header.timestamp;
+
+		atomic_thread_fence(memory_order_acquire);
+		if (header.sequence.load(memory_order_relaxed) == sequence_begin) {
+			*timestamp = snapshot_timestamp;
+			*sequence = sequence_begin;
+			return TRUE;
+		}
+	}
+}
+
+void close_live_snapshot_reader(live_snapshot_reader* reader) {
+	if (reader->segment != nullptr) {
+		UnmapViewOfFile(reader->segment);
+		reader->segment = nullptr;
+	}
+	if (reader->mapping != nullptr) {
+		CloseHandle(reader->mapping);
+		reader->mapping = nullptr;
+	}
+}
\ No newline at end of file
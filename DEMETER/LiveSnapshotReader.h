@@ -0,0 +1,41 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Reader side of the live snapshot segment. This header and LiveSnapshotReader.cpp, together with
+ * LiveSnapshotLayout.h, can be dropped as is in any local consumer (tray widget, dashboard, ...).
+ */
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "LiveSnapshotLayout.h"
+
+typedef struct live_snapshot_reader {
+	HANDLE mapping;
+	const live_snapshot_segment* segment;
+} live_snapshot_reader;
+
+BOOL open_live_snapshot_reader(live_snapshot_reader*, LPCWSTR = LIVE_SNAPSHOT_SEGMENT_NAME);
+
+UINT64 get_live_snapshot_sequence(const live_snapshot_reader*);
+
+BOOL read_live_snapshot(const live_snapshot_reader*, std::vector<live_snapshot_row>&, INT64*, UINT64*, std::vector<std::string>* = nullptr);
+
+void close_live_snapshot_reader(live_snapshot_reader*);
\ No newline at end of file
@@ -0,0 +1,236 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the OpenMetrics (Prometheus) exporter.
+ *
+ * A small HTTP listener bound to localhost answers every request with the rows of the last tick.
+ * The whole HTTP response is rendered once per tick by the main loop (publish_metrics) and swapped
+ * in atomically, so a scrape only loads a pointer and sends a prebuilt buffer: scrapes never wait
+ * on, nor slow down, the sampling.
+ */
+
+#include "MetricsExporter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+typedef struct metric_family {
+	const char* name;
+	const char* unit;
+	const char* help;
+	float process_record::* value;
+} metric_family;
+
+static const metric_family metric_families[] = {
+	{ "demeter_cpu_usage_percent", "percent", "CPU usage over the last interval.", &process_record::cpu_usage },
+	{ "demeter_cpu_energy_milliwatt_hours", "milliwatt_hours", "CPU energy consumed over the last interval.", &process_record::cpu_consumption },
+	{ "demeter_net_up_megabytes_per_second", "megabytes_per_second", "Upstream bandwidth over the last interval.", &process_record::net_up_bandwidth },
+	{ "demeter_net_up_energy_milliwatt_hours", "milliwatt_hours", "Upstream energy consumed over the last interval.", &process_record::net_up_consumption },
+	{ "demeter_net_down_megabytes_per_second", "megabytes_per_second", "Downstream bandwidth over the last interval.", &process_record::net_down_bandwidth },
+	{ "demeter_net_down_energy_milliwatt_hours", "milliwatt_hours", "Downstream energy consumed over the last interval.", &process_record::net_down_consumption },
+	{ "demeter_disk_read_megabytes_per_second", "megabytes_per_second", "Disk read speed over the last interval.", &process_record::disk_read_speed },
+	{ "demeter_disk_write_megabytes_per_second", "megabytes_per_second", "Disk write speed over the last interval.", &process_record::disk_write_speed },
+	{ "demeter_disk_read_energy_milliwatt_hours", "milliwatt_hours", "Disk read energy consumed over the last interval.", &process_record::disk_read_consumption },
+	{ "demeter_disk_write_energy_milliwatt_hours", "milliwatt_hours", "Disk write energy consumed over the last interval.", &process_record::disk_write_consumption },
+	{ "demeter_energy_milliwatt_hours", "milliwatt_hours", "Total energy consumed over the last interval.", &process_record::sum_consumption },
+	{ "demeter_core_energy_milliwatt_hours", "milliwatt_hours", "Cores (RAPL PP0) energy consumed over the last interval.", &process_record::core_consumption },
+	{ "demeter_gpu_energy_milliwatt_hours", "milliwatt_hours", "Integrated graphics (RAPL PP1) energy consumed over the last interval.", &process_record::gpu_consumption },
+	{ "demeter_uncore_energy_milliwatt_hours", "milliwatt_hours", "Uncore energy consumed over the last interval.", &process_record::uncore_consumption },
+	{ "demeter_dram_energy_milliwatt_hours", "milliwatt_hours", "DRAM energy consumed over the last interval.", &process_record::dram_consumption },
+};
+
+static atomic<SOCKET> listen_socket = INVALID_SOCKET; // Read by the listener thread while stop_metrics_exporter clears it.
+static SIZE_T series_limit = 200;
+static atomic<shared_ptr<const string>> exposition;
+
+void set_metrics_series_limit(const SIZE_T limit) {
+	series_limit = limit;
+}
+
+/*
+ * Prefixes the body with the HTTP headers, so that the listener can answer with a single send.
+ */
+static shared_ptr<const string> build_response(const string& body) {
+	auto response = make_shared<string>();
+	response->reserve(body.size() + 256);
+	*response += "HTTP/1.1 200 OK\r\n";
+	*response += "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n";
+	*response += "Content-Length: " + to_string(body.size()) + "\r\n";
+	*response += "Connection: close\r\n\r\n";
+	*response += body;
+	return response;
+}
+
+static void append_label_value(string& buffer, const string& value) {
+	for (const char c : value) {
+		if (c == '\\' || c == '"') {
+			buffer += '\\';
+			buffer += c;
+		}
+		else if (c == '\n') {
+			buffer += "\\n";
+		}
+		else {
+			buffer += c;
+		}
+	}
+}
+
+/*
+ * Keeps the aggregate rows and the series_limit most consuming processes, every other process is
+ * folded into a single "other" series so that the cardinality stays bounded on busy hosts.
+ */
+static vector<const process_record*> select_series(const vector<process_record>& records, process_record& other) {
+	vector<const process_record*> series;
+	vector<const process_record*> processes;
+	series.reserve(records.size());
+	processes.reserve(records.size());
+
+	for (const auto& record : records) {
+		if (record.aggregate) {
+			series.push_back(&record);
+		}
+		else {
+			processes.push_back(&record);
+		}
+	}
+
+	if (processes.size() > series_limit) {
+		const auto limit = processes.begin() + static_cast<ptrdiff_t>(series_limit);
+		nth_element(processes.begin(), limit, processes.end(),
+			[](const process_record* a, const process_record* b) { return a->sum_consumption > b->sum_consumption; });
+		for (auto it = limit; it != processes.end(); ++it) {
+			add_process_record(other, **it);
+		}
+		processes.erase(limit, processes.end());
+		processes.push_back(&other);
+	}
+
+	series.insert(series.end(), processes.begin(), processes.end());
+	return series;
+}
+
+/*
+ * Renders the rows of the tick in the OpenMetrics text format and publishes them to the listener.
+ * This is called from the main loop once per tick.
+ */
+void publish_metrics(const vector<process_record>& records) {
+	if (listen_socket.load() == INVALID_SOCKET) return;
+
+	process_record other = {};
+	other.name = "other";
+	const vector<const process_record*> series = select_series(records, other);
+
+	string body;
+	body.reserve(series.size() * 64 * (size(metric_families) + 1));
+
+	for (const auto& family : metric_families) {
+		fmt::format_to(back_inserter(body), "# TYPE {} gauge\n# UNIT {} {}\n# HELP {} {}\n",
+			family.name, family.name, family.unit, family.name, family.help);
+		for (const auto* record : series) {
+			body += family.name;
+			body += "{process=\"";
+			append_label_value(body, record->name);
+			fmt::format_to(back_inserter(body), "\"}} {}\n", record->*family.value);
+		}
+	}
+
+	body += "# TYPE demeter_ram_bytes gauge\n# UNIT demeter_ram_bytes bytes\n# HELP demeter_ram_bytes RAM usage.\n";
+	for (const auto* record : series) {
+		body += "demeter_ram_bytes{process=\"";
+		append_label_value(body, record->name);
+		fmt::format_to(back_inserter(body), "\"}} {}\n", record->ram);
+	}
+	body += "# EOF\n";
+
+	exposition.store(build_response(body));
+}
+
+/*
+ * Serves the current exposition buffer to every client, one at a time.
+ * The request itself is not interpreted, any path gets the metrics.
+ */
+DWORD WINAPI metrics_exporter_loop(LPVOID) {
+	char request[1024];
+	constexpr DWORD receive_timeout = 1000;
+
+	while (true) {
+		const SOCKET client = accept(listen_socket.load(), nullptr, nullptr);
+		if (client == INVALID_SOCKET) {
+			if (listen_socket.load() == INVALID_SOCKET) {
+				return 0; // Exporter stopped.
+			}
+			continue;
+		}
+
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&receive_timeout), sizeof(receive_timeout));
+		recv(client, request, sizeof(request), 0);
+
+		const shared_ptr<const string> response = exposition.load();
+		send(client, response->data(), static_cast<int>(response->size()), 0);
+
+		shutdown(client, SD_SEND);
+		closesocket(client);
+	}
+}
+
+/*
+ * Starts the HTTP listener on 127.0.0.1:port.
+ */
+BOOL start_metrics_exporter(const u_short port) {
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		spdlog::error("WSAStartup failed for the metrics exporter.");
+		return FALSE;
+	}
+
+	exposition.store(build_response("# EOF\n"));
+
+	const SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server_socket == INVALID_SOCKET) {
+		spdlog::error("Could not create the metrics exporter socket: {}", WSAGetLastError());
+		return FALSE;
+	}
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	if (bind(server_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+		|| listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
+		spdlog::error("Could not listen on 127.0.0.1:{} for the metrics exporter: {}", port, WSAGetLastError());
+		closesocket(server_socket);
+		return FALSE;
+	}
+	listen_socket.store(server_socket);
+
+	CreateThread(nullptr, 0, metrics_exporter_loop, nullptr, 0, nullptr);
+	spdlog::info("Metrics exporter listening on 127.0.0.1:{}", port);
+	return TRUE;
+}
+
+void stop_metrics_exporter() {
+	const SOCKET socket_to_close = listen_socket.exchange(INVALID_SOCKET);
+	if (socket_to_close == INVALID_SOCKET) return;
+
+	closesocket(socket_to_close);
+}
\ No newline at end of file
@@ -0,0 +1,441 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the packet parser of the capture threads: it reads the ports of a TCP or UDP
+ * packet straight from the header bytes and tells whether the packet was sent or received by
+ * comparing the binary addresses against the addresses of the interface.
+ *
+ * The parser runs once per captured packet, it must not allocate, lock or convert addresses to
+ * text. The local addresses are kept in small open addressing hash sets built when the capture
+ * starts.
+ *
+ * The link headers are described by the link_decoders table rather than by code: each capture
+ * handle looks up the entry of its data link type once, and every link type goes through the same
+ * steps (fixed header, VLAN tags, IP header, IPv6 extension headers).
+ */
+
+#include "PacketParser.h"
+
+#ifdef _WIN32
+#define _WINSOCKAPI_
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "pcap.h"
+
+using namespace std;
+
+constexpr uint16_t ETHERTYPE_IPV4 = 0x0800;
+constexpr uint16_t ETHERTYPE_IPV6 = 0x86DD;
+constexpr uint16_t ETHERTYPE_VLAN = 0x8100; // 802.1Q.
+constexpr uint16_t ETHERTYPE_QINQ = 0x88A8; // 802.1ad outer tag.
+constexpr uint16_t ETHERTYPE_QINQ_OLD = 0x9100; // Outer tag before 802.1ad.
+constexpr int MAX_VLAN_TAGS = 2;
+
+// Packet types of the Linux cooked capture headers.
+constexpr uint8_t LINUX_PACKET_OTHERHOST = 3;
+constexpr uint8_t LINUX_PACKET_OUTGOING = 4;
+
+// IPv6 extension headers followed to the TCP or UDP header.
+constexpr uint8_t IPV6_HOP_BY_HOP = 0;
+constexpr uint8_t IPV6_ROUTING = 43;
+constexpr uint8_t IPV6_FRAGMENT = 44;
+constexpr uint8_t IPV6_AUTHENTICATION = 51;
+constexpr uint8_t IPV6_DESTINATION = 60;
+constexpr int MAX_IPV6_EXTENSION_HEADERS = 8;
+
+static const link_decoder link_decoders[] = {
+	// link type, header, EtherType, packet type, loopback, VLAN tags
+	{ LINK_TYPE_NULL, 4, -1, -1, true, false },
+	{ LINK_TYPE_LOOP, 4, -1, -1, true, false },
+	{ LINK_TYPE_ETHERNET, 14, 12, -1, false, true },
+	{ LINK_TYPE_RAW, 0, -1, -1, false, false },
+	{ LINK_TYPE_IPV4, 0, -1, -1, false, false },
+	{ LINK_TYPE_IPV6, 0, -1, -1, false, false },
+	{ LINK_TYPE_LINUX_SLL, 16, 14, 1, false, false },
+	{ LINK_TYPE_LINUX_SLL2, 20, 0, 10, false, false },
+};
+
+/*
+ * Returns the decoder of a pcap data link type, nullptr when the parser cannot read it.
+ */
+const link_decoder* find_link_decoder(const int link_type) {
+	for (const link_decoder& decoder : link_decoders) {
+		if (decoder.link_type == link_type) {
+			return &decoder;
+		}
+	}
+	return nullptr;
+}
+
+/*
+ * Returns the kernel filter of the handles of a link type: CAPTURE_FILTER, the frames with VLAN tags
+ * when the link has them, minus the traffic of the exclude expression (none when empty).
+ *
+ * The first "vlan" of an expression shifts the offsets of everything after it, so the untagged and
+ * the tagged frames are matched, and the exclusion applied, in two separate branches.
+ */
+string build_capture_filter(const link_decoder* decoder, const string& exclude) {
+	const string base = string("(") + CAPTURE_FILTER + ")";
+	const string not_excluded = exclude.empty() ? "" : " and not (" + exclude + ")";
+	if (!decoder->vlan_tags) {
+		return base + not_excluded;
+	}
+	return "(" + base + not_excluded + ") or (vlan" + not_excluded + ")";
+}
+
+static uint32_t hash_slot(const uint32_t value) {
+	// Fibonacci hashing, the top bits of the product are the best mixed.
+	return (value * 2654435769u) >> 27 & (LOCAL_ADDRESS_SLOTS - 1);
+}
+
+static uint32_t read_u32(const uint8_t* bytes) {
+	uint32_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static uint16_t read_u16_big_endian(const uint8_t* bytes) {
+	return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+static uint32_t fold_ipv6(const uint8_t* address) {
+	return read_u32(address) ^ read_u32(address + 4) ^ read_u32(address + 8) ^ read_u32(address + 12);
+}
+
+void clear_local_addresses(local_addresses* addresses) {
+	memset(addresses, 0, sizeof(local_addresses));
+}
+
+static bool add_ipv4(local_addresses* addresses, const uint8_t* address) {
+	const uint32_t value = read_u32(address);
+	uint32_t slot = hash_slot(value);
+	for (int probe = 0; probe < LOCAL_ADDRESS_SLOTS; probe++) {
+		if (!addresses->ipv4_used[slot]) {
+			addresses->ipv4[slot] = value;
+			addresses->ipv4_used[slot] = true;
+			return true;
+		}
+		if (addresses->ipv4[slot] == value) {
+			return true;
+		}
+		slot = (slot + 1) & (LOCAL_ADDRESS_SLOTS - 1);
+	}
+	return false; // Full.
+}
+
+static bool add_ipv6(local_addresses* addresses, const uint8_t* address) {
+	uint32_t slot = hash_slot(fold_ipv6(address));
+	for (int probe = 0; probe < LOCAL_ADDRESS_SLOTS; probe++) {
+		if (!addresses->ipv6_used[slot]) {
+			memcpy(addresses->ipv6[slot], address, 16);
+			addresses->ipv6_used[slot] = true;
+			return true;
+		}
+		if (memcmp(addresses->ipv6[slot], address, 16) == 0) {
+			return true;
+		}
+		slot = (slot + 1) & (LOCAL_ADDRESS_SLOTS - 1);
+	}
+	return false;
+}
+
+/*
+ * Adds an interface address (as listed by pcap_findalldevs) to the set. Returns false for other
+ * address families or when the set is full.
+ */
+bool add_local_address(local_addresses* addresses, const sockaddr* address) {
+	if (address == nullptr) {
+		return false;
+	}
+	if (address->sa_family == AF_INET) {
+		const auto ipv4 = reinterpret_cast<const sockaddr_in*>(address);
+		return add_ipv4(addresses, reinterpret_cast<const uint8_t*>(&ipv4->sin_addr));
+	}
+	if (address->sa_family == AF_INET6) {
+		const auto ipv6 = reinterpret_cast<const sockaddr_in6*>(address);
+		return add_ipv6(addresses, reinterpret_cast<const uint8_t*>(&ipv6->sin6_addr));
+	}
+	return false;
+}
+
+bool is_local_ipv4_address(const local_addresses* addresses, const uint8_t* address) {
+	const uint32_t value = read_u32(address);
+	uint32_t slot = hash_slot(value);
+	for (int probe = 0; probe < LOCAL_ADDRESS_SLOTS && addresses->ipv4_used[slot]; probe++) {
+		if (addresses->ipv4[slot] == value) {
+			return true;
+		}
+		slot = (slot + 1) & (LOCAL_ADDRESS_SLOTS - 1);
+	}
+	return false;
+}
+
+bool is_local_ipv6_address(const local_addresses* addresses, const uint8_t* address) {
+	uint32_t slot = hash_slot(fold_ipv6(address));
+	for (int probe = 0; probe < LOCAL_ADDRESS_SLOTS && addresses->ipv6_used[slot]; probe++) {
+		if (memcmp(addresses->ipv6[slot], address, 16) == 0) {
+			return true;
+		}
+		slot = (slot + 1) & (LOCAL_ADDRESS_SLOTS - 1);
+	}
+	return false;
+}
+
+/*
+ * Sets head to the offset of the IP header, behind the link header and its VLAN tags. Returns false
+ * when the packet does not carry IP or is truncated.
+ */
+static bool skip_link_header(const uint8_t* packet, const uint32_t caplen, const link_decoder* decoder, uint32_t* head) {
+	*head = decoder->header_length;
+	if (caplen <= *head) {
+		return false;
+	}
+	if (decoder->ethertype_offset < 0) {
+		return true;
+	}
+
+	// A tag (2 bytes of VLAN id, then the EtherType of the payload) follows each VLAN EtherType.
+	uint16_t ethertype = read_u16_big_endian(packet + decoder->ethertype_offset);
+	for (int tag = 0; tag < MAX_VLAN_TAGS && (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ || ethertype == ETHERTYPE_QINQ_OLD); tag++) {
+		if (caplen < *head + 4) {
+			return false;
+		}
+		ethertype = read_u16_big_endian(packet + *head + 2);
+		*head += 4;
+	}
+
+	return (ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6) && caplen > *head;
+}
+
+/*
+ * Follows the IPv6 extension headers from the fixed header to the upper layer protocol. Returns
+ * false for the fragments without the transport header, ESP and truncated headers.
+ */
+static bool skip_ipv6_extension_headers(const uint8_t* ip, const uint32_t ip_length, uint8_t* protocol, uint32_t* ip_header_length) {
+	for (int extension = 0; extension < MAX_IPV6_EXTENSION_HEADERS; extension++) {
+		if (*protocol == PROTOCOL_TCP || *protocol == PROTOCOL_UDP) {
+			return true;
+		}
+		if (ip_length < *ip_header_length + 8) {
+			return false;
+		}
+
+		const uint8_t* header = ip + *ip_header_length;
+		uint32_t header_length;
+		if (*protocol == IPV6_HOP_BY_HOP || *protocol == IPV6_ROUTING || *protocol == IPV6_DESTINATION) {
+			header_length = (header[1] + 1u) * 8;
+		}
+		else if (*protocol == IPV6_FRAGMENT) {
+			if ((read_u16_big_endian(header + 2) & 0xFFF8) != 0) {
+				return false; // Not the first fragment.
+			}
+			header_length = 8;
+		}
+		else if (*protocol == IPV6_AUTHENTICATION) {
+			header_length = (header[1] + 2u) * 4;
+		}
+		else {
+			return false;
+		}
+
+		*protocol = header[0];
+		*ip_header_length += header_length;
+	}
+	return *protocol == PROTOCOL_TCP || *protocol == PROTOCOL_UDP;
+}
+
+/*
+ * Reads the protocol, addresses, ports and direction of a captured packet, the addresses point into
+ * the packet. caplen is the number of bytes captured, every read is checked against it. Returns
+ * false, with the direction set to DIRECTION_IGNORED, when the packet is not counted.
+ *
+ * Loopback frames are counted on both ports. Linux cooked captures tell the direction in their
+ * header (the loopback traffic shows once leaving and once arriving). The others are counted on the
+ * port of the local side, the source first (a packet between two addresses of the interface is
+ * counted as sent).
+ */
+bool parse_packet(const uint8_t* packet, const uint32_t caplen, const link_decoder* decoder, const local_addresses* addresses, parsed_packet* parsed) {
+	parsed->direction = DIRECTION_IGNORED;
+
+	uint32_t head;
+	if (!skip_link_header(packet, caplen, decoder, &head)) {
+		return false;
+	}
+
+	const uint8_t* ip = packet + head;
+	const uint32_t ip_length = caplen - head;
+	const int ip_version = ip[0] >> 4;
+
+	uint8_t protocol;
+	uint32_t ip_header_length;
+
+	if (ip_version == 4) {
+		ip_header_length = (ip[0] & 0x0F) * 4u;
+		if (ip_header_length < 20 || ip_length < ip_header_length + 4) {
+			return false;
+		}
+		if ((read_u16_big_endian(ip + 6) & 0x1FFF) != 0) {
+			return false; // Not the first fragment, no ports.
+		}
+		protocol = ip[9];
+		parsed->src_address = ip + 12;
+		parsed->dst_address = ip + 16;
+	}
+	else if (ip_version == 6) {
+		ip_header_length = 40;
+		if (ip_length < ip_header_length + 4) {
+			return false;
+		}
+		protocol = ip[6];
+		if (!skip_ipv6_extension_headers(ip, ip_length, &protocol, &ip_header_length)) {
+			return false;
+		}
+		if (ip_length < ip_header_length + 4) {
+			return false;
+		}
+		parsed->src_address = ip + 8;
+		parsed->dst_address = ip + 24;
+	}
+	else {
+		return false;
+	}
+
+	if (protocol != PROTOCOL_TCP && protocol != PROTOCOL_UDP) {
+		return false;
+	}
+
+	parsed->protocol = protocol;
+	parsed->ip_version = static_cast<uint8_t>(ip_version);
+
+	// Both TCP and UDP start with the source and destination ports, big endian.
+	const uint8_t* transport = ip + ip_header_length;
+	parsed->src_port = read_u16_big_endian(transport);
+	parsed->dst_port = read_u16_big_endian(transport + 2);
+
+	if (decoder->loopback) {
+		parsed->direction = DIRECTION_LOOPBACK;
+	}
+	else if (decoder->packet_type_offset >= 0) {
+		const uint8_t packet_type = packet[decoder->packet_type_offset];
+		if (packet_type == LINUX_PACKET_OUTGOING) {
+			parsed->direction = DIRECTION_SENT;
+		}
+		else if (packet_type != LINUX_PACKET_OTHERHOST) {
+			parsed->direction = DIRECTION_RECEIVED;
+		}
+	}
+	else if (ip_version == 4) {
+		if (is_local_ipv4_address(addresses, parsed->src_address)) {
+			parsed->direction = DIRECTION_SENT;
+		}
+		else if (is_local_ipv4_address(addresses, parsed->dst_address)) {
+			parsed->direction = DIRECTION_RECEIVED;
+		}
+	}
+	else {
+		if (is_local_ipv6_address(addresses, parsed->src_address)) {
+			parsed->direction = DIRECTION_SENT;
+		}
+		else if (is_local_ipv6_address(addresses, parsed->dst_address)) {
+			parsed->direction = DIRECTION_RECEIVED;
+		}
+	}
+	return parsed->direction != DIRECTION_IGNORED;
+}
+
+typedef struct captured_packet {
+	size_t offset;
+	uint32_t caplen;
+} captured_packet;
+
+/*
+ * Loads the packets of a pcap file in memory and parses them in a loop for at least one second,
+ * with the addresses of the local interfaces. Prints the packets per second and the time per
+ * packet. Used with --bench-parser.
+ */
+void run_packet_parser_benchmark(const string& path) {
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t* handle = pcap_open_offline(path.c_str(), errbuf);
+	if (handle == nullptr) {
+		printf("Could not open %s: %s\n", path.c_str(), errbuf);
+		return;
+	}
+
+	const int link_type = pcap_datalink(handle);
+	const link_decoder* decoder = find_link_decoder(link_type);
+	if (decoder == nullptr) {
+		printf("Link type %d of %s not supported by the parser\n", link_type, path.c_str());
+		pcap_close(handle);
+		return;
+	}
+
+	vector<uint8_t> bytes;
+	vector<captured_packet> packets;
+	pcap_pkthdr* header;
+	const u_char* data;
+	while (pcap_next_ex(handle, &header, &data) == 1) {
+		packets.push_back({ bytes.size(), header->caplen });
+		bytes.insert(bytes.end(), data, data + header->caplen);
+	}
+	pcap_close(handle);
+
+	if (packets.empty()) {
+		printf("No packets in %s\n", path.c_str());
+		return;
+	}
+
+	local_addresses addresses;
+	clear_local_addresses(&addresses);
+	pcap_if_t* devices;
+	if (pcap_findalldevs(&devices, errbuf) == 0) {
+		for (const pcap_if_t* device = devices; device != nullptr; device = device->next) {
+			for (const pcap_addr* address = device->addresses; address != nullptr; address = address->next) {
+				add_local_address(&addresses, address->addr);
+			}
+		}
+		pcap_freealldevs(devices);
+	}
+
+	uint64_t parsed_count = 0;
+	uint64_t counted_count = 0;
+	const auto begin = chrono::steady_clock::now();
+	chrono::steady_clock::duration elapsed;
+	do {
+		for (const captured_packet& packet : packets) {
+			parsed_packet parsed;
+			counted_count += parse_packet(bytes.data() + packet.offset, packet.caplen, decoder, &addresses, &parsed);
+		}
+		parsed_count += packets.size();
+		elapsed = chrono::steady_clock::now() - begin;
+	} while (elapsed < chrono::seconds(1));
+
+	const double seconds = chrono::duration<double>(elapsed).count();
+	printf("Packet parser benchmark, %zu packets (link type %d) from %s\n", packets.size(), link_type, path.c_str());
+	printf("  %.0f packets/s, %.1f ns/packet, %.1f%% counted\n",
+		parsed_count / seconds, seconds * 1e9 / parsed_count, 100.0 * counted_count / parsed_count);
+}
\ No newline at end of file
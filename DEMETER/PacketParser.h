@@ -0,0 +1,105 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+struct sockaddr;
+
+// pcap data link types (DLT_*) read by the parser, see find_link_decoder.
+constexpr int LINK_TYPE_NULL = 0; // BSD loopback, 4 bytes address family header.
+constexpr int LINK_TYPE_ETHERNET = 1; // With or without 802.1Q and 802.1ad VLAN tags.
+constexpr int LINK_TYPE_RAW = 12; // IP packets without link header (tunnels).
+constexpr int LINK_TYPE_LOOP = 108; // OpenBSD loopback, as LINK_TYPE_NULL.
+constexpr int LINK_TYPE_LINUX_SLL = 113; // Linux cooked capture (the "any" device), 16 bytes header.
+constexpr int LINK_TYPE_IPV4 = 228;
+constexpr int LINK_TYPE_IPV6 = 229;
+constexpr int LINK_TYPE_LINUX_SLL2 = 276; // Linux cooked capture v2, 20 bytes header.
+
+constexpr uint8_t PROTOCOL_TCP = 6;
+constexpr uint8_t PROTOCOL_UDP = 17;
+
+// Bytes captured per packet, enough for the link header (cooked v2, or Ethernet with two VLAN
+// tags), an IPv4 header with options or an IPv6 header followed by up to 190 bytes of extension
+// headers (a segment routing header of 10 segments), and the TCP or UDP ports. Packets whose ports
+// lie further are not counted. The lengths counted come from the length on the wire, not from the
+// captured bytes.
+constexpr int CAPTURE_SNAPLEN = 256;
+
+// Kernel filter of the capture, the parser only counts TCP and UDP packets. IPv6 packets all pass:
+// the "tcp" and "udp" primitives do not follow the IPv6 extension headers, the parser does.
+constexpr const char* CAPTURE_FILTER = "tcp or udp or ip6";
+
+// Slots per address family in a local address set, a power of 2 well above the addresses of an
+// interface so that lookups stay one or two probes long.
+constexpr int LOCAL_ADDRESS_SLOTS = 32;
+
+// Addresses of one capture interface, in network byte order, looked up by the parser without
+// converting them to text.
+typedef struct local_addresses {
+	uint32_t ipv4[LOCAL_ADDRESS_SLOTS];
+	bool ipv4_used[LOCAL_ADDRESS_SLOTS];
+	uint8_t ipv6[LOCAL_ADDRESS_SLOTS][16];
+	bool ipv6_used[LOCAL_ADDRESS_SLOTS];
+} local_addresses;
+
+// How the parser finds the IP header of the packets of one data link type. Looked up once per
+// capture handle with find_link_decoder, the parser then reads the packets without testing the
+// link type.
+typedef struct link_decoder {
+	int link_type;
+	uint16_t header_length; // Link header bytes before the IP header (or the first VLAN tag).
+	int16_t ethertype_offset; // Big endian EtherType of the payload, -1 to read the IP version instead.
+	int16_t packet_type_offset; // Linux packet type byte (outgoing, to this host...), -1 for none.
+	bool loopback; // Every packet is counted on both ports.
+	bool vlan_tags; // The frames with VLAN tags also pass the capture filter, whole.
+} link_decoder;
+
+typedef enum packet_direction {
+	DIRECTION_IGNORED, // Not TCP or UDP over IP, truncated, or neither address is local.
+	DIRECTION_SENT, // Counted on the source port.
+	DIRECTION_RECEIVED, // Counted on the destination port.
+	DIRECTION_LOOPBACK // Counted on both ports.
+} packet_direction;
+
+typedef struct parsed_packet {
+	packet_direction direction;
+	uint8_t protocol; // PROTOCOL_TCP or PROTOCOL_UDP.
+	uint8_t ip_version; // 4 or 6.
+	uint16_t src_port;
+	uint16_t dst_port;
+	const uint8_t* src_address; // In the packet, 4 or 16 bytes in network byte order.
+	const uint8_t* dst_address;
+} parsed_packet;
+
+void clear_local_addresses(local_addresses*);
+
+bool add_local_address(local_addresses*, const sockaddr*);
+
+bool is_local_ipv4_address(const local_addresses*, const uint8_t*);
+
+bool is_local_ipv6_address(const local_addresses*, const uint8_t*);
+
+const link_decoder* find_link_decoder(int);
+
+std::string build_capture_filter(const link_decoder*, const std::string&);
+
+bool parse_packet(const uint8_t*, uint32_t, const link_decoder*, const local_addresses*, parsed_packet*);
+
+void run_packet_parser_benchmark(const std::string&);
\ No newline at end of file
@@ -0,0 +1,420 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the offline replay of the network accounting: the packets of pcap or pcapng
+ * files go through the parser, the capture counters and the harvest of ProcessNetDataGatherer as if
+ * captured live, and are charged with a port table recorded beforehand instead of the sockets of
+ * this machine. Used to benchmark and check the attribution without live interfaces.
+ *
+ * Each file is replayed by its own thread into its own counter bank, as an interface would be, and
+ * the counters are harvested every REPLAY_TICK_MS as the main loop does once per tick. The packets
+ * are loaded in memory first, so that the file reads are not measured.
+ *
+ * Port snapshot format (text, one record per line, written by --record-ports):
+ *
+ *	address <ip>                  an address of the capture interfaces, tells sent from received
+ *	port <tcp|udp> <port> <pid>   the owner of a port
+ *	socket <tcp|udp> <pid> <local ip> <local port> <remote ip> <remote port>
+ *	                              a socket, its addresses are 0.0.0.0 or :: when not bound or
+ *	                              connected
+ *
+ * Empty lines and lines starting with # are skipped.
+ */
+
+#include "PacketReplay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "ProcessNetDataGatherer.h"
+
+using namespace std;
+
+typedef struct replay_packet {
+	size_t offset; // In the bytes of the file.
+	uint32_t caplen;
+	uint32_t length; // On the wire.
+	int64_t time_us; // Capture time.
+} replay_packet;
+
+typedef struct replay_file {
+	string path;
+	const link_decoder* decoder;
+	vector<uint8_t> bytes;
+	vector<replay_packet> packets;
+	port_counter_bank* counters;
+	uint64_t counted_tx; // Bytes counted by the parser, attributed or not.
+	uint64_t counted_rx;
+	chrono::steady_clock::duration busy; // Time spent reading packets, without the waits.
+	chrono::steady_clock::time_point finished;
+} replay_file;
+
+static const char* protocol_name(const uint8_t protocol) {
+	return protocol == PROTOCOL_TCP ? "tcp" : "udp";
+}
+
+static bool parse_protocol(const string& name, uint8_t* protocol) {
+	if (name == "tcp") {
+		*protocol = PROTOCOL_TCP;
+		return true;
+	}
+	if (name == "udp") {
+		*protocol = PROTOCOL_UDP;
+		return true;
+	}
+	return false;
+}
+
+static string address_text(const uint8_t ip_version, const uint8_t* address) {
+	char text[INET6_ADDRSTRLEN];
+	if (inet_ntop(ip_version == 4 ? AF_INET : AF_INET6, address, text, sizeof(text)) == nullptr) {
+		return "";
+	}
+	return text;
+}
+
+static bool parse_address(const string& text, uint8_t* address, uint8_t* ip_version) {
+	if (inet_pton(AF_INET, text.c_str(), address) == 1) {
+		*ip_version = 4;
+		return true;
+	}
+	if (inet_pton(AF_INET6, text.c_str(), address) == 1) {
+		*ip_version = 6;
+		return true;
+	}
+	return false;
+}
+
+static bool add_local_address_text(local_addresses* addresses, const string& text) {
+	uint8_t address[16];
+	uint8_t ip_version;
+	if (!parse_address(text, address, &ip_version)) {
+		return false;
+	}
+
+	if (ip_version == 4) {
+		sockaddr_in ipv4 = {};
+		ipv4.sin_family = AF_INET;
+		memcpy(&ipv4.sin_addr, address, 4);
+		return add_local_address(addresses, reinterpret_cast<const sockaddr*>(&ipv4));
+	}
+	sockaddr_in6 ipv6 = {};
+	ipv6.sin6_family = AF_INET6;
+	memcpy(&ipv6.sin6_addr, address, 16);
+	return add_local_address(addresses, reinterpret_cast<const sockaddr*>(&ipv6));
+}
+
+/*
+ * Writes the addresses of the capture interfaces and the owners of the TCP and UDP sockets of this
+ * machine to path (replaced if it exists), for --replay-ports. Used with --record-ports.
+ */
+bool record_port_snapshot(const string& path) {
+	map_ports_to_pid();
+	const shared_ptr<const port_owner_table> table = get_port_owner_table();
+
+	ofstream file(path, ios::out | ios::trunc);
+	if (!file) {
+		spdlog::error("Could not open the port snapshot {}", path);
+		return false;
+	}
+	file << "# Demeter port snapshot, see PacketReplay.cpp for the format\n";
+
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_if_t* devices;
+	if (pcap_findalldevs(&devices, errbuf) == 0) {
+		for (const pcap_if_t* device = devices; device != nullptr; device = device->next) {
+			for (const pcap_addr* address = device->addresses; address != nullptr; address = address->next) {
+				char text[INET6_ADDRSTRLEN];
+				if (address->addr != nullptr && get_ip_str(address->addr, text, sizeof(text)) != nullptr) {
+					file << "address " << text << "\n";
+				}
+			}
+		}
+		pcap_freealldevs(devices);
+	}
+	else {
+		spdlog::warn("Could not list the capture interfaces, the snapshot has no address: {}", errbuf);
+	}
+
+	for (int port = 0; port < 65536; port++) {
+		if (table->tcp_owner[port] != PORT_OWNER_NONE) {
+			file << "port tcp " << port << " " << table->owners[table->tcp_owner[port]] << "\n";
+		}
+		if (table->udp_owner[port] != PORT_OWNER_NONE) {
+			file << "port udp " << port << " " << table->owners[table->udp_owner[port]] << "\n";
+		}
+	}
+
+	for (const auto& [key, owner] : table->socket_owner) {
+		file << "socket " << protocol_name(key.protocol) << " " << table->owners[owner]
+			<< " " << address_text(key.ip_version, key.local_address) << " " << key.local_port
+			<< " " << address_text(key.ip_version, key.remote_address) << " " << key.remote_port << "\n";
+	}
+
+	file.close();
+	if (!file) {
+		spdlog::error("Could not write the port snapshot {}", path);
+		return false;
+	}
+	printf("Recorded %zu sockets of %zu processes to %s\n", table->socket_owner.size(), table->owners.size(), path.c_str());
+	return true;
+}
+
+/*
+ * Reads a snapshot written by record_port_snapshot into a port table and the local addresses.
+ * Returns nullptr when the file cannot be read, invalid lines are skipped with a warning.
+ */
+static shared_ptr<port_owner_table> load_port_snapshot(const string& path, local_addresses* addresses) {
+	ifstream file(path);
+	if (!file) {
+		spdlog::error("Could not open the port snapshot {}", path);
+		return nullptr;
+	}
+
+	const shared_ptr<port_owner_table> table = new_port_owner_table();
+	clear_local_addresses(addresses);
+
+	string line;
+	int line_number = 0;
+	while (getline(file, line)) {
+		line_number++;
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		istringstream fields(line);
+		string record;
+		string protocol_text;
+		uint8_t protocol = 0;
+		fields >> record;
+
+		bool valid = false;
+		if (record == "address") {
+			string text;
+			valid = (fields >> text) && add_local_address_text(addresses, text);
+		}
+		else if (record == "port") {
+			uint32_t port;
+			uint32_t pid;
+			valid = (fields >> protocol_text >> port >> pid) && parse_protocol(protocol_text, &protocol) && port < 65536;
+			if (valid) {
+				add_port_owner(table.get(), protocol == PROTOCOL_TCP ? table->tcp_owner : table->udp_owner, pid, static_cast<uint16_t>(port));
+			}
+		}
+		else if (record == "socket") {
+			uint32_t pid;
+			string local_text;
+			string remote_text;
+			uint32_t local_port;
+			uint32_t remote_port;
+			uint8_t local_address[16];
+			uint8_t remote_address[16];
+			uint8_t local_version;
+			uint8_t remote_version;
+			valid = (fields >> protocol_text >> pid >> local_text >> local_port >> remote_text >> remote_port)
+				&& parse_protocol(protocol_text, &protocol) && local_port < 65536 && remote_port < 65536
+				&& parse_address(local_text, local_address, &local_version) && parse_address(remote_text, remote_address, &remote_version)
+				&& local_version == remote_version;
+			if (valid) {
+				add_socket_owner(table.get(), make_flow_key(protocol, local_version, local_address, static_cast<uint16_t>(local_port), remote_address, static_cast<uint16_t>(remote_port)), pid);
+			}
+		}
+
+		if (!valid) {
+			spdlog::warn("Skipped line {} of the port snapshot {}: {}", line_number, path, line);
+		}
+	}
+	return table;
+}
+
+/*
+ * Loads every packet of a pcap or pcapng file in memory.
+ */
+static bool load_replay_file(const string& path, replay_file* file) {
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t* handle = pcap_open_offline(path.c_str(), errbuf);
+	if (handle == nullptr) {
+		printf("Could not open %s: %s\n", path.c_str(), errbuf);
+		return false;
+	}
+
+	const int link_type = pcap_datalink(handle);
+	file->path = path;
+	file->decoder = find_link_decoder(link_type);
+	if (file->decoder == nullptr) {
+		printf("Link type %d of %s not supported by the parser\n", link_type, path.c_str());
+		pcap_close(handle);
+		return false;
+	}
+
+	pcap_pkthdr* header;
+	const u_char* data;
+	int status;
+	while ((status = pcap_next_ex(handle, &header, &data)) == 1) {
+		const int64_t time_us = static_cast<int64_t>(header->ts.tv_sec) * 1000000 + header->ts.tv_usec;
+		file->packets.push_back({ file->bytes.size(), header->caplen, header->len, time_us });
+		file->bytes.insert(file->bytes.end(), data, data + header->caplen);
+	}
+	if (status == PCAP_ERROR) {
+		// A truncated or corrupted file, replaying part of it would skew the results.
+		printf("Could not read %s: %s\n", path.c_str(), pcap_geterr(handle));
+		pcap_close(handle);
+		return false;
+	}
+	pcap_close(handle);
+
+	file->counters = nullptr;
+	file->counted_tx = 0;
+	file->counted_rx = 0;
+	file->busy = chrono::steady_clock::duration::zero();
+	return true;
+}
+
+/*
+ * Replay thread of one file. With timing, each packet is counted when as much time has passed
+ * since begin as between base_us and its capture time.
+ */
+static void replay_packets(replay_file* file, const local_addresses* addresses, const bool timing, const chrono::steady_clock::time_point begin, const int64_t base_us) {
+	auto busy_begin = chrono::steady_clock::now();
+	for (const replay_packet& packet : file->packets) {
+		if (timing) {
+			const auto due = begin + chrono::microseconds(packet.time_us - base_us);
+			const auto now = chrono::steady_clock::now();
+			if (due > now) {
+				file->busy += now - busy_begin;
+				this_thread::sleep_until(due);
+				busy_begin = chrono::steady_clock::now();
+			}
+		}
+
+		parsed_packet parsed;
+		if (parse_packet(file->bytes.data() + packet.offset, packet.caplen, file->decoder, addresses, &parsed)) {
+			count_parsed_packet(file->counters, parsed, packet.length);
+			if (parsed.direction != DIRECTION_RECEIVED) {
+				file->counted_tx += packet.length;
+			}
+			if (parsed.direction != DIRECTION_SENT) {
+				file->counted_rx += packet.length;
+			}
+		}
+	}
+	file->finished = chrono::steady_clock::now();
+	file->busy += file->finished - busy_begin;
+}
+
+/*
+ * Replays the packets of the files (pcap or pcapng) through the network accounting, with the port
+ * table and addresses of the snapshot at snapshot_path, as fast as possible or at their original
+ * timing. Prints the packets per second, the time per packet (reading, parsing and counting, on
+ * the replay threads) and the bytes charged to each process. Used with --replay.
+ */
+void run_packet_replay(const vector<string>& paths, const string& snapshot_path, const bool timing) {
+	local_addresses addresses;
+	const shared_ptr<port_owner_table> table = load_port_snapshot(snapshot_path, &addresses);
+	if (table == nullptr) {
+		return;
+	}
+
+	vector<replay_file> files(paths.size());
+	size_t packets_count = 0;
+	int64_t base_us = INT64_MAX;
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!load_replay_file(paths[i], &files[i])) {
+			return;
+		}
+		packets_count += files[i].packets.size();
+		if (!files[i].packets.empty()) {
+			base_us = min(base_us, files[i].packets.front().time_us);
+		}
+	}
+	if (packets_count == 0) {
+		printf("No packets to replay\n");
+		return;
+	}
+
+	set_port_owner_table(table);
+	map<uint32_t, pair<uint64_t, uint64_t>> process_bytes;
+	const auto harvest = [&table, &process_bytes]() {
+		harvest_packet_counters();
+		for (const uint32_t pid : table->owners) {
+			process_bytes[pid].first += get_packet_sent_weight(pid);
+			process_bytes[pid].second += get_packet_received_weight(pid);
+		}
+	};
+
+	for (replay_file& file : files) {
+		file.counters = add_port_counter_bank();
+	}
+
+	atomic<size_t> finished_count = 0;
+	vector<thread> workers;
+	const auto begin = chrono::steady_clock::now();
+	for (replay_file& file : files) {
+		workers.emplace_back([&file, &addresses, timing, begin, base_us, &finished_count]() {
+			replay_packets(&file, &addresses, timing, begin, base_us);
+			finished_count++;
+		});
+	}
+
+	auto next_tick = begin + chrono::milliseconds(REPLAY_TICK_MS);
+	while (finished_count.load() < files.size()) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		if (chrono::steady_clock::now() >= next_tick) {
+			harvest();
+			next_tick += chrono::milliseconds(REPLAY_TICK_MS);
+		}
+	}
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	harvest();
+	for (replay_file& file : files) {
+		remove_port_counter_bank(file.counters);
+		file.counters = nullptr;
+	}
+
+	auto end = begin;
+	chrono::steady_clock::duration busy = chrono::steady_clock::duration::zero();
+	uint64_t counted_tx = 0;
+	uint64_t counted_rx = 0;
+	for (const replay_file& file : files) {
+		end = max(end, file.finished);
+		busy += file.busy;
+		counted_tx += file.counted_tx;
+		counted_rx += file.counted_rx;
+	}
+	const double seconds = chrono::duration<double>(end - begin).count();
+
+	printf("Replay of %zu packets from %zu files, %s\n", packets_count, files.size(), timing ? "at their original timing" : "as fast as possible");
+	printf("  %.0f packets/s, %.1f ns/packet, %.3f s\n",
+		packets_count / seconds, chrono::duration<double, nano>(busy).count() / packets_count, seconds);
+	printf("  %-12s %18s %18s\n", "PID", "Sent bytes", "Received bytes");
+	for (const auto& [pid, bytes] : process_bytes) {
+		if (bytes.first > 0 || bytes.second > 0) {
+			printf("  %-12u %18llu %18llu\n", pid, static_cast<unsigned long long>(bytes.first), static_cast<unsigned long long>(bytes.second));
+		}
+	}
+	printf("  %-12s %18llu %18llu\n", "Counted", static_cast<unsigned long long>(counted_tx), static_cast<unsigned long long>(counted_rx));
+}
\ No newline at end of file
@@ -0,0 +1,438 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the Linux capture backend, an alternative to the Npcap loop of
+ * ProcessNetDataGatherer built on AF_PACKET sockets with a TPACKET_V3 memory mapped ring.
+ *
+ * The kernel writes the packets (cut to CAPTURE_SNAPLEN by the socket filter) into blocks of the
+ * ring shared with the process. A worker wakes up once per block, parses every packet of the block
+ * in place and gives the block back: there is no system call per packet. Each interface is read by
+ * several sockets joined in a PACKET_FANOUT group, the kernel spreads the flows of the interface
+ * over them (a flow always goes to the same worker).
+ *
+ * Workers count into their own port_counter_bank, harvested with the other backends.
+ */
+
+#include "PacketRing.h"
+
+#ifdef __linux__
+
+#include <ifaddrs.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "DemeterLogger.h"
+#include "pcap.h"
+
+using namespace std;
+
+static atomic<bool> ring_running = false;
+static vector<ring_socket*> ring_sockets;
+static vector<thread> ring_workers;
+
+/*
+ * Compiles the capture filter of Ethernet frames (see build_capture_filter). The filter returns
+ * CAPTURE_SNAPLEN for accepted packets, so the kernel only copies their headers.
+ */
+static bool compile_ring_filter(const string& exclude, bpf_program* program) {
+	const string filter = build_capture_filter(find_link_decoder(LINK_TYPE_ETHERNET), exclude);
+
+	pcap_t* dead = pcap_open_dead(DLT_EN10MB, CAPTURE_SNAPLEN);
+	if (dead == nullptr) {
+		return false;
+	}
+	const bool compiled = pcap_compile(dead, program, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) == 0;
+	if (!compiled) {
+		spdlog::error("Couldn't compile the capture filter \"{}\": {}", filter, pcap_geterr(dead));
+	}
+	pcap_close(dead);
+	return compiled;
+}
+
+static void close_ring_socket(ring_socket* ring) {
+	if (ring->map != nullptr) {
+		munmap(ring->map, ring->map_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	delete ring;
+}
+
+/*
+ * Opens a capture socket on an interface, with its filter and ring, and joins the fanout group of
+ * the interface. Returns nullptr on failure.
+ */
+static ring_socket* open_ring_socket(const unsigned int interface_index, const int fanout_group, const bpf_program* filter) {
+	const auto ring = new ring_socket();
+	ring->map = nullptr;
+	ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (ring->fd < 0) {
+		spdlog::error("Couldn't open a packet socket: {}", strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+
+	// The filter is attached before binding, so that no unfiltered packet reaches the ring.
+	sock_fprog program = {};
+	program.len = static_cast<unsigned short>(filter->bf_len);
+	program.filter = reinterpret_cast<sock_filter*>(filter->bf_insns);
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0) {
+		spdlog::error("Couldn't attach the capture filter: {}", strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+
+	int version = TPACKET_V3;
+	tpacket_req3 request = {};
+	request.tp_block_size = RING_BLOCK_SIZE;
+	request.tp_block_nr = RING_BLOCKS;
+	request.tp_frame_size = RING_FRAME_SIZE;
+	request.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCKS;
+	request.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0
+		|| setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) != 0) {
+		spdlog::error("Couldn't set up the TPACKET_V3 ring: {}", strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+
+	ring->map_size = static_cast<size_t>(RING_BLOCK_SIZE) * RING_BLOCKS;
+	void* map = mmap(nullptr, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+	if (map == MAP_FAILED) {
+		spdlog::error("Couldn't map the packet ring: {}", strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+	ring->map = static_cast<uint8_t*>(map);
+
+	sockaddr_ll address = {};
+	address.sll_family = AF_PACKET;
+	address.sll_protocol = htons(ETH_P_ALL);
+	address.sll_ifindex = static_cast<int>(interface_index);
+	if (bind(ring->fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		spdlog::error("Couldn't bind the packet socket to interface {}: {}", interface_index, strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+
+	// Flow hash: both directions of a connection land on the same worker.
+	int fanout = (fanout_group & 0xFFFF) | (PACKET_FANOUT_HASH << 16);
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0) {
+		spdlog::error("Couldn't join fanout group {}: {}", fanout_group, strerror(errno));
+		close_ring_socket(ring);
+		return nullptr;
+	}
+
+	return ring;
+}
+
+/*
+ * Parses and counts every packet of a block handed over by the kernel.
+ */
+static void read_ring_block(ring_socket* ring, const tpacket_block_desc* block) {
+	const uint32_t packets_count = block->hdr.bh1.num_pkts;
+	auto header = reinterpret_cast<const tpacket3_hdr*>(reinterpret_cast<const uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt);
+
+	for (uint32_t i = 0; i < packets_count; i++) {
+		const uint8_t* frame = reinterpret_cast<const uint8_t*>(header) + header->tp_mac;
+		const auto link = reinterpret_cast<const sockaddr_ll*>(reinterpret_cast<const uint8_t*>(header) + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+		// The loopback shows every packet twice, leaving and arriving: only the arrival is counted,
+		// on both ports as with the Npcap loopback adapter.
+		if (!ring->loopback || link->sll_pkttype != PACKET_OUTGOING) {
+			parsed_packet parsed;
+			if (parse_packet(frame, header->tp_snaplen, ring->decoder, &ring->addresses, &parsed)) {
+				if (ring->loopback) {
+					parsed.direction = DIRECTION_LOOPBACK;
+				}
+				count_parsed_packet(ring->counters, parsed, header->tp_len);
+			}
+		}
+
+		header = reinterpret_cast<const tpacket3_hdr*>(reinterpret_cast<const uint8_t*>(header) + header->tp_next_offset);
+	}
+	ring->packets += packets_count;
+}
+
+/*
+ * Worker loop: waits for the next block of the ring to be handed over, reads it, gives it back.
+ */
+static void read_ring(ring_socket* ring, const atomic<bool>* running) {
+	uint32_t block_index = 0;
+	pollfd poll_fd = {};
+	poll_fd.fd = ring->fd;
+	poll_fd.events = POLLIN | POLLERR;
+
+	while (running->load(memory_order_relaxed)) {
+		const auto block = reinterpret_cast<tpacket_block_desc*>(ring->map + static_cast<size_t>(block_index) * RING_BLOCK_SIZE);
+		if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+			poll(&poll_fd, 1, 100);
+			continue;
+		}
+
+		read_ring_block(ring, block);
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		block_index = (block_index + 1) % RING_BLOCKS;
+	}
+}
+
+/*
+ * Returns the Ethernet and loopback interfaces that are up, with their addresses. Other link types
+ * are not read by the parser.
+ */
+static map<string, local_addresses> list_ring_interfaces(const bool loopback_capture) {
+	map<string, local_addresses> interfaces;
+	ifaddrs* addresses;
+	if (getifaddrs(&addresses) != 0) {
+		spdlog::error("Couldn't list the interfaces: {}", strerror(errno));
+		return interfaces;
+	}
+
+	const int probe = socket(AF_INET, SOCK_DGRAM, 0);
+	for (const ifaddrs* address = addresses; address != nullptr; address = address->ifa_next) {
+		const bool loopback = (address->ifa_flags & IFF_LOOPBACK) != 0;
+		if (loopback ? !loopback_capture : (address->ifa_flags & (IFF_UP | IFF_RUNNING)) != (IFF_UP | IFF_RUNNING)) {
+			continue;
+		}
+
+		if (!interfaces.contains(address->ifa_name)) {
+			ifreq request = {};
+			strncpy(request.ifr_name, address->ifa_name, IFNAMSIZ - 1);
+			if (probe < 0 || ioctl(probe, SIOCGIFHWADDR, &request) != 0
+				|| (request.ifr_hwaddr.sa_family != ARPHRD_ETHER && request.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)) {
+				continue;
+			}
+			clear_local_addresses(&interfaces[address->ifa_name]);
+		}
+		add_local_address(&interfaces[address->ifa_name], address->ifa_addr);
+	}
+
+	if (probe >= 0) {
+		close(probe);
+	}
+	freeifaddrs(addresses);
+	return interfaces;
+}
+
+/*
+ * Opens workers_count sockets per interface in a fanout group, each with its ring and worker. The
+ * filter is the capture filter of the Npcap backend. Returns the number of sockets opened, 0 when
+ * the interface could not be opened.
+ */
+static int open_ring_interface(const string& name, const local_addresses& addresses, const int workers_count, const bpf_program* filter, vector<ring_socket*>* sockets) {
+	const unsigned int interface_index = if_nametoindex(name.c_str());
+	if (interface_index == 0) {
+		return 0;
+	}
+	const int fanout_group = static_cast<int>(getpid() + interface_index);
+
+	int opened = 0;
+	for (int worker = 0; worker < workers_count; worker++) {
+		ring_socket* ring = open_ring_socket(interface_index, fanout_group, filter);
+		if (ring == nullptr) {
+			break;
+		}
+		ring->addresses = addresses;
+		ring->loopback = name == "lo";
+		ring->decoder = find_link_decoder(LINK_TYPE_ETHERNET); // The loopback also has Ethernet headers.
+		ring->packets = 0;
+		sockets->push_back(ring);
+		opened++;
+	}
+	return opened;
+}
+
+int start_packet_ring_sniffing(const int workers_count, const bool loopback_capture, const string& exclude) {
+	bpf_program filter;
+	if (!compile_ring_filter(exclude, &filter)) {
+		return 2;
+	}
+
+	for (const auto& [name, addresses] : list_ring_interfaces(loopback_capture)) {
+		const int opened = open_ring_interface(name, addresses, workers_count > 0 ? workers_count : 1, &filter, &ring_sockets);
+		if (opened > 0) {
+			spdlog::info("Opened {} with {} ring workers", name, opened);
+		}
+		else {
+			spdlog::info("Could not open {}", name);
+		}
+	}
+	pcap_freecode(&filter);
+
+	if (ring_sockets.empty()) {
+		spdlog::warn("Could not find interface");
+		return 2;
+	}
+
+	ring_running.store(true);
+	for (ring_socket* ring : ring_sockets) {
+		ring->counters = add_port_counter_bank();
+		ring_workers.emplace_back(read_ring, ring, &ring_running);
+	}
+	return 1;
+}
+
+void stop_packet_ring_sniffing() {
+	ring_running.store(false);
+	for (thread& worker : ring_workers) {
+		worker.join();
+	}
+	ring_workers.clear();
+	for (ring_socket* ring : ring_sockets) {
+		remove_port_counter_bank(ring->counters);
+		close_ring_socket(ring);
+	}
+	ring_sockets.clear();
+}
+
+static double process_cpu_seconds() {
+	timespec time;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+typedef struct benchmark_capture {
+	const link_decoder* decoder;
+	local_addresses addresses;
+	port_counter_bank* counters;
+	uint64_t packets;
+} benchmark_capture;
+
+static void count_benchmark_packet(u_char* user, const pcap_pkthdr* header, const u_char* packet) {
+	const auto capture = reinterpret_cast<benchmark_capture*>(user);
+	parsed_packet parsed;
+	if (parse_packet(packet, header->caplen, capture->decoder, &capture->addresses, &parsed)) {
+		count_parsed_packet(capture->counters, parsed, header->len);
+	}
+	capture->packets++;
+}
+
+static void print_benchmark_result(const char* backend, const uint64_t packets, const uint64_t drops, const double seconds, const double cpu_seconds) {
+	printf("  %-24s %12.0f packets/s, %6.1f%% CPU, %.1f ns CPU/packet, %llu dropped\n",
+		backend, packets / seconds, 100.0 * cpu_seconds / seconds,
+		packets > 0 ? cpu_seconds * 1e9 / packets : 0.0, static_cast<unsigned long long>(drops));
+}
+
+/*
+ * Captures the traffic of an interface for the given seconds with libpcap (pcap_dispatch, one
+ * callback per packet), then for as long with the ring and workers_count workers, and prints the
+ * packets per second and the CPU time of each. Both parse and count every packet. The traffic is
+ * not generated here: run a steady load (e.g. iperf3) on the interface meanwhile.
+ */
+void run_packet_ring_benchmark(const string& name, const int seconds, const int workers_count) {
+	const auto addresses = list_ring_interfaces(true);
+	if (!addresses.contains(name)) {
+		printf("Unknown or unsupported interface %s\n", name.c_str());
+		return;
+	}
+
+	bpf_program filter;
+	if (!compile_ring_filter("", &filter)) {
+		return;
+	}
+	printf("Capture benchmark on %s, %d s per backend\n", name.c_str(), seconds);
+
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t* handle = pcap_open_live(name.c_str(), CAPTURE_SNAPLEN, 0, 100, errbuf);
+	if (handle == nullptr) {
+		printf("Couldn't open %s with libpcap: %s\n", name.c_str(), errbuf);
+	}
+	else {
+		pcap_setfilter(handle, &filter);
+		benchmark_capture capture;
+		capture.decoder = find_link_decoder(pcap_datalink(handle));
+		capture.addresses = addresses.at(name);
+		capture.counters = add_port_counter_bank();
+		capture.packets = 0;
+
+		const double cpu_begin = process_cpu_seconds();
+		const auto begin = chrono::steady_clock::now();
+		while (chrono::steady_clock::now() - begin < chrono::seconds(seconds)) {
+			pcap_dispatch(handle, -1, count_benchmark_packet, reinterpret_cast<u_char*>(&capture));
+		}
+		const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+		const double cpu_seconds = process_cpu_seconds() - cpu_begin;
+
+		pcap_stat stats = {};
+		pcap_stats(handle, &stats);
+		pcap_close(handle);
+		remove_port_counter_bank(capture.counters);
+		print_benchmark_result("libpcap", capture.packets, stats.ps_drop, elapsed, cpu_seconds);
+	}
+
+	vector<ring_socket*> sockets;
+	if (open_ring_interface(name, addresses.at(name), workers_count > 0 ? workers_count : 1, &filter, &sockets) == 0) {
+		printf("Couldn't open %s with the packet ring\n", name.c_str());
+		pcap_freecode(&filter);
+		return;
+	}
+	pcap_freecode(&filter);
+
+	atomic<bool> running = true;
+	vector<thread> workers;
+	const double cpu_begin = process_cpu_seconds();
+	const auto begin = chrono::steady_clock::now();
+	for (ring_socket* ring : sockets) {
+		ring->counters = add_port_counter_bank();
+		workers.emplace_back(read_ring, ring, &running);
+	}
+	this_thread::sleep_for(chrono::seconds(seconds));
+	running.store(false);
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+	const double cpu_seconds = process_cpu_seconds() - cpu_begin;
+
+	uint64_t packets = 0;
+	uint64_t drops = 0;
+	for (ring_socket* ring : sockets) {
+		tpacket_stats_v3 stats = {};
+		socklen_t length = sizeof(stats);
+		if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0) {
+			drops += stats.tp_drops;
+		}
+		packets += ring->packets;
+		remove_port_counter_bank(ring->counters);
+		close_ring_socket(ring);
+	}
+
+	const string backend = "TPACKET_V3, " + to_string(sockets.size()) + " workers";
+	print_benchmark_result(backend.c_str(), packets, drops, elapsed, cpu_seconds);
+}
+
+#endif
\ No newline at end of file
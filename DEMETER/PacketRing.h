@@ -0,0 +1,53 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <cstdint>
+#include <string>
+
+#include "PacketParser.h"
+#include "PortCounters.h"
+
+// Geometry of the TPACKET_V3 ring of each capture socket: the kernel fills whole blocks and hands
+// them over when full or after RING_BLOCK_TIMEOUT_MS.
+constexpr uint32_t RING_BLOCK_SIZE = 1 << 18;
+constexpr uint32_t RING_BLOCKS = 32;
+constexpr uint32_t RING_FRAME_SIZE = 512; // Header and CAPTURE_SNAPLEN bytes, aligned.
+constexpr uint32_t RING_BLOCK_TIMEOUT_MS = 50;
+
+// One AF_PACKET socket of a fanout group and its mapped ring, read by one worker thread.
+typedef struct ring_socket {
+	int fd;
+	uint8_t* map;
+	size_t map_size;
+	bool loopback;
+	const link_decoder* decoder;
+	local_addresses addresses;
+	port_counter_bank* counters;
+	uint64_t packets; // Packets read by the worker.
+} ring_socket;
+
+int start_packet_ring_sniffing(int, bool, const std::string&);
+
+void stop_packet_ring_sniffing();
+
+void run_packet_ring_benchmark(const std::string&, int, int);
+
+#endif
\ No newline at end of file
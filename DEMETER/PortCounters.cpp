@@ -0,0 +1,210 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the per port byte counters of the capture threads, shared by the capture
+ * backends (Npcap in ProcessNetDataGatherer, the packet ring on Linux), and the port owner table
+ * filled by the port table backends (the IP helper tables on Windows, sock_diag on Linux).
+ *
+ * Each capture thread owns a bank and counts into it without locks, the main thread harvests every
+ * bank once per tick.
+ */
+
+#include "PortCounters.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static atomic<uint32_t> capture_epoch = 0;
+static vector<port_counter_bank*> capture_banks; // Changed while no capture thread runs only.
+
+/*
+ * Returns a new bank for a capture thread, harvested with the others. Must be called before the
+ * capture threads start.
+ */
+port_counter_bank* add_port_counter_bank() {
+	const auto counters = new port_counter_bank();
+	capture_banks.push_back(counters);
+	return counters;
+}
+
+/*
+ * Releases a bank of add_port_counter_bank, once its capture thread stopped and its last counts
+ * were harvested. Must not be called while other capture threads run.
+ */
+void remove_port_counter_bank(port_counter_bank* counters) {
+	erase(capture_banks, counters);
+	delete counters;
+}
+
+/*
+ * Starts counting a packet in the bank of a capture thread, returns the bank to count into.
+ *
+ * The thread announces the epoch it counts in, then checks that the epoch did not move meanwhile:
+ * either it sees the new epoch, or harvest_port_counters sees the announcement and waits (both
+ * sides use sequentially consistent operations).
+ */
+static uint32_t begin_packet_count(port_counter_bank* counters) {
+	uint32_t epoch = capture_epoch.load();
+	while (true) {
+		counters->counting_epoch.store(epoch + 1);
+		const uint32_t current_epoch = capture_epoch.load();
+		if (current_epoch == epoch) {
+			return epoch & 1;
+		}
+		epoch = current_epoch;
+	}
+}
+
+static void end_packet_count(port_counter_bank* counters) {
+	counters->counting_epoch.store(0, memory_order_release);
+}
+
+/*
+ * Counts the length of a parsed packet in the flow of its local socket(s), or on its local port(s)
+ * when the flow table is full. Called by the owner of the bank only.
+ */
+void count_parsed_packet(port_counter_bank* counters, const parsed_packet& parsed, const uint32_t length) {
+	const bool sent = parsed.direction == DIRECTION_SENT || parsed.direction == DIRECTION_LOOPBACK;
+	const bool received = parsed.direction == DIRECTION_RECEIVED || parsed.direction == DIRECTION_LOOPBACK;
+	const bool sent_on_port = sent && !count_packet_flow(parsed, true, length);
+	const bool received_on_port = received && !count_packet_flow(parsed, false, length);
+	if (!sent_on_port && !received_on_port) {
+		return;
+	}
+
+	const uint32_t bank = begin_packet_count(counters);
+
+	if (sent_on_port) {
+		counters->tx[bank][parsed.src_port] += length;
+		counters->dirty[bank][parsed.src_port >> 6] |= 1ull << (parsed.src_port & 63);
+	}
+	if (received_on_port) {
+		counters->rx[bank][parsed.dst_port] += length;
+		counters->dirty[bank][parsed.dst_port >> 6] |= 1ull << (parsed.dst_port & 63);
+	}
+
+	end_packet_count(counters);
+}
+
+/*
+ * Adds the bytes counted by every capture thread since the previous call to tx and rx (65536
+ * ports each), and sets the ports counted in dirty (PORT_DIRTY_WORDS). Only the ports counted are
+ * read and cleared. Called from one thread only, once per tick.
+ */
+void harvest_port_counters(uint64_t* tx, uint64_t* rx, uint64_t* dirty) {
+	const uint32_t epoch = capture_epoch.fetch_add(1);
+	const uint32_t bank = epoch & 1;
+
+	for (port_counter_bank* counters : capture_banks) {
+		// A packet counted in the previous epoch is at most a few instructions away from done.
+		while (counters->counting_epoch.load() == epoch + 1) {
+			this_thread::yield();
+		}
+		atomic_thread_fence(memory_order_acquire);
+
+		for_each_dirty_port(counters->dirty[bank], [&](const uint16_t port) {
+			tx[port] += counters->tx[bank][port];
+			rx[port] += counters->rx[bank][port];
+			counters->tx[bank][port] = 0;
+			counters->rx[bank][port] = 0;
+		});
+		for (int word = 0; word < PORT_DIRTY_WORDS; word++) {
+			dirty[word] |= counters->dirty[bank][word];
+			counters->dirty[bank][word] = 0;
+		}
+	}
+}
+
+/*
+ * Returns an empty port table, every port without owner.
+ */
+shared_ptr<port_owner_table> new_port_owner_table() {
+	const auto table = make_shared<port_owner_table>();
+	fill(begin(table->tcp_owner), end(table->tcp_owner), PORT_OWNER_NONE);
+	fill(begin(table->udp_owner), end(table->udp_owner), PORT_OWNER_NONE);
+	return table;
+}
+
+static uint32_t get_owner_index(port_owner_table* table, const uint32_t pid) {
+	const auto [owner, added] = table->owner_index.try_emplace(pid, static_cast<uint32_t>(table->owners.size()));
+	if (added) {
+		table->owners.push_back(pid);
+	}
+	return owner->second;
+}
+
+/*
+ * Records that pid owns port in owners (tcp_owner or udp_owner of the table). Only the first owner
+ * of a port is kept: a port shared by several processes (or bound by different processes in IPv4
+ * and IPv6) is charged to one of them.
+ */
+void add_port_owner(port_owner_table* table, uint32_t* owners, const uint32_t pid, const uint16_t port) {
+	if (owners[port] == PORT_OWNER_NONE) {
+		owners[port] = get_owner_index(table, pid);
+	}
+}
+
+/*
+ * Records that pid owns the socket of key (see make_flow_key), and its port.
+ */
+void add_socket_owner(port_owner_table* table, const flow_key& key, const uint32_t pid) {
+	table->socket_owner.try_emplace(key, get_owner_index(table, pid));
+	add_port_owner(table, key.protocol == PROTOCOL_TCP ? table->tcp_owner : table->udp_owner, pid, key.local_port);
+}
+
+/*
+ * Returns the owner index of the socket of a flow, PORT_OWNER_NONE if none. The socket is looked up
+ * connected, then bound to the local address, then bound to every address (IPv4 flows also on dual
+ * stack IPv6 sockets). exact is set when found so, otherwise the owner of the port is returned.
+ */
+uint32_t find_flow_owner(const port_owner_table* table, const flow_key& key, bool* exact) {
+	*exact = true;
+	auto owner = table->socket_owner.find(key);
+	if (owner != table->socket_owner.end()) {
+		return owner->second;
+	}
+
+	flow_key bound = key;
+	bound.remote_port = 0;
+	memset(bound.remote_address, 0, sizeof(bound.remote_address));
+	owner = table->socket_owner.find(bound);
+	if (owner != table->socket_owner.end()) {
+		return owner->second;
+	}
+
+	memset(bound.local_address, 0, sizeof(bound.local_address));
+	owner = table->socket_owner.find(bound);
+	if (owner != table->socket_owner.end()) {
+		return owner->second;
+	}
+
+	if (key.ip_version == 4) {
+		bound.ip_version = 6;
+		owner = table->socket_owner.find(bound);
+		if (owner != table->socket_owner.end()) {
+			return owner->second;
+		}
+	}
+
+	*exact = false;
+	return key.protocol == PROTOCOL_TCP ? table->tcp_owner[key.local_port] : table->udp_owner[key.local_port];
+}
\ No newline at end of file
@@ -0,0 +1,80 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "FlowTable.h"
+#include "PacketParser.h"
+
+// Words of a dirty port bitmap, one bit per port.
+constexpr int PORT_DIRTY_WORDS = 65536 / 64;
+
+// Bytes counted by one capture thread, written by that thread only, without locks. The thread
+// counts into the bank of the current epoch, harvest_port_counters moves the epoch forward and
+// then reads and clears the bank of the previous one.
+typedef struct port_counter_bank {
+	std::atomic<uint32_t> counting_epoch; // Epoch + 1 while a packet is being counted, 0 otherwise.
+	uint64_t tx[2][65536];
+	uint64_t rx[2][65536];
+	uint64_t dirty[2][PORT_DIRTY_WORDS]; // Ports counted in the epoch.
+} port_counter_bank;
+
+constexpr uint32_t PORT_OWNER_NONE = 0xFFFFFFFF;
+
+// Owners of the local TCP and UDP ports, built whole by a port table backend and then only read.
+typedef struct port_owner_table {
+	uint32_t tcp_owner[65536]; // Index in owners of the first process bound to the port, PORT_OWNER_NONE if none.
+	uint32_t udp_owner[65536];
+	std::vector<uint32_t> owners; // PID of each owner index.
+	std::unordered_map<uint32_t, uint32_t> owner_index;
+	std::unordered_map<flow_key, uint32_t, flow_key_hash> socket_owner; // Owner index of each socket.
+} port_owner_table;
+
+port_counter_bank* add_port_counter_bank();
+
+void remove_port_counter_bank(port_counter_bank*);
+
+void count_parsed_packet(port_counter_bank*, const parsed_packet&, uint32_t);
+
+void harvest_port_counters(uint64_t*, uint64_t*, uint64_t*);
+
+std::shared_ptr<port_owner_table> new_port_owner_table();
+
+void add_port_owner(port_owner_table*, uint32_t*, uint32_t, uint16_t);
+
+void add_socket_owner(port_owner_table*, const flow_key&, uint32_t);
+
+uint32_t find_flow_owner(const port_owner_table*, const flow_key&, bool*);
+
+// Calls visit(port) for every port set in a dirty bitmap, in increasing order.
+template <typename Visitor>
+void for_each_dirty_port(const uint64_t* dirty, Visitor visit) {
+	for (int word = 0; word < PORT_DIRTY_WORDS; word++) {
+		uint64_t bits = dirty[word];
+		while (bits != 0) {
+			visit(static_cast<uint16_t>(word * 64 + std::countr_zero(bits)));
+			bits &= bits - 1;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,429 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the model energy source, used when no hardware energy counter can be read
+ * (virtual machines, AMD CPUs, missing Scaphandre driver).
+ *
+ * The package power is estimated from the total CPU utilization scaled by the current to maximum
+ * frequency ratio, with a quadratic curve. Its coefficients are read from a profile file, which
+ * CalibratePowerModel fits against a real counter on a reference machine.
+ */
+#include "PowerModel.h"
+
+#ifdef _WIN32
+
+#include <powerbase.h>
+#include <timeapi.h>
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <vector>
+
+#include "DemeterLogger.h"
+
+#pragma comment(lib, "PowrProf.lib")
+#pragma comment(lib, "winmm.lib")
+
+// Not declared by the SDK headers, see CallNtPowerInformation.
+typedef struct processor_power_information {
+    ULONG number;
+    ULONG max_mhz;
+    ULONG current_mhz;
+    ULONG mhz_limit;
+    ULONG max_idle_state;
+    ULONG current_idle_state;
+} processor_power_information;
+
+// Rough figures of a mobile CPU, only used without a profile.
+static constexpr power_model default_model = { 4.0, 14.0, 6.0 };
+
+static std::string profile_path = POWER_MODEL_DEFAULT_PROFILE;
+static power_model model = default_model;
+static DWORD processors_count;
+static ULARGE_INTEGER last_idle_time, last_kernel_time, last_user_time;
+static LARGE_INTEGER last_counter, counter_frequency;
+static bool frequency_readable = true;
+
+void SetPowerModelProfile(const std::string& path)
+{
+    profile_path = path;
+}
+
+static ULARGE_INTEGER toLargeInteger(const FILETIME& time)
+{
+    ULARGE_INTEGER value;
+    value.LowPart = time.dwLowDateTime;
+    value.HighPart = time.dwHighDateTime;
+    return value;
+}
+
+/**
+ * @brief Returns the average ratio of the current to the maximum frequency of the processors, 1
+ * when it cannot be read.
+ */
+static double readFrequencyRatio()
+{
+    if (!frequency_readable)
+    {
+        return 1.0;
+    }
+
+    std::vector<processor_power_information> processors(processors_count);
+    const auto size = static_cast<ULONG>(processors.size() * sizeof(processor_power_information));
+    if (CallNtPowerInformation(ProcessorInformation, nullptr, 0, processors.data(), size) != 0)
+    {
+        spdlog::warn("Processor frequencies cannot be read, the power model only uses utilization.");
+        frequency_readable = false;
+        return 1.0;
+    }
+
+    double ratio = 0.0;
+    for (const auto& processor : processors)
+    {
+        ratio += processor.max_mhz > 0 ? static_cast<double>(processor.current_mhz) / processor.max_mhz : 1.0;
+    }
+    return ratio / static_cast<double>(processors.size());
+}
+
+/**
+ * @brief Reads the load of the model since the previous call: CPU utilization (0 to 1) scaled by
+ * the frequency ratio.
+ *
+ * @param elapsed_seconds Receives the time since the previous call.
+ */
+static bool readLoad(double* load, double* elapsed_seconds)
+{
+    FILETIME idle_file_time, kernel_file_time, user_file_time;
+    if (!GetSystemTimes(&idle_file_time, &kernel_file_time, &user_file_time))
+    {
+        spdlog::error("GetSystemTimes failed. Error code: {}", GetLastError());
+        return false;
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    const ULARGE_INTEGER idle_time = toLargeInteger(idle_file_time);
+    const ULARGE_INTEGER kernel_time = toLargeInteger(kernel_file_time);
+    const ULARGE_INTEGER user_time = toLargeInteger(user_file_time);
+
+    // Kernel time includes idle time.
+    const ULONGLONG idle = idle_time.QuadPart - last_idle_time.QuadPart;
+    const ULONGLONG total = (kernel_time.QuadPart - last_kernel_time.QuadPart) + (user_time.QuadPart - last_user_time.QuadPart);
+    const double utilization = total > 0 ? static_cast<double>(idle < total ? total - idle : 0) / static_cast<double>(total) : 0.0;
+
+    *load = utilization * readFrequencyRatio();
+    *elapsed_seconds = static_cast<double>(counter.QuadPart - last_counter.QuadPart) / static_cast<double>(counter_frequency.QuadPart);
+
+    last_idle_time = idle_time;
+    last_kernel_time = kernel_time;
+    last_user_time = user_time;
+    last_counter = counter;
+    return true;
+}
+
+static double modelWatts(const power_model& fitted, const double load)
+{
+    const double watts = fitted.idle_watts + fitted.linear_watts * load + fitted.quadratic_watts * load * load;
+    return watts > 0.0 ? watts : 0.0;
+}
+
+static bool loadProfile(const std::string& path, power_model* loaded)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+
+    int found = 0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const size_t separator = line.find('=');
+        if (line.empty() || line[0] == '#' || separator == std::string::npos)
+        {
+            continue;
+        }
+        const std::string key = line.substr(0, separator);
+        const double value = strtod(line.c_str() + separator + 1, nullptr);
+        if (key == "idle_watts")
+        {
+            loaded->idle_watts = value;
+            found++;
+        }
+        else if (key == "linear_watts")
+        {
+            loaded->linear_watts = value;
+            found++;
+        }
+        else if (key == "quadratic_watts")
+        {
+            loaded->quadratic_watts = value;
+            found++;
+        }
+    }
+    return found == 3;
+}
+
+static bool saveProfile(const std::string& path, const power_model& fitted, const double rmse_watts)
+{
+    std::ofstream file(path, std::ofstream::out | std::ofstream::trunc);
+    file << "# Demeter power model, P = idle + linear * load + quadratic * load^2 (watts)\n";
+    file << "# Fitted by --calibrate-model, RMSE " << rmse_watts << " W\n";
+    file << "idle_watts=" << fitted.idle_watts << "\n";
+    file << "linear_watts=" << fitted.linear_watts << "\n";
+    file << "quadratic_watts=" << fitted.quadratic_watts << "\n";
+    return file.good();
+}
+
+/**
+ * @brief Loads the coefficients of the profile, or rough defaults if there is none.
+ *
+ * @return Returns 0, the model can always be used.
+ */
+int LoadPowerModel(bool)
+{
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    processors_count = system_info.dwNumberOfProcessors;
+    QueryPerformanceFrequency(&counter_frequency);
+
+    power_model loaded = default_model;
+    if (loadProfile(profile_path, &loaded))
+    {
+        model = loaded;
+        spdlog::info("Power model loaded from {}: {} + {} * load + {} * load^2 W", profile_path, model.idle_watts, model.linear_watts, model.quadratic_watts);
+    }
+    else
+    {
+        model = default_model;
+        spdlog::warn("No power model profile at {}, using generic coefficients. Run --calibrate-model on a reference machine for accurate estimates.", profile_path);
+    }
+
+    double load, elapsed_seconds;
+    readLoad(&load, &elapsed_seconds); // Starts the first window now.
+    return 0;
+}
+
+/**
+ * @brief Estimates the package energy consumed since the previous reading. Only the package domain
+ * is available.
+ */
+bool ReadPowerModelDomains(energy_reading* reading, bool)
+{
+    *reading = {};
+
+    double load, elapsed_seconds;
+    if (!readLoad(&load, &elapsed_seconds))
+    {
+        return false;
+    }
+
+    // Joules to milliwatt-hour.
+    reading->domains[ENERGY_DOMAIN_PKG] = static_cast<float>(modelWatts(model, load) * elapsed_seconds / 3.6);
+    reading->available[ENERGY_DOMAIN_PKG] = true;
+    reading->package = reading->domains[ENERGY_DOMAIN_PKG];
+    return true;
+}
+
+bool IsPowerModelPlatformUsed()
+{
+    return false;
+}
+
+void ClosePowerModel()
+{
+}
+
+// ----- Calibration
+
+typedef struct calibration_load {
+    std::atomic<double> duty_cycle;
+    std::atomic<bool> running;
+} calibration_load;
+
+/**
+ * @brief Keeps one processor busy for duty_cycle of every 10 ms slice.
+ */
+DWORD WINAPI calibrationLoadLoop(const LPVOID parameter)
+{
+    const auto load = static_cast<calibration_load*>(parameter);
+    LARGE_INTEGER frequency, begin, now;
+    QueryPerformanceFrequency(&frequency);
+    const LONGLONG slice = frequency.QuadPart / 100;
+
+    while (load->running.load())
+    {
+        const double duty_cycle = load->duty_cycle.load();
+        QueryPerformanceCounter(&begin);
+        do
+        {
+            QueryPerformanceCounter(&now);
+        } while (now.QuadPart - begin.QuadPart < static_cast<LONGLONG>(duty_cycle * slice));
+
+        if (duty_cycle < 1.0)
+        {
+            Sleep(static_cast<DWORD>((1.0 - duty_cycle) * 10.0));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Fits the coefficients by least squares on the (load, watts) samples.
+ */
+static bool fitModel(const std::vector<double>& loads, const std::vector<double>& watts, power_model* fitted)
+{
+    // Normal equations of watts = c0 + c1 * load + c2 * load^2.
+    double a[3][4] = {};
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+        const double features[3] = { 1.0, loads[i], loads[i] * loads[i] };
+        for (int row = 0; row < 3; row++)
+        {
+            for (int column = 0; column < 3; column++)
+            {
+                a[row][column] += features[row] * features[column];
+            }
+            a[row][3] += features[row] * watts[i];
+        }
+    }
+
+    // Gauss-Jordan elimination with partial pivoting.
+    for (int pivot = 0; pivot < 3; pivot++)
+    {
+        int best = pivot;
+        for (int row = pivot + 1; row < 3; row++)
+        {
+            if (fabs(a[row][pivot]) > fabs(a[best][pivot]))
+            {
+                best = row;
+            }
+        }
+        if (fabs(a[best][pivot]) < 1e-12)
+        {
+            return false;
+        }
+        for (int column = 0; column < 4; column++)
+        {
+            std::swap(a[pivot][column], a[best][column]);
+        }
+        for (int row = 0; row < 3; row++)
+        {
+            if (row == pivot)
+            {
+                continue;
+            }
+            const double factor = a[row][pivot] / a[pivot][pivot];
+            for (int column = pivot; column < 4; column++)
+            {
+                a[row][column] -= factor * a[pivot][column];
+            }
+        }
+    }
+
+    fitted->idle_watts = a[0][3] / a[0][0];
+    fitted->linear_watts = a[1][3] / a[1][1];
+    fitted->quadratic_watts = a[2][3] / a[2][2];
+    return true;
+}
+
+/**
+ * @brief Fits the model against the hardware energy source, which must be loaded, and saves it to
+ * the profile.
+ *
+ * Every processor is loaded with duty cycles from 0 to 100%, each held for step_seconds, while the
+ * load of the model and the real package power are sampled every second.
+ *
+ * @return Returns 0 if successful, otherwise returns 1.
+ */
+int CalibratePowerModel(const int step_seconds)
+{
+    constexpr double duty_cycles[] = { 0.0, 0.1, 0.25, 0.4, 0.55, 0.7, 0.85, 1.0 };
+
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    processors_count = system_info.dwNumberOfProcessors;
+    QueryPerformanceFrequency(&counter_frequency);
+
+    calibration_load load;
+    load.duty_cycle.store(0.0);
+    load.running.store(true);
+    timeBeginPeriod(1);
+    std::vector<HANDLE> threads;
+    for (DWORD i = 0; i < processors_count; i++)
+    {
+        threads.push_back(CreateThread(nullptr, 0, calibrationLoadLoop, &load, 0, nullptr));
+    }
+
+    std::vector<double> loads, watts;
+    for (const double duty_cycle : duty_cycles)
+    {
+        load.duty_cycle.store(duty_cycle);
+        Sleep(1000); // Lets frequency and power settle.
+
+        energy_reading reading;
+        double model_load, elapsed_seconds;
+        ReadEnergySource(&reading);
+        readLoad(&model_load, &elapsed_seconds);
+        for (int second = 0; second < step_seconds; second++)
+        {
+            Sleep(1000);
+            ReadEnergySource(&reading);
+            readLoad(&model_load, &elapsed_seconds);
+            // Milliwatt-hour to joules, over the elapsed time.
+            loads.push_back(model_load);
+            watts.push_back(reading.package * 3.6 / elapsed_seconds);
+        }
+        spdlog::info("Calibration: duty cycle {:.0f}%, load {:.3f}, {:.2f} W", duty_cycle * 100.0, loads.back(), watts.back());
+    }
+
+    load.running.store(false);
+    WaitForMultipleObjects(static_cast<DWORD>(threads.size()), threads.data(), TRUE, INFINITE);
+    for (const HANDLE thread : threads)
+    {
+        CloseHandle(thread);
+    }
+    timeEndPeriod(1);
+
+    power_model fitted;
+    if (!fitModel(loads, watts, &fitted))
+    {
+        spdlog::error("Calibration failed, the samples do not cover enough load levels.");
+        return 1;
+    }
+
+    double squared_error = 0.0;
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+        const double error = modelWatts(fitted, loads[i]) - watts[i];
+        squared_error += error * error;
+    }
+    const double rmse_watts = sqrt(squared_error / static_cast<double>(loads.size()));
+
+    if (!saveProfile(profile_path, fitted, rmse_watts))
+    {
+        spdlog::error("Could not write the power model profile {}", profile_path);
+        return 1;
+    }
+    spdlog::info("Power model saved to {}: {} + {} * load + {} * load^2 W, RMSE {:.2f} W", profile_path, fitted.idle_watts, fitted.linear_watts, fitted.quadratic_watts, rmse_watts);
+    return 0;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <Windows.h>
+#include <string>
+
+#include "EnergySource.h"
+
+constexpr const char* POWER_MODEL_DEFAULT_PROFILE = "power-model.txt";
+
+// Package power in watts, P = idle + linear * load + quadratic * load^2, where load is the CPU
+// utilization scaled by the current to maximum frequency ratio.
+typedef struct power_model {
+    double idle_watts;
+    double linear_watts;
+    double quadratic_watts;
+} power_model;
+
+void SetPowerModelProfile(const std::string&);
+
+int LoadPowerModel(bool = false);
+
+bool ReadPowerModelDomains(energy_reading*, bool = true);
+
+bool IsPowerModelPlatformUsed();
+
+void ClosePowerModel();
+
+int CalibratePowerModel(int);
+
+#endif
\ No newline at end of file
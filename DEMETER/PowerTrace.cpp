@@ -0,0 +1,304 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the power trace: every sample of the energy sampler is written to a binary
+ * file, so that short jobs can be looked at as a power waveform rather than as interval averages.
+ *
+ * The sampler thread only fills its lock-free ring (see EnergySampler), a writer thread follows the
+ * ring and appends the samples to the file. The windows of the main loop ticks and the markers sent
+ * by jobs are written to the same file, so that a trace can be cut along the CSV rows or along the
+ * phases of a job.
+ *
+ * File format (every integer is little endian):
+ *
+ *	header: u32 magic, u32 version, u32 domain count, u32 sample rate (Hz),
+ *	        i64 wall clock (ns since epoch) and u64 sampler clock (ns), taken together
+ *	records: u32 type, u32 payload length, payload
+ *	  SAMPLE: u64 time, u32 available domains (1 bit per domain), u32 reserved,
+ *	          u64 energy since the sampler started (uJ) per domain (PKG, PP0, PP1, DRAM, PSYS)
+ *	  TICK:   u64 window begin, u64 window end, i64 TIME of the rows of the tick
+ *	  MARKER: u64 time, label bytes
+ *
+ * Times are in nanoseconds on the sampler clock. Records are appended in batches, a TICK or MARKER
+ * can follow samples newer than itself: readers order them by time.
+ *
+ * Markers: a job connects to the Unix domain socket given with --power-trace-markers and sends one
+ * label per line. Each line is timestamped when received, the connection can stay open.
+ */
+
+#include "PowerTrace.h"
+
+#include <timeapi.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+#include "EnergySampler.h"
+
+using namespace std;
+
+static ofstream trace_file;
+static atomic<bool> trace_running = false;
+static HANDLE writer_thread = nullptr;
+static mutex pending_records_lock;
+static string pending_records; // TICK and MARKER records waiting for the writer.
+static UINT64 lost_samples = 0;
+static SOCKET marker_socket = INVALID_SOCKET;
+static string marker_path;
+
+constexpr SIZE_T max_marker_size = 1024;
+
+template <typename T>
+static void append_value(string& buffer, const T value) {
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void queue_record(const UINT32 type, const string& payload) {
+	lock_guard lock(pending_records_lock);
+	append_value<UINT32>(pending_records, type);
+	append_value<UINT32>(pending_records, static_cast<UINT32>(payload.size()));
+	pending_records += payload;
+}
+
+static void append_sample(string& buffer, const energy_totals& sample) {
+	UINT32 available = 0;
+	for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++) {
+		if (sample.available[domain]) {
+			available |= 1u << domain;
+		}
+	}
+
+	append_value<UINT32>(buffer, POWER_TRACE_SAMPLE);
+	append_value<UINT32>(buffer, static_cast<UINT32>(2 * sizeof(UINT64) + ENERGY_DOMAIN_COUNT * sizeof(UINT64)));
+	append_value<UINT64>(buffer, sample.time_ns);
+	append_value<UINT32>(buffer, available);
+	append_value<UINT32>(buffer, 0);
+	for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++) {
+		append_value<UINT64>(buffer, sample.energy_uj[domain]);
+	}
+}
+
+/*
+ * Appends the new samples of the ring and the queued records to the file, 20 times per second.
+ */
+DWORD WINAPI power_trace_writer_loop(LPVOID) {
+	UINT64 next_sample = GetEnergySampleCount();
+	string buffer;
+
+	while (true) {
+		const bool stopping = !trace_running.load();
+
+		const UINT64 samples_count = GetEnergySampleCount();
+		for (; next_sample < samples_count; next_sample++) {
+			energy_totals sample;
+			if (GetEnergySample(next_sample, &sample)) {
+				append_sample(buffer, sample);
+			}
+			else {
+				lost_samples++; // Overwritten before the writer got to it.
+			}
+		}
+
+		{
+			lock_guard lock(pending_records_lock);
+			buffer += pending_records;
+			pending_records.clear();
+		}
+
+		trace_file.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+		trace_file.flush();
+		buffer.clear();
+
+		if (stopping) {
+			return 0;
+		}
+		Sleep(50);
+	}
+}
+
+DWORD WINAPI power_trace_marker_client_loop(const LPVOID parameter) {
+	const auto client = reinterpret_cast<SOCKET>(parameter);
+	char buffer[1024];
+	string label;
+
+	int received;
+	while ((received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+		for (int i = 0; i < received; i++) {
+			if (buffer[i] == '\n') {
+				mark_power_trace(label);
+				label.clear();
+			}
+			else if (buffer[i] != '\r' && label.size() < max_marker_size) {
+				label += buffer[i];
+			}
+		}
+	}
+	if (!label.empty()) {
+		mark_power_trace(label);
+	}
+
+	closesocket(client);
+	return 0;
+}
+
+DWORD WINAPI power_trace_marker_loop(LPVOID) {
+	while (true) {
+		const SOCKET client = accept(marker_socket, nullptr, nullptr);
+		if (client == INVALID_SOCKET) {
+			if (marker_socket == INVALID_SOCKET) {
+				return 0; // Trace stopped.
+			}
+			continue;
+		}
+
+		const HANDLE thread = CreateThread(nullptr, 0, power_trace_marker_client_loop, reinterpret_cast<LPVOID>(client), 0, nullptr);
+		if (thread == nullptr) {
+			spdlog::warn("Could not start a power trace marker thread.");
+			closesocket(client);
+			continue;
+		}
+		CloseHandle(thread);
+	}
+}
+
+static BOOL start_marker_listener(const string& path) {
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		spdlog::error("WSAStartup failed for the power trace markers.");
+		return FALSE;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		spdlog::error("Power trace marker socket path too long: {}", path);
+		return FALSE;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size());
+
+	marker_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (marker_socket == INVALID_SOCKET) {
+		spdlog::error("Could not create the power trace marker socket: {}", WSAGetLastError());
+		return FALSE;
+	}
+
+	DeleteFileA(path.c_str());
+	if (bind(marker_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+		|| listen(marker_socket, SOMAXCONN) == SOCKET_ERROR) {
+		spdlog::error("Could not listen on {} for the power trace markers: {}", path, WSAGetLastError());
+		closesocket(marker_socket);
+		marker_socket = INVALID_SOCKET;
+		return FALSE;
+	}
+	marker_path = path;
+
+	CreateThread(nullptr, 0, power_trace_marker_loop, nullptr, 0, nullptr);
+	spdlog::info("Power trace markers listening on {}", path);
+	return TRUE;
+}
+
+/*
+ * Starts writing the samples to the file at path (replaced if it exists). The energy sampler must
+ * be running, at the rate wanted for the trace. Markers are only listened for when marker_socket
+ * is not empty.
+ */
+BOOL start_power_trace(const string& path, const string& marker_socket_path) {
+	if (!IsEnergySamplerRunning()) {
+		spdlog::error("The power trace needs the energy sampler (--energy-sample-rate).");
+		return FALSE;
+	}
+
+	trace_file.open(path, ios::out | ios::binary | ios::trunc);
+	if (!trace_file) {
+		spdlog::error("Could not open the power trace file {}", path);
+		return FALSE;
+	}
+
+	const auto wall_clock = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	const UINT64 sampler_clock = EnergySamplerNow();
+	string header;
+	append_value<UINT32>(header, POWER_TRACE_MAGIC);
+	append_value<UINT32>(header, POWER_TRACE_VERSION);
+	append_value<UINT32>(header, ENERGY_DOMAIN_COUNT);
+	append_value<UINT32>(header, static_cast<UINT32>(GetEnergySamplerRate()));
+	append_value<INT64>(header, static_cast<INT64>(wall_clock));
+	append_value<UINT64>(header, sampler_clock);
+	trace_file.write(header.data(), static_cast<streamsize>(header.size()));
+
+	// The sampler sleeps between samples, the default timer resolution would cap it at 64 Hz.
+	timeBeginPeriod(1);
+
+	trace_running.store(true);
+	writer_thread = CreateThread(nullptr, 0, power_trace_writer_loop, nullptr, 0, nullptr);
+	spdlog::info("Power trace written to {} at {} Hz", path, GetEnergySamplerRate());
+
+	if (!marker_socket_path.empty() && !start_marker_listener(marker_socket_path)) {
+		spdlog::error("Failed to start the power trace markers");
+	}
+	return TRUE;
+}
+
+/*
+ * Records the energy window of a tick and the TIME of its rows. Called from the main loop once per
+ * tick.
+ */
+void mark_power_trace_tick(const UINT64 window_begin, const UINT64 window_end, const time_t timestamp) {
+	if (!trace_running.load()) return;
+
+	string payload;
+	append_value<UINT64>(payload, window_begin);
+	append_value<UINT64>(payload, window_end);
+	append_value<INT64>(payload, static_cast<INT64>(timestamp));
+	queue_record(POWER_TRACE_TICK, payload);
+}
+
+void mark_power_trace(const string& label) {
+	if (!trace_running.load()) return;
+
+	string payload;
+	append_value<UINT64>(payload, EnergySamplerNow());
+	payload += label;
+	queue_record(POWER_TRACE_MARKER, payload);
+}
+
+/*
+ * Flushes the samples taken so far and closes the file. Must be called before the sampler stops.
+ */
+void stop_power_trace() {
+	if (!trace_running.load()) return;
+
+	if (marker_socket != INVALID_SOCKET) {
+		const SOCKET socket_to_close = marker_socket;
+		marker_socket = INVALID_SOCKET;
+		closesocket(socket_to_close);
+		DeleteFileA(marker_path.c_str());
+	}
+
+	trace_running.store(false);
+	WaitForSingleObject(writer_thread, INFINITE);
+	CloseHandle(writer_thread);
+	writer_thread = nullptr;
+	trace_file.close();
+	timeEndPeriod(1);
+
+	if (lost_samples > 0) {
+		spdlog::warn("Power trace: {} samples lost, the writer could not keep up.", lost_samples);
+	}
+}
\ No newline at end of file
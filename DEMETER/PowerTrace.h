@@ -0,0 +1,45 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#define _WINSOCKAPI_
+
+#include <windows.h>
+#include <winsock2.h>
+#include <afunix.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "winmm.lib")
+
+#include <string>
+
+#include "DemeterLogger.h"
+
+constexpr UINT32 POWER_TRACE_MAGIC = 0x504D5444; // "DTMP"
+constexpr UINT32 POWER_TRACE_VERSION = 1;
+constexpr UINT32 POWER_TRACE_SAMPLE = 1;
+constexpr UINT32 POWER_TRACE_TICK = 2;
+constexpr UINT32 POWER_TRACE_MARKER = 3;
+
+BOOL start_power_trace(const std::string&, const std::string&);
+
+void mark_power_trace_tick(UINT64, UINT64, time_t);
+
+void mark_power_trace(const std::string&);
+
+void stop_power_trace();
\ No newline at end of file
@@ -0,0 +1,322 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the Linux energy source: the intel-rapl zones of the powercap sysfs tree.
+ *
+ * Every intel-rapl:<n> zone (one package per socket, or psys) and intel-rapl:<n>:<m> subzone
+ * (core, uncore, dram) is discovered when loading. Their energy_uj files are opened once and
+ * re-read with pread at every reading, each zone wrapping at its own max_energy_range_uj.
+ */
+#include "PowercapEnergy.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+#include "DemeterLogger.h"
+
+static const std::string powercap_root = POWERCAP_DEFAULT_ROOT;
+static std::vector<powercap_zone> zones;
+static bool use_platform_zone = false;
+
+static bool readZoneFile(const std::filesystem::path& path, std::string* value)
+{
+    std::ifstream file(path);
+    return static_cast<bool>(std::getline(file, *value));
+}
+
+static bool readEnergyCounter(const int fd, uint64_t* energy_uj)
+{
+    char buffer[32];
+    const ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (size <= 0)
+    {
+        return false;
+    }
+    buffer[size] = '\0';
+
+    char* end;
+    *energy_uj = strtoull(buffer, &end, 10);
+    return end != buffer;
+}
+
+static bool zoneDomain(const std::string& name, energy_domain* domain)
+{
+    if (name.starts_with("package-"))
+    {
+        *domain = ENERGY_DOMAIN_PKG;
+    }
+    else if (name == "core")
+    {
+        *domain = ENERGY_DOMAIN_PP0;
+    }
+    else if (name == "uncore")
+    {
+        *domain = ENERGY_DOMAIN_PP1;
+    }
+    else if (name == "dram")
+    {
+        *domain = ENERGY_DOMAIN_DRAM;
+    }
+    else if (name == "psys")
+    {
+        *domain = ENERGY_DOMAIN_PSYS;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Opens one zone and reads its first counter value.
+ *
+ * @return Returns false if the zone is unknown or its counter cannot be read (energy_uj is only
+ * readable by root on recent kernels).
+ */
+static bool openZone(const std::string& directory, const int package, powercap_zone* zone)
+{
+    const std::filesystem::path path = std::filesystem::path(powercap_root) / directory;
+    zone->path = path.string();
+    zone->package = package;
+
+    if (!readZoneFile(path / "name", &zone->name) || !zoneDomain(zone->name, &zone->domain))
+    {
+        spdlog::info("Powercap zone {} ignored.", directory);
+        return false;
+    }
+
+    std::string max_energy_range;
+    if (!readZoneFile(path / "max_energy_range_uj", &max_energy_range))
+    {
+        spdlog::error("Could not read the energy range of powercap zone {}.", directory);
+        return false;
+    }
+    zone->max_energy_range_uj = strtoull(max_energy_range.c_str(), nullptr, 10);
+
+    zone->energy_fd = open((path / "energy_uj").c_str(), O_RDONLY | O_CLOEXEC);
+    if (zone->energy_fd < 0)
+    {
+        spdlog::error("Could not open {}/energy_uj: {}", zone->path, strerror(errno));
+        return false;
+    }
+
+    if (!readEnergyCounter(zone->energy_fd, &zone->last_energy_uj))
+    {
+        spdlog::error("Could not read {}/energy_uj.", zone->path);
+        close(zone->energy_fd);
+        return false;
+    }
+    zone->last_delta_uj = 0;
+    return true;
+}
+
+/**
+ * @brief Discovers and opens every intel-rapl zone and subzone.
+ *
+ * Packages are numbered by their "package-<n>" name, subzones belong to the package of their
+ * parent zone.
+ *
+ * @param force_use_platform Boolean flag indicating whether to force using the psys zone.
+ * @return Returns 0 if successful, otherwise returns 1.
+ */
+int LoadPowercapZones(bool force_use_platform)
+{
+    if (!zones.empty())
+    {
+        spdlog::error("Powercap zones already loaded.");
+        return 1;
+    }
+
+    std::error_code error;
+    std::vector<std::string> directories;
+    for (const auto& entry : std::filesystem::directory_iterator(powercap_root, error))
+    {
+        directories.push_back(entry.path().filename().string());
+    }
+    if (error)
+    {
+        spdlog::error("Could not list {}: {}", powercap_root, error.message());
+        return 1;
+    }
+    std::sort(directories.begin(), directories.end());
+
+    // Zones first, so that the package of every parent is known before its subzones.
+    std::map<int, int> zone_packages;
+    for (const auto& directory : directories)
+    {
+        int index, subzone;
+        if (sscanf(directory.c_str(), "intel-rapl:%d:%d", &index, &subzone) != 1)
+        {
+            continue;
+        }
+
+        powercap_zone zone;
+        if (!openZone(directory, -1, &zone))
+        {
+            continue;
+        }
+        if (zone.domain == ENERGY_DOMAIN_PKG)
+        {
+            zone.package = atoi(zone.name.c_str() + strlen("package-"));
+        }
+        zone_packages[index] = zone.package;
+        zones.push_back(zone);
+    }
+
+    for (const auto& directory : directories)
+    {
+        int index, subzone;
+        if (sscanf(directory.c_str(), "intel-rapl:%d:%d", &index, &subzone) != 2)
+        {
+            continue;
+        }
+
+        const auto parent = zone_packages.find(index);
+        powercap_zone zone;
+        if (!openZone(directory, parent == zone_packages.end() ? -1 : parent->second, &zone))
+        {
+            continue;
+        }
+        zones.push_back(zone);
+    }
+
+    bool has_package = false;
+    bool has_platform = false;
+    for (const auto& zone : zones)
+    {
+        spdlog::info("Powercap zone {} ({}), package {}, range {} uJ", zone.path, zone.name, zone.package, zone.max_energy_range_uj);
+        has_package |= zone.domain == ENERGY_DOMAIN_PKG;
+        has_platform |= zone.domain == ENERGY_DOMAIN_PSYS;
+    }
+
+    if (!has_package)
+    {
+        spdlog::error("No intel-rapl package zone found under {}.", powercap_root);
+        ClosePowercapZones();
+        return 1;
+    }
+
+    if (force_use_platform)
+    {
+        if (has_platform)
+        {
+            spdlog::info("Forced psys zone usage");
+            use_platform_zone = true;
+        }
+        else
+        {
+            spdlog::error("No psys zone found, using the package zones.");
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reads the energy consumed by every domain since the previous reading.
+ *
+ * The zones of a domain are summed, so PKG and DRAM cover every socket. The package zones are
+ * also reported per socket.
+ *
+ * @param reading Receives the energy of each domain, in milliwatt-hour.
+ * @return Returns true if the package (or psys) domain could be read.
+ */
+bool ReadPowercapDomains(energy_reading* reading, bool)
+{
+    uint64_t domains_uj[ENERGY_DOMAIN_COUNT] = {};
+    uint64_t sockets_uj[ENERGY_MAX_SOCKETS] = {};
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        reading->available[domain] = false;
+    }
+    reading->sockets_count = 0;
+
+    for (auto& zone : zones)
+    {
+        uint64_t energy_uj;
+        if (!readEnergyCounter(zone.energy_fd, &energy_uj))
+        {
+            spdlog::error("Couldn't read {}/energy_uj.", zone.path);
+            zone.last_delta_uj = 0;
+            continue;
+        }
+
+        // The counter goes back to 0 after max_energy_range_uj, the step to 0 counts one more uJ.
+        zone.last_delta_uj = energy_uj >= zone.last_energy_uj
+            ? energy_uj - zone.last_energy_uj
+            : zone.max_energy_range_uj - zone.last_energy_uj + energy_uj + 1;
+        zone.last_energy_uj = energy_uj;
+
+        domains_uj[zone.domain] += zone.last_delta_uj;
+        reading->available[zone.domain] = true;
+
+        if (zone.domain == ENERGY_DOMAIN_PKG && zone.package >= 0 && zone.package < ENERGY_MAX_SOCKETS)
+        {
+            sockets_uj[zone.package] += zone.last_delta_uj;
+            reading->sockets_count = std::max(reading->sockets_count, zone.package + 1);
+        }
+    }
+
+    for (int domain = 0; domain < ENERGY_DOMAIN_COUNT; domain++)
+    {
+        // 1 mWh = 3.6 J = 3600000 uJ.
+        reading->domains[domain] = static_cast<float>(static_cast<double>(domains_uj[domain]) / 3600000.0);
+    }
+    for (int socket = 0; socket < ENERGY_MAX_SOCKETS; socket++)
+    {
+        reading->sockets[socket] = static_cast<float>(static_cast<double>(sockets_uj[socket]) / 3600000.0);
+    }
+
+    const energy_domain package_domain = use_platform_zone ? ENERGY_DOMAIN_PSYS : ENERGY_DOMAIN_PKG;
+    reading->package = reading->domains[package_domain];
+    return reading->available[package_domain];
+}
+
+bool IsPowercapPlatformUsed()
+{
+    return use_platform_zone;
+}
+
+const std::vector<powercap_zone>& GetPowercapZones()
+{
+    return zones;
+}
+
+void ClosePowercapZones()
+{
+    for (const auto& zone : zones)
+    {
+        close(zone.energy_fd);
+    }
+    zones.clear();
+    use_platform_zone = false;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "EnergySource.h"
+
+constexpr const char* POWERCAP_DEFAULT_ROOT = "/sys/class/powercap";
+
+// One intel-rapl zone or subzone, its energy_uj file is kept open between readings.
+typedef struct powercap_zone {
+    std::string path;
+    std::string name; // "package-0", "core", "uncore", "dram", "psys"...
+    energy_domain domain;
+    int package; // Socket of the zone, -1 for psys.
+    int energy_fd;
+    uint64_t max_energy_range_uj;
+    uint64_t last_energy_uj;
+    uint64_t last_delta_uj; // Energy of the zone in the last reading.
+} powercap_zone;
+
+int LoadPowercapZones(bool = false);
+
+bool ReadPowercapDomains(energy_reading*, bool = true);
+
+bool IsPowercapPlatformUsed();
+
+const std::vector<powercap_zone>& GetPowercapZones();
+
+void ClosePowercapZones();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file interns process names.
+ *
+ * Every distinct process name gets a small integer ID, so that consumers can key their data by ID
+ * instead of hashing and copying strings every tick. IDs are attributed in order, starting at 0.
+ * A name not interned for PROCESS_NAME_RETENTION seconds (a full hourly rollup window) is evicted
+ * by evict_process_names, and its ID is given to the next new name: the table, and the data keyed
+ * by ID, stay bounded by the names seen over the last hour rather than since Demeter started.
+ * Consumers keeping data by ID drop that of the evicted IDs.
+ *
+ * Only the main loop interns names, hence no locking.
+ */
+
+#include "ProcessNameTable.h"
+
+#include <ctime>
+#include <limits>
+#include <unordered_map>
+
+using namespace std;
+
+constexpr time_t PROCESS_NAME_RETENTION = 3600;
+constexpr time_t NAME_FREE = numeric_limits<time_t>::max(); // Last seen time of a free ID.
+
+static unordered_map<string, UINT32> name_ids;
+static vector<string> names;
+static vector<time_t> last_seen; // By ID, when the name was last interned.
+static vector<UINT32> free_ids;
+
+UINT32 intern_process_name(const string& name) {
+	const time_t now = time(nullptr);
+	const auto it = name_ids.find(name);
+	if (it != name_ids.end()) {
+		last_seen[it->second] = now;
+		return it->second;
+	}
+
+	UINT32 id;
+	if (!free_ids.empty()) {
+		id = free_ids.back();
+		free_ids.pop_back();
+		names[id] = name;
+		last_seen[id] = now;
+	}
+	else {
+		id = static_cast<UINT32>(names.size());
+		names.push_back(name);
+		last_seen.push_back(now);
+	}
+	name_ids.emplace(name, id);
+	return id;
+}
+
+const string& get_interned_process_name(const UINT32 id) {
+	return names[id];
+}
+
+/*
+ * Returns one past the largest ID given so far, the size of a vector indexed by ID.
+ */
+SIZE_T get_interned_process_names_count() {
+	return names.size();
+}
+
+/*
+ * Evicts the names not interned during the PROCESS_NAME_RETENTION seconds before now, and returns
+ * their IDs, free for reuse from now on.
+ */
+vector<UINT32> evict_process_names(const time_t now) {
+	vector<UINT32> evicted;
+	for (UINT32 id = 0; id < names.size(); id++) {
+		if (last_seen[id] != NAME_FREE && now - last_seen[id] >= PROCESS_NAME_RETENTION) {
+			name_ids.erase(names[id]);
+			names[id].clear();
+			last_seen[id] = NAME_FREE;
+			free_ids.push_back(id);
+			evicted.push_back(id);
+		}
+	}
+	return evicted;
+}
\ No newline at end of file
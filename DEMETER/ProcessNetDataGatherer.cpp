@@ -35,110 +35,61 @@
 
 #include "ProcessNetDataGatherer.h"
 
-#include <ranges>
+#include <algorithm>
 
 using namespace std;
 
 // To ensure correct resolution of symbols, add Psapi.lib to TARGETLIBS
 // and compile with -DPSAPI_VERSION=1
 
-// Port <-> PID mapping
-static std::map<DWORD, vector<u_short>*> process_port_map;
-static std::map<DWORD, SIZE_T> process_port_size;
-static std::recursive_mutex pid_port_map_lock;
-static std::recursive_mutex pid_port_size_map_lock;
+// Port <-> PID mapping, rebuilt by the port table thread and swapped in whole. Readers keep the
+// table they loaded alive until they drop it.
+static std::atomic<std::shared_ptr<const port_owner_table>> port_table;
+static HANDLE port_table_thread = nullptr;
+static HANDLE port_table_refresh = nullptr; // Auto reset event, set to rebuild the table.
 
-// Port bandwidth
-static UINT tx_port_packet_counts[65536];
-static UINT rx_port_packet_counts[65536];
-static std::recursive_mutex tx_port_packet_map_lock;
-static std::recursive_mutex rx_port_packet_map_lock;
+// Port bandwidth, harvested from every capture thread at each tick (main thread only).
+static uint64_t tx_port_packet_counts[65536];
+static uint64_t rx_port_packet_counts[65536];
+static uint64_t dirty_ports[PORT_DIRTY_WORDS]; // Ports with traffic in the last tick.
+
+// Bandwidth of each owner of the port table the last tick was aggregated with (main thread only).
+static shared_ptr<const port_owner_table> totals_table;
+static vector<ULONGLONG> tx_owner_bytes;
+static vector<ULONGLONG> rx_owner_bytes;
+// Bandwidth of the flows whose owner is no longer in the port table (its socket closed).
+static std::unordered_map<DWORD, pair<ULONGLONG, ULONGLONG>> departed_owner_bytes;
 
 // ----- Utils data structures (used for npcap loop inter thread values)
 typedef struct thread_data {
 	pcap_t* handle;
 	pcap_if_t* dev;
+	const link_decoder* decoder;
+	port_counter_bank* counters;
 } thread_data, *pthread_data;
 
 typedef struct loop_data {
-	int linkType;
-	char* addresses;
+	const link_decoder* decoder;
+	local_addresses addresses;
+	port_counter_bank* counters;
 } loop_data, *ploop_data;
 
 static int opened_handles_count;
 static pcap_t** opened_handles = nullptr;
 
 static bool loopback_capture = true;
+static string capture_exclude; // BPF expression of the traffic not captured, empty for none.
 // -----
 
 void set_loopback_capture(const bool capture) {
 	loopback_capture = capture;
 }
 
-void reset_port_map(const DWORD pid) {
-	pid_port_map_lock.lock();
-	pid_port_size_map_lock.lock();
-	process_port_map.erase(pid);
-	process_port_size[pid] = 0;
-	pid_port_size_map_lock.unlock();
-	pid_port_map_lock.unlock();
-}
-
-void alloc_port_map(const DWORD pid) {
-	pid_port_map_lock.lock();
-	pid_port_size_map_lock.lock();
-	process_port_map[pid] = new vector<u_short>(1, 0);
-	if (process_port_map[pid] == nullptr) {
-		spdlog::critical("Could not allocate memory for pid array");
-		exit(1);
-	}
-	process_port_size[pid] = 0;
-	pid_port_size_map_lock.unlock();
-	pid_port_map_lock.unlock();
-}
-
-void add_port_to_map(const DWORD pid, const u_short port) {
-	pid_port_map_lock.lock();
-	if (!process_port_map.contains(pid)) {
-		alloc_port_map(pid);
-	}
-
-	pid_port_size_map_lock.lock();
-	const SIZE_T index = process_port_size[pid];
-	const vector<u_short> ports = *process_port_map[pid];
-
-	// Adding port only if it is not already present
-	boolean found = false;
-	for (unsigned int i = 0; i < index; i++) {
-		if (!found && (ports[i] == port)) {
-			found = true;
-		}
-	}
-
-	if (!found) {
-		process_port_map[pid]->push_back(port);
-		process_port_size[pid] = index + 1;
-	}
- 	
-	pid_port_size_map_lock.unlock();
-	pid_port_map_lock.unlock();
-}
-
-void clear_pid_port_map() {
-	pid_port_map_lock.lock();
-	pid_port_size_map_lock.lock();
-
-	for (const auto& snd : process_port_map | views::values) { delete snd; }
-
-	process_port_size.clear();
-
-	process_port_map.clear();
-	
-	pid_port_size_map_lock.unlock();
-	pid_port_map_lock.unlock();
+void set_capture_exclude(const string& exclude) {
+	capture_exclude = exclude;
 }
 
-void update_tcp4() {
+void update_tcp4(port_owner_table* table) {
 	// STATIC MALLOC
 	static auto tcp_table = static_cast<MIB_TCPTABLE2*>(malloc(sizeof(MIB_TCPTABLE2))); 
 	ULONG mib_tcptable_size;
@@ -165,9 +116,11 @@ void update_tcp4() {
 	// Loop over TCP table values
 	if (return_code == NO_ERROR) {
 		for (int i = 0; i < static_cast<int>(tcp_table->dwNumEntries); i++) {
-			const DWORD pid = tcp_table->table[i].dwOwningPid;
-			const u_short port = ntohs((u_short)tcp_table->table[i].dwLocalPort);
-			add_port_to_map(pid, port);
+			const MIB_TCPROW2& row = tcp_table->table[i];
+			const flow_key key = make_flow_key(PROTOCOL_TCP, 4,
+				reinterpret_cast<const uint8_t*>(&row.dwLocalAddr), ntohs((u_short)row.dwLocalPort),
+				reinterpret_cast<const uint8_t*>(&row.dwRemoteAddr), ntohs((u_short)row.dwRemotePort));
+			add_socket_owner(table, key, row.dwOwningPid);
 		}
 	}
 	else {
@@ -175,7 +128,7 @@ void update_tcp4() {
 	}
 }
 
-void update_tcp6() {
+void update_tcp6(port_owner_table* table) {
 	// STATIC MALLOC
 	static auto tcp_table = static_cast<MIB_TCP6TABLE2*>(malloc(sizeof(MIB_TCP6TABLE2))); 
 	DWORD mib_tcptable_size;
@@ -202,9 +155,11 @@ void update_tcp6() {
 	// Loop over tcp table values
 	if (return_code == NO_ERROR) {
 		for (int i = 0; i < static_cast<int>(tcp_table->dwNumEntries); i++) {
-			const DWORD pid = tcp_table->table[i].dwOwningPid;
-			const u_short port = ntohs((u_short)tcp_table->table[i].dwLocalPort);
-			add_port_to_map(pid, port);
+			const MIB_TCP6ROW2& row = tcp_table->table[i];
+			const flow_key key = make_flow_key(PROTOCOL_TCP, 6,
+				reinterpret_cast<const uint8_t*>(&row.LocalAddr), ntohs((u_short)row.dwLocalPort),
+				reinterpret_cast<const uint8_t*>(&row.RemoteAddr), ntohs((u_short)row.dwRemotePort));
+			add_socket_owner(table, key, row.dwOwningPid);
 		}
 	}
 	else {
@@ -212,12 +167,12 @@ void update_tcp6() {
 	}
 }
 
-void update_tcp() {
-	update_tcp4();
-	update_tcp6();
+void update_tcp(port_owner_table* table) {
+	update_tcp4(table);
+	update_tcp6(table);
 }
 
-void update_udp(const ULONG ul_af) {
+void update_udp(port_owner_table* table, const ULONG ul_af) {
 	// STATIC MALLOC
 	static auto udp_table = static_cast<MIB_UDPTABLE_OWNER_PID*>(malloc(sizeof(MIB_UDPTABLE_OWNER_PID))); 
 	DWORD mib_udptable_size;
@@ -256,10 +211,20 @@ void update_udp(const ULONG ul_af) {
 
 	// Loop over udp table values
 	if (return_code == NO_ERROR) {
-		for (int i = 0; i < static_cast<int>(udp_table->dwNumEntries); i++) {
-			const DWORD pid = udp_table->table[i].dwOwningPid;
-			const u_short port = ntohs((u_short)udp_table->table[i].dwLocalPort);
-			add_port_to_map(pid, port);
+		if (ul_af == AF_INET6) { // Same header, IPv6 rows.
+			const auto udp6_table = reinterpret_cast<const MIB_UDP6TABLE_OWNER_PID*>(udp_table);
+			for (int i = 0; i < static_cast<int>(udp6_table->dwNumEntries); i++) {
+				const MIB_UDP6ROW_OWNER_PID& row = udp6_table->table[i];
+				const flow_key key = make_flow_key(PROTOCOL_UDP, 6, row.ucLocalAddr, ntohs((u_short)row.dwLocalPort), nullptr, 0);
+				add_socket_owner(table, key, row.dwOwningPid);
+			}
+		}
+		else {
+			for (int i = 0; i < static_cast<int>(udp_table->dwNumEntries); i++) {
+				const MIB_UDPROW_OWNER_PID& row = udp_table->table[i];
+				const flow_key key = make_flow_key(PROTOCOL_UDP, 4, reinterpret_cast<const uint8_t*>(&row.dwLocalAddr), ntohs((u_short)row.dwLocalPort), nullptr, 0);
+				add_socket_owner(table, key, row.dwOwningPid);
+			}
 		}
 	}
 	else {
@@ -267,120 +232,168 @@ void update_udp(const ULONG ul_af) {
 	}
 }
 
-void update_udp() {
-	update_udp(AF_INET);
-	update_udp(AF_INET6);
+void update_udp(port_owner_table* table) {
+	update_udp(table, AF_INET);
+	update_udp(table, AF_INET6);
 }
 
-void map_ports_to_pid() {
-	// Useless to update two times (or more) at the same time the pid port map
-	const bool map_locked = pid_port_map_lock.try_lock();
-	if (!map_locked) {
-		return;
-	}
-	if (!pid_port_size_map_lock.try_lock()) {
-		if (map_locked) {
-			pid_port_map_lock.unlock();
-		}
-		return;
-	}
-	clear_pid_port_map();
-	update_udp();
-	update_tcp();
+/*
+ * Builds a new port table from the TCP and UDP tables of the system and publishes it. Only called
+ * from one thread at a time (the GetTcpTable2 buffers are shared).
+ */
+static void rebuild_port_table() {
+	const shared_ptr<port_owner_table> table = new_port_owner_table();
+	update_udp(table.get());
+	update_tcp(table.get());
 
-	pid_port_size_map_lock.unlock();
-	pid_port_map_lock.unlock();
+	port_table.store(table);
 }
 
-bool get_connected_ports(const DWORD pid, vector<u_short>* vectret) {
-	pid_port_map_lock.lock();
-	if (!process_port_map.contains(pid)) {
-		pid_port_map_lock.unlock();
-		return false;
+DWORD WINAPI port_table_loop(LPVOID) {
+	while (WaitForSingleObject(port_table_refresh, INFINITE) == WAIT_OBJECT_0) {
+		rebuild_port_table();
 	}
-	*vectret = *process_port_map[pid];
-	pid_port_map_lock.unlock();
-
-	return true;
+	return 0;
 }
 
-SIZE_T get_connected_ports_counts(const DWORD pid) {
-	pid_port_map_lock.lock();
-	if (!process_port_map.contains(pid)) {
-		pid_port_map_lock.unlock();
-		return 0;
+/*
+ * Refreshes the port <-> PID mapping. The first call builds the table before returning, the next
+ * ones wake the port table thread up and return at once: readers keep the previous table until the
+ * new one is complete. A refresh requested while one is running is done right after it. While the
+ * thread cannot be started, every call builds the table itself and tries to start it again.
+ */
+void map_ports_to_pid() {
+	if (port_table_thread != nullptr) {
+		SetEvent(port_table_refresh);
+		return;
 	}
 
-	pid_port_size_map_lock.lock();
-	const SIZE_T size = process_port_size[pid];
-	pid_port_size_map_lock.unlock();
-
-	pid_port_map_lock.unlock();
-	return size;
-}
-
-DWORD count_packets_for_pid(const DWORD pid, const UINT* port_packets) {
-	const SIZE_T ports_count = get_connected_ports_counts(pid);
-	if (ports_count == 0) {
-		return 0;
+	rebuild_port_table();
+	if (port_table_refresh == nullptr) {
+		port_table_refresh = CreateEvent(nullptr, FALSE, FALSE, nullptr);
 	}
-
-	vector<u_short> ports;
-
-	if (!get_connected_ports(pid, &ports)) {
-		spdlog::warn("Could not get ports.");
-		return 0;
+	if (port_table_refresh != nullptr) {
+		port_table_thread = CreateThread(nullptr, 0, port_table_loop, nullptr, 0, nullptr);
 	}
-
-	DWORD packet_sum = 0;
-	for (unsigned int i = 0; i < ports_count; i++) {
-		const u_short port = ports[i];
-		packet_sum += port_packets[port];
+	static bool thread_failed = false;
+	if (port_table_thread == nullptr && !thread_failed) {
+		spdlog::error("Could not start the port table thread, the ports are refreshed on the calling thread. Error code: {}", GetLastError());
 	}
+	else if (port_table_thread != nullptr && thread_failed) {
+		spdlog::info("Port table thread started");
+	}
+	thread_failed = port_table_thread == nullptr;
+}
 
-	return packet_sum;
+/*
+ * Returns the last complete port table, or nullptr before the first map_ports_to_pid.
+ */
+shared_ptr<const port_owner_table> get_port_owner_table() {
+	return port_table.load();
 }
 
-DWORD get_packet_sent_weight(const DWORD pid) {
-	tx_port_packet_map_lock.lock();
-	const DWORD res = count_packets_for_pid(pid, tx_port_packet_counts);
-	tx_port_packet_map_lock.unlock();
-	return res;
+/*
+ * Publishes a port table built elsewhere (a recorded snapshot, see PacketReplay) in place of the
+ * sockets of this machine. map_ports_to_pid must not be called afterwards.
+ */
+void set_port_owner_table(shared_ptr<const port_owner_table> table) {
+	port_table.store(std::move(table));
 }
 
-DWORD get_packet_received_weight(const DWORD pid) {
-	rx_port_packet_map_lock.lock();
-	const DWORD res = count_packets_for_pid(pid, rx_port_packet_counts);
-	rx_port_packet_map_lock.unlock();
-	return res;
+static ULONGLONG get_owner_bytes(const DWORD pid, const vector<ULONGLONG>& owner_bytes, const bool sent) {
+	const auto departed = departed_owner_bytes.find(pid);
+	const ULONGLONG departed_bytes = departed == departed_owner_bytes.end() ? 0 : (sent ? departed->second.first : departed->second.second);
+	if (totals_table == nullptr) {
+		return departed_bytes;
+	}
+
+	const auto owner = totals_table->owner_index.find(pid);
+	return departed_bytes + (owner == totals_table->owner_index.end() ? 0 : owner_bytes[owner->second]);
 }
 
-void increment_packet_sent_weight(const u_short port, const u_int packet_size) {
-	// spdlog::info("IncrementPacketSent");
-	tx_port_packet_map_lock.lock();
-	tx_port_packet_counts[port] += packet_size;
-	tx_port_packet_map_lock.unlock();
+ULONGLONG get_packet_sent_weight(const DWORD pid) {
+	return get_owner_bytes(pid, tx_owner_bytes, true);
 }
 
-void increment_packet_received_weight(const u_short port, const u_int packet_size) {
-	// spdlog::info("IncrementPacketReceived");
-	rx_port_packet_map_lock.lock();
-	rx_port_packet_counts[port] += packet_size;
-	rx_port_packet_map_lock.unlock();
+ULONGLONG get_packet_received_weight(const DWORD pid) {
+	return get_owner_bytes(pid, rx_owner_bytes, false);
 }
 
-void reset_packet_bandwith() {
-	rx_port_packet_map_lock.lock();
-	tx_port_packet_map_lock.lock();
+static void add_owner_bytes(const DWORD pid, const ULONGLONG tx_bytes, const ULONGLONG rx_bytes) {
+	const auto owner = totals_table->owner_index.find(pid);
+	if (owner != totals_table->owner_index.end()) {
+		tx_owner_bytes[owner->second] += tx_bytes;
+		rx_owner_bytes[owner->second] += rx_bytes;
+	}
+	else {
+		departed_owner_bytes[pid].first += tx_bytes;
+		departed_owner_bytes[pid].second += rx_bytes;
+	}
+}
 
-	// Resetting counter arrays, optimized way according to:
-	// https://stackoverflow.com/questions/9146395/reset-c-int-array-to-zero-the-fastest-way
+/*
+ * Charges the bytes counted since the previous call to the process owning them, read by
+ * get_packet_sent_weight and get_packet_received_weight. Called once per tick.
+ *
+ * Flows are charged to the owner of their socket, looked up by address and port (see
+ * find_flow_owner). Once found so, the owner sticks to the flow while it lives, so a flow started
+ * and closed between two port tables, or an ephemeral port reused by another process meanwhile,
+ * keeps its owner. Flows without socket in the table are charged to the owner of the port for
+ * this tick only.
+ *
+ * Packets the flow table had no room for are counted per port: only the ports that saw traffic are
+ * visited, a port used by TCP and UDP with different owners is charged to both, as its counters do
+ * not tell the protocols apart.
+ */
+void harvest_packet_counters() {
+	for_each_dirty_port(dirty_ports, [](const uint16_t port) {
+		tx_port_packet_counts[port] = 0;
+		rx_port_packet_counts[port] = 0;
+	});
+	memset(dirty_ports, 0, sizeof(dirty_ports));
+	harvest_port_counters(tx_port_packet_counts, rx_port_packet_counts, dirty_ports);
+
+	totals_table = port_table.load();
+	departed_owner_bytes.clear();
+	if (totals_table == nullptr) {
+		harvest_flow_table([](flow_slot&, uint64_t, uint64_t) {});
+		return;
+	}
 
-	memset(rx_port_packet_counts, 0, sizeof(rx_port_packet_counts));
-	memset(tx_port_packet_counts, 0, sizeof(tx_port_packet_counts));
-	
-	rx_port_packet_map_lock.unlock();
-	tx_port_packet_map_lock.unlock();
+	tx_owner_bytes.assign(totals_table->owners.size(), 0);
+	rx_owner_bytes.assign(totals_table->owners.size(), 0);
+	const port_owner_table& table = *totals_table;
+
+	harvest_flow_table([&table](flow_slot& flow, const uint64_t tx_bytes, const uint64_t rx_bytes) {
+		if (!flow.owner_known) {
+			bool exact;
+			const uint32_t owner = find_flow_owner(&table, get_flow_key(flow), &exact);
+			if (owner == PORT_OWNER_NONE) {
+				return;
+			}
+			if (!exact) {
+				tx_owner_bytes[owner] += tx_bytes;
+				rx_owner_bytes[owner] += rx_bytes;
+				return;
+			}
+			flow.owner_pid = table.owners[owner];
+			flow.owner_known = true;
+		}
+		add_owner_bytes(flow.owner_pid, tx_bytes, rx_bytes);
+	});
+
+	for_each_dirty_port(dirty_ports, [&table](const uint16_t port) {
+		const uint32_t tcp_owner = table.tcp_owner[port];
+		const uint32_t udp_owner = table.udp_owner[port];
+		if (tcp_owner != PORT_OWNER_NONE) {
+			tx_owner_bytes[tcp_owner] += tx_port_packet_counts[port];
+			rx_owner_bytes[tcp_owner] += rx_port_packet_counts[port];
+		}
+		if (udp_owner != PORT_OWNER_NONE && udp_owner != tcp_owner) {
+			tx_owner_bytes[udp_owner] += tx_port_packet_counts[port];
+			rx_owner_bytes[udp_owner] += rx_port_packet_counts[port];
+		}
+	});
 }
 
 pcap_t** get_pcap_handle(SIZE_T* size) {
@@ -391,138 +404,20 @@ pcap_t** get_pcap_handle(SIZE_T* size) {
 /*
  * This function is called by the pcap library.
  * This is the main function of this logic, it will parse the packet and increment data sent or
- * received by the corresponding port, if any.
+ * received by the corresponding port, if any (see PacketParser).
  */
 static void got_packet(u_char* args, const struct pcap_pkthdr* header, const u_char* packet) {
 	if (is_watchdog_under_lockdown()) return; // Do not handle packets if we are under lockdown.
 
 	const auto p_loop_data = reinterpret_cast<ploop_data>(args);
-	int data_link_type = p_loop_data->linkType;
-	const string addresses = p_loop_data->addresses;
-
-	// Here we'll parse the packet. because we are monitoring both loopback and normal interfaces,
-	// Some packets will have an ethernet frame, some wont, so we have to parse them properly.
-	// Procedure:
-	// 
-	// IP packet = None
-	// 
-	// If data_link_type == 1
-	//		Extract IP packet from ether frame.
-	// else
-	//		Extract IP packet from loopback frame.
-	// 
-	// PDU = Extract PDU from IP packet.
-	// 
-	// 
-	// 
-	// In the PDU, only destination port and source port are relevant, 
-	// they lie on the first 32 bits of the PDU. As:
-	// 
-	//			16 bits					16 bits
-	//	+----------------------+----------------------+
-	//	|		SRC PORT	   |		DST PORT	  |
-	//	+----------------------+----------------------+
-
-	int packet_head;
-
-	if (data_link_type == 0) { // Loopback.
-		packet_head = 4;
-		if (!loopback_capture) return; // If we dont capture loopback packets, return.
-	}
-	else if (data_link_type == 1) { // Ethernet.
-		packet_head = 14;
-	}
-	else {
-		spdlog::info("Data link type unknown: {}", data_link_type);
-		return;
-	}
-
-	int ip_header_len;
-	string src_addr, dst_addr;
-	src_addr = "";
-	dst_addr = "";
-	// Used to assert protocol ID, we are only interested in UDP and TCP.
-	u_char protocol;
-	// Used to parse ports, B means begin and E means end (of a 16bits value (u_char
-	// are on 8 bits)).
-
-	const u_char ip_version_byte = packet[packet_head];
-	const int ip_version = ((ip_version_byte & 0xF0) >> 4);
-
-	if (ip_version == 4) {
-		u_char* bytes = const_cast<u_char*>(packet) + (packet_head + 12);
-		src_addr = inet_ntoa(*reinterpret_cast<in_addr*>(bytes));
+	if (p_loop_data->decoder->loopback && !loopback_capture) return;
 
-		bytes = const_cast<u_char*>(packet) + (packet_head + 16);
-		dst_addr = inet_ntoa(*reinterpret_cast<in_addr*>(bytes));
-
-		protocol = packet[packet_head + 9];
-		// Value of the byte could be 0101 = 5, which means 5 times 4 bits.
-		ip_header_len = (packet[packet_head] & 0x0F) * 4;
-	} else if (ip_version == 6) {
-		char src_addr_buffer[100];
-		const u_char* bytes = const_cast<u_char*>(packet) + (packet_head + 8);
-		inet_ntop(AF_INET6, bytes,
-			(PSTR)src_addr_buffer, 100);
-
-		char dst_addr_buffer[100];
-		bytes = const_cast<u_char*>(packet) + (packet_head + 24);
-		inet_ntop(AF_INET6, bytes,
-			(PSTR)dst_addr_buffer, 100);
-
-		src_addr = src_addr_buffer;
-		dst_addr = dst_addr_buffer;
-
-
- 		protocol = packet[packet_head + 6];
-		ip_header_len = 40; // IPV6 header has a fixed size.
-	} else {
-		return; // unknown version.
-	}
-
-	if (protocol != 0x06 && protocol != 0x11) { // 0x06 for TCP 0x11 for UDP.
-		return; // unknown protocol.
+	parsed_packet parsed;
+	if (!parse_packet(packet, header->caplen, p_loop_data->decoder, &p_loop_data->addresses, &parsed)) {
+		return;
 	}
 
-	packet_head += ip_header_len;
-
-	// Instead of using two variables, maybe directly using 
-	// UINT16 port = (UINT16)packet[packet_head]; would work, but that is less clear.
-
-	u_char B = packet[packet_head];
-	u_char E = packet[packet_head + 1];
-
-	// Port is on 16 bits, and we have 8 bits in B and 8 bits in E so we need to
-	// shift B to the left of 8 and or the result with E to get the full BE.
-
-	const UINT16 src_port = B << 8 | E;
-
-	packet_head += 2;
-
-	B = packet[packet_head];
-	E = packet[packet_head + 1];
-
-	const UINT16 dst_port = B << 8 | E;
-
-	// Now we have the source and the destination port.
-	// Next step is to increment packets for these ports if we are in loopback,
-	// or to find which port is the local port and to increment only this one
-	// (meaning this packets is either going to the internet, or coming from it).
-
-	const u_int packet_length = header->len;
-
-	if (data_link_type == 0) {
-		increment_packet_sent_weight(src_port, packet_length);
-		increment_packet_received_weight(dst_port, packet_length);
-	}
-	else { // Already filtered unknown data link types
-		if (addresses.find(src_addr) != string::npos) {
-			increment_packet_sent_weight(src_port, packet_length);
-		}
-		else if (addresses.find(dst_addr) != string::npos) {
-			increment_packet_received_weight(dst_port, packet_length);
-		}
-	}
+	count_parsed_packet(p_loop_data->counters, parsed, header->len);
 }
 
 // https://gist.github.com/jkomyno/45bee6e79451453c7bbdc22d033a282e
@@ -547,24 +442,13 @@ char* get_ip_str(const sockaddr* sa, char* s, const size_t maxlen) {
 }
 
 /*
-* Returns space separated string with every addresses linked to this device (returns "" if no
-* addresses found)
-*/
-char* extract_addresses(const pcap_if_t* device) {
-	const pcap_addr* tmp_a = device->addresses;
-	const auto addresses = new char[1000]; // passed to packet sniffer method
-	addresses[0] = '\0'; // init str to ''
-	const auto str_ip = new char[100];
-	while (tmp_a != nullptr) {
-		get_ip_str(tmp_a->addr, str_ip, 100);
-
-		strcat(addresses, str_ip);
-		strcat(addresses, " ");
-		tmp_a = tmp_a->next;
+ * Fills the local address set of the parser with every address linked to this device.
+ */
+void extract_addresses(const pcap_if_t* device, local_addresses* addresses) {
+	clear_local_addresses(addresses);
+	for (const pcap_addr* address = device->addresses; address != nullptr; address = address->next) {
+		add_local_address(addresses, address->addr);
 	}
-
-	delete[] str_ip;
-	return addresses;
 }
 
 /* 
@@ -592,12 +476,6 @@ DWORD WINAPI start_packet_sniffing_loop(const LPVOID passed_thread_parameters) {
 
 	strcpy(device_description_copy, device_description);
 
-	// Get addresses (if any)
-	char* addresses = extract_addresses(dev);
-
-	// Get data link type
-	const int link_type = pcap_datalink(handle);
-
 	// Start loop
 
 	const auto p_loop_data = static_cast<ploop_data>(malloc(sizeof(loop_data)));
@@ -607,8 +485,10 @@ DWORD WINAPI start_packet_sniffing_loop(const LPVOID passed_thread_parameters) {
 		return 0;
 	}
 
-	p_loop_data->addresses = addresses;
-	p_loop_data->linkType = link_type;
+	// Get addresses (if any)
+	extract_addresses(dev, &p_loop_data->addresses);
+	p_loop_data->decoder = data->decoder;
+	p_loop_data->counters = data->counters;
 
 	pcap_loop(handle, -1, got_packet, reinterpret_cast<u_char*>(p_loop_data));
 	return 1;
@@ -665,6 +545,63 @@ int start_packet_sniffing() {
 	return 1;
 }
 
+/*
+ * Checks that the --capture-exclude expression compiles, so that a typo stops Demeter at startup
+ * rather than leaving the handles without a filter.
+ */
+BOOL check_capture_exclude() {
+	if (capture_exclude.empty()) {
+		return TRUE;
+	}
+	const string filter = build_capture_filter(find_link_decoder(LINK_TYPE_ETHERNET), capture_exclude);
+
+	pcap_t* dead = pcap_open_dead(DLT_EN10MB, CAPTURE_SNAPLEN);
+	if (dead == nullptr) {
+		return FALSE;
+	}
+	bpf_program program;
+	const BOOL compiled = pcap_compile(dead, &program, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) != -1;
+	if (compiled) {
+		pcap_freecode(&program);
+	}
+	else {
+		spdlog::critical("Couldn't compile the capture exclusion \"{}\": {}", capture_exclude, pcap_geterr(dead));
+	}
+	pcap_close(dead);
+	return compiled;
+}
+
+/*
+ * Sets the kernel filter of a capture handle, so that only TCP and UDP packets (minus the excluded
+ * traffic) are copied to the capture thread. Without a filter every packet is still parsed, and the
+ * packets that are not TCP or UDP are dropped there. If the exclusion does not compile on the link
+ * type of the handle, the handle falls back to the filter without it rather than to no filter.
+ */
+static BOOL apply_capture_filter(pcap_t* handle, const char* device_name, const link_decoder* decoder) {
+	string filter = build_capture_filter(decoder, capture_exclude);
+
+	bpf_program program;
+	if (pcap_compile(handle, &program, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		spdlog::error("Couldn't compile the capture filter \"{}\" on {}: {}", filter, device_name, pcap_geterr(handle));
+		if (capture_exclude.empty()) {
+			return FALSE;
+		}
+		filter = build_capture_filter(decoder, "");
+		if (pcap_compile(handle, &program, filter.c_str(), 1, PCAP_NETMASK_UNKNOWN) == -1) {
+			spdlog::error("Couldn't compile the capture filter \"{}\" on {}: {}", filter, device_name, pcap_geterr(handle));
+			return FALSE;
+		}
+		spdlog::warn("Capturing on {} without the capture exclusion", device_name);
+	}
+
+	const BOOL set = pcap_setfilter(handle, &program) != -1;
+	if (!set) {
+		spdlog::warn("Couldn't set the capture filter on {}: {}", device_name, pcap_geterr(handle));
+	}
+	pcap_freecode(&program);
+	return set;
+}
+
 /*Tries to start the capturing loop on the device device.*/
 pcap_t* sniff_device(pcap_if_t* device) {
 	// Session handle.
@@ -680,8 +617,7 @@ pcap_t* sniff_device(pcap_if_t* device) {
 	const char* device_name = device->name;
 	pcap_t* handle = pcap_open(
 		device_name, // Name of the device.
-		65536, // Portion of the packet to capture.
-		// 65536 guarantees that the whole packet will be captured on all the link layers.
+		CAPTURE_SNAPLEN, // Portion of the packet to capture, only the headers are read.
 		0, // Non promiscuous mode.
 		1000, // Read timeout.
 		nullptr, // Authentication on the remote machine.
@@ -693,8 +629,22 @@ pcap_t* sniff_device(pcap_if_t* device) {
 		return nullptr;
 	}
 
+	// The link header is decoded the same way for every packet of the handle.
+	const int link_type = pcap_datalink(handle);
+	const link_decoder* decoder = find_link_decoder(link_type);
+	if (decoder == nullptr) {
+		spdlog::warn("Data link type {} not supported, not sniffing on {}", link_type, device_name);
+		pcap_close(handle);
+		free(data);
+		return nullptr;
+	}
+
+	apply_capture_filter(handle, device_name, decoder);
+
 	data->handle = handle;
 	data->dev = device;
+	data->decoder = decoder;
+	data->counters = add_port_counter_bank();
 
 	const LPDWORD packet_sniffer_handle_identifier = nullptr;
 	CreateThread(
@@ -44,12 +44,17 @@
 #include "pcap.h"
 #include <stdlib.h>
 #include <map>
+#include <memory>
 
 #include <stdio.h>
 
 #include <mutex>
+#include <atomic>
+#include <vector>
 
 #include "DemeterLogger.h"
+#include "PacketParser.h"
+#include "PortCounters.h"
 
 #include "UsageWatchdogManager.h"
 
@@ -57,29 +62,23 @@ using namespace std;
 
 void set_loopback_capture(bool);
 
-void reset_port_map(DWORD);
+void set_capture_exclude(const std::string&);
 
-void alloc_port_map(DWORD);
-
-void add_port_to_map(DWORD, u_short);
+BOOL check_capture_exclude();
 
 void map_ports_to_pid();
 
-void get_connected_ports(DWORD, u_short**);
+std::shared_ptr<const port_owner_table> get_port_owner_table();
 
-SIZE_T get_connected_ports_counts(DWORD);
+void set_port_owner_table(std::shared_ptr<const port_owner_table>);
 
 DWORD get_packets(DWORD, std::map<u_short, DWORD>);
 
-DWORD get_packet_sent_weight(DWORD);
-
-DWORD get_packet_received_weight(DWORD);
-
-void increment_packet_sent_weight(u_short, u_int);
+ULONGLONG get_packet_sent_weight(DWORD);
 
-void increment_packet_received_weight(u_short, u_int);
+ULONGLONG get_packet_received_weight(DWORD);
 
-void reset_packet_bandwith();
+void harvest_packet_counters();
 
 static void got_packet(u_char*, const struct pcap_pkthdr*, const u_char*);
 
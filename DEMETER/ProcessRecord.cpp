@@ -0,0 +1,127 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines helpers on the per tick process records.
+ */
+
+#include "ProcessRecord.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+/*
+ * Adds every metric of record to target, used to fold several rows into a single one (the name of
+ * target is left untouched).
+ */
+void add_process_record(process_record& target, const process_record& record) {
+	target.cpu_usage += record.cpu_usage;
+	target.cpu_consumption += record.cpu_consumption;
+	target.net_up_bandwidth += record.net_up_bandwidth;
+	target.net_up_consumption += record.net_up_consumption;
+	target.net_down_bandwidth += record.net_down_bandwidth;
+	target.net_down_consumption += record.net_down_consumption;
+	target.disk_read_speed += record.disk_read_speed;
+	target.disk_write_speed += record.disk_write_speed;
+	target.disk_read_consumption += record.disk_read_consumption;
+	target.disk_write_consumption += record.disk_write_consumption;
+	target.ram += record.ram;
+	target.sum_consumption += record.sum_consumption;
+	target.core_consumption += record.core_consumption;
+	target.gpu_consumption += record.gpu_consumption;
+	target.uncore_consumption += record.uncore_consumption;
+	target.dram_consumption += record.dram_consumption;
+	target.net_up_bytes += record.net_up_bytes;
+	target.net_down_bytes += record.net_down_bytes;
+	target.disk_read_bytes += record.disk_read_bytes;
+	target.disk_write_bytes += record.disk_write_bytes;
+}
+
+/*
+ * Parses a column name, case insensitive ("sumc", "CPU", ...). Returns false if unknown.
+ */
+bool parse_record_column(const string& name, record_column* column) {
+	string lower_name = name;
+	transform(lower_name.begin(), lower_name.end(), lower_name.begin(), [](const unsigned char c) { return static_cast<char>(tolower(c)); });
+
+	static const pair<const char*, record_column> columns[] = {
+		{ "cpu", RECORD_CPU }, { "cpuc", RECORD_CPUC },
+		{ "netup", RECORD_NETUP }, { "netupc", RECORD_NETUPC },
+		{ "netdown", RECORD_NETDOWN }, { "netdownc", RECORD_NETDOWNC },
+		{ "diskr", RECORD_DISKR }, { "diskw", RECORD_DISKW },
+		{ "diskrc", RECORD_DISKRC }, { "diskwc", RECORD_DISKWC },
+		{ "ram", RECORD_RAM }, { "sumc", RECORD_SUMC },
+		{ "corec", RECORD_COREC }, { "gpuc", RECORD_GPUC },
+		{ "uncorec", RECORD_UNCOREC }, { "dramc", RECORD_DRAMC },
+	};
+	for (const auto& [column_name, value] : columns) {
+		if (lower_name == column_name) {
+			*column = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+double get_record_value(const process_record& record, const record_column column) {
+	switch (column) {
+	case RECORD_CPU: return record.cpu_usage;
+	case RECORD_CPUC: return record.cpu_consumption;
+	case RECORD_NETUP: return record.net_up_bandwidth;
+	case RECORD_NETUPC: return record.net_up_consumption;
+	case RECORD_NETDOWN: return record.net_down_bandwidth;
+	case RECORD_NETDOWNC: return record.net_down_consumption;
+	case RECORD_DISKR: return record.disk_read_speed;
+	case RECORD_DISKW: return record.disk_write_speed;
+	case RECORD_DISKRC: return record.disk_read_consumption;
+	case RECORD_DISKWC: return record.disk_write_consumption;
+	case RECORD_RAM: return static_cast<double>(record.ram);
+	case RECORD_SUMC: return record.sum_consumption;
+	case RECORD_COREC: return record.core_consumption;
+	case RECORD_GPUC: return record.gpu_consumption;
+	case RECORD_UNCOREC: return record.uncore_consumption;
+	case RECORD_DRAMC: return record.dram_consumption;
+	}
+	return 0;
+}
+
+/*
+ * Keeps the aggregate records and the count process records with the highest value in column,
+ * every other process record is folded into a copy of other which is appended, so that totals
+ * still add up. Selection is partial (nth_element), kept records are not sorted.
+ */
+void keep_top_records(vector<process_record>& records, const SIZE_T count, const record_column column, const process_record& other) {
+	const auto processes_begin = partition(records.begin(), records.end(),
+		[](const process_record& record) { return record.aggregate; });
+
+	if (static_cast<SIZE_T>(records.end() - processes_begin) <= count) {
+		return;
+	}
+
+	const auto processes_end = processes_begin + static_cast<ptrdiff_t>(count);
+	nth_element(processes_begin, processes_end, records.end(),
+		[column](const process_record& a, const process_record& b) { return get_record_value(a, column) > get_record_value(b, column); });
+
+	process_record folded = other;
+	for (auto it = processes_end; it != records.end(); ++it) {
+		add_process_record(folded, *it);
+	}
+	records.erase(processes_end, records.end());
+	records.push_back(move(folded));
+}
\ No newline at end of file
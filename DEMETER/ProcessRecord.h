@@ -0,0 +1,80 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+/*
+ * One row of a tick: what a process name (or an aggregate such as "System Total") used and
+ * consumed over the last measurement interval. Energies are in mWh, bandwidths in MB/s.
+ */
+typedef struct process_record {
+	std::string name;
+	UINT32 name_id; // See ProcessNameTable.
+	bool aggregate;
+	float cpu_usage;
+	float cpu_consumption;
+	float net_up_bandwidth;
+	float net_up_consumption;
+	float net_down_bandwidth;
+	float net_down_consumption;
+	float disk_read_speed;
+	float disk_write_speed;
+	float disk_read_consumption;
+	float disk_write_consumption;
+	SIZE_T ram;
+	float sum_consumption;
+	float core_consumption; // Per RAPL domain, see process_data.
+	float gpu_consumption;
+	float uncore_consumption;
+	float dram_consumption;
+	ULONGLONG net_up_bytes; // Raw traffic of the interval, for the rollups.
+	ULONGLONG net_down_bytes;
+	ULONGLONG disk_read_bytes;
+	ULONGLONG disk_write_bytes;
+} process_record, *pprocess_record;
+
+// Columns of a record, as named in the CSV header.
+typedef enum record_column {
+	RECORD_CPU,
+	RECORD_CPUC,
+	RECORD_NETUP,
+	RECORD_NETUPC,
+	RECORD_NETDOWN,
+	RECORD_NETDOWNC,
+	RECORD_DISKR,
+	RECORD_DISKW,
+	RECORD_DISKRC,
+	RECORD_DISKWC,
+	RECORD_RAM,
+	RECORD_SUMC,
+	RECORD_COREC,
+	RECORD_GPUC,
+	RECORD_UNCOREC,
+	RECORD_DRAMC
+} record_column;
+
+void add_process_record(process_record&, const process_record&);
+
+bool parse_record_column(const std::string&, record_column*);
+
+double get_record_value(const process_record&, record_column);
+
+void keep_top_records(std::vector<process_record>&, SIZE_T, record_column, const process_record&);
\ No newline at end of file
@@ -0,0 +1,221 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file maintains the per minute and per hour rollups of the measurements.
+ *
+ * Every tick is added to the running accumulator of its process name, in each resolution. When a
+ * tick falls in a new window (windows are aligned on the epoch, a tick belongs to the window in
+ * which it ended), the accumulators of the previous window are written to the rollup file of that
+ * resolution and cleared. Only names seen during the current window have an accumulator, so memory
+ * stays bounded by the number of live names.
+ *
+ * When Demeter stops, the windows being accumulated are not written to the rollup files, since
+ * the run that follows would write the same windows again. They are saved as they are to
+ * rollup-<resolution>-pending-<user>.csv instead, and restored by the next run: a window that is
+ * still current goes on accumulating, one that ended meanwhile is written at the next tick.
+ * Pending lines hold the raw accumulator, the name last since it may contain the separator:
+ *
+ *	TIME;TICKS;DURATION;CPUTIME;CPUMAX;CPUC;NetUpB;NetDownB;DiskRB;DiskWB;RAMMAX;SumC;NAME
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Rollups.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "ProcessNameTable.h"
+#include "SystemInfoGatherer.h"
+
+using namespace std;
+
+typedef struct rollup_accumulator {
+	UINT32 ticks;
+	double duration; // Seconds.
+	double cpu_time; // CPU usage (%) times seconds, for the duration weighted mean.
+	float cpu_max;
+	double cpu_consumption;
+	double sum_consumption;
+	double net_up_bytes;
+	double net_down_bytes;
+	double disk_read_bytes;
+	double disk_write_bytes;
+	SIZE_T ram_max;
+} rollup_accumulator;
+
+typedef struct rollup {
+	const char* label;
+	time_t period;
+	time_t window; // Start of the window being accumulated, -1 if none.
+	unordered_map<UINT32, rollup_accumulator> accumulators; // Keyed by name ID.
+} rollup;
+
+static bool rollups_enabled = false;
+static rollup rollups[] = {
+	{ "1m", 60, -1, {} },
+	{ "1h", 3600, -1, {} },
+};
+
+static string get_pending_file_name(const rollup& resolution) {
+	return "rollup-" + string(resolution.label) + "-pending-" + get_system_username() + ".csv";
+}
+
+/*
+ * Restores the window a previous run was accumulating when it stopped, and removes its pending
+ * file so that it is restored only once.
+ */
+static void load_pending_rollup(rollup& resolution) {
+	const string file_name = get_pending_file_name(resolution);
+	ifstream file(file_name);
+	if (!file.good()) {
+		return;
+	}
+
+	string line;
+	getline(file, line); // Header.
+	while (getline(file, line)) {
+		istringstream fields(line);
+		time_t window;
+		rollup_accumulator accumulator = {};
+		char separator;
+		fields >> window >> separator >> accumulator.ticks >> separator >> accumulator.duration >> separator
+			>> accumulator.cpu_time >> separator >> accumulator.cpu_max >> separator >> accumulator.cpu_consumption >> separator
+			>> accumulator.net_up_bytes >> separator >> accumulator.net_down_bytes >> separator
+			>> accumulator.disk_read_bytes >> separator >> accumulator.disk_write_bytes >> separator
+			>> accumulator.ram_max >> separator >> accumulator.sum_consumption >> separator;
+		string name;
+		if (!fields || !getline(fields, name) || (resolution.window != -1 && resolution.window != window)) {
+			spdlog::warn("Ignoring a malformed line of the pending rollup file {}", file_name);
+			continue;
+		}
+		resolution.window = window;
+		resolution.accumulators[intern_process_name(name)] = accumulator;
+	}
+	file.close();
+	remove(file_name.c_str());
+	spdlog::info("Restored {} pending {} rollups", resolution.accumulators.size(), resolution.label);
+}
+
+static void save_pending_rollup(const rollup& resolution) {
+	const string file_name = get_pending_file_name(resolution);
+	ofstream file(file_name, ofstream::out | ofstream::trunc);
+	if (!file.good()) {
+		spdlog::error("Could not open pending rollup file {}", file_name);
+		return;
+	}
+
+	file << "TIME;TICKS;DURATION;CPUTIME;CPUMAX;CPUC;NetUpB;NetDownB;DiskRB;DiskWB;RAMMAX;SumC;NAME\n";
+	file.precision(17);
+	for (const auto& [name_id, accumulator] : resolution.accumulators) {
+		file << resolution.window << ";" << accumulator.ticks << ";" << accumulator.duration << ";"
+			<< accumulator.cpu_time << ";" << accumulator.cpu_max << ";" << accumulator.cpu_consumption << ";"
+			<< accumulator.net_up_bytes << ";" << accumulator.net_down_bytes << ";"
+			<< accumulator.disk_read_bytes << ";" << accumulator.disk_write_bytes << ";"
+			<< accumulator.ram_max << ";" << accumulator.sum_consumption << ";" << get_interned_process_name(name_id) << "\n";
+	}
+}
+
+void enable_rollups() {
+	spdlog::info("Rollups enabled");
+	rollups_enabled = true;
+	for (auto& resolution : rollups) {
+		load_pending_rollup(resolution);
+	}
+}
+
+static void write_rollup(const rollup& resolution) {
+	const tm* ptm = localtime(&resolution.window);
+	char date[32];
+	strftime(date, 32, "%d_%m_%Y", ptm);
+	const string file_name = "rollup-" + string(resolution.label) + "-" + date + "-" + get_system_username() + ".csv";
+
+	const bool exists = ifstream(file_name).good();
+	ofstream file(file_name, ofstream::out | ofstream::app);
+	if (!file.good()) {
+		spdlog::error("Could not open rollup file {}", file_name);
+		return;
+	}
+	if (!exists) {
+		file << "TIME;NAME;TICKS;CPUMEAN;CPUMAX;CPUC;NetUpB;NetDownB;DiskRB;DiskWB;RAMMAX;SumC\n";
+	}
+
+	file << fixed;
+	for (const auto& [name_id, accumulator] : resolution.accumulators) {
+		const double cpu_mean = accumulator.duration > 0 ? accumulator.cpu_time / accumulator.duration : 0;
+		file << resolution.window << ";" << get_interned_process_name(name_id) << ";" << accumulator.ticks << ";"
+			<< cpu_mean << ";" << accumulator.cpu_max << ";" << accumulator.cpu_consumption << ";"
+			<< accumulator.net_up_bytes << ";" << accumulator.net_down_bytes << ";"
+			<< accumulator.disk_read_bytes << ";" << accumulator.disk_write_bytes << ";"
+			<< accumulator.ram_max << ";" << accumulator.sum_consumption << "\n";
+	}
+}
+
+/*
+ * Adds the rows of a tick, ended at timestamp and lasting duration seconds, to the rollups.
+ */
+void push_rollups(const vector<process_record>& records, const time_t timestamp, const time_t duration) {
+	if (!rollups_enabled) return;
+
+	const auto seconds = static_cast<double>(duration);
+
+	for (auto& resolution : rollups) {
+		const time_t window = timestamp - timestamp % resolution.period;
+		if (resolution.window != window) {
+			if (resolution.window != -1) {
+				write_rollup(resolution);
+			}
+			resolution.accumulators.clear();
+			resolution.window = window;
+		}
+
+		for (const auto& record : records) {
+			rollup_accumulator& accumulator = resolution.accumulators[record.name_id];
+			accumulator.ticks++;
+			accumulator.duration += seconds;
+			accumulator.cpu_time += record.cpu_usage * seconds;
+			accumulator.cpu_max = max(accumulator.cpu_max, record.cpu_usage);
+			accumulator.cpu_consumption += record.cpu_consumption;
+			accumulator.sum_consumption += record.sum_consumption;
+			accumulator.net_up_bytes += static_cast<double>(record.net_up_bytes);
+			accumulator.net_down_bytes += static_cast<double>(record.net_down_bytes);
+			accumulator.disk_read_bytes += static_cast<double>(record.disk_read_bytes);
+			accumulator.disk_write_bytes += static_cast<double>(record.disk_write_bytes);
+			accumulator.ram_max = max(accumulator.ram_max, record.ram);
+		}
+	}
+}
+
+/*
+ * Saves the windows being accumulated for the next run. Called when Demeter stops.
+ */
+void flush_rollups() {
+	if (!rollups_enabled) return;
+
+	for (auto& resolution : rollups) {
+		if (resolution.window != -1 && !resolution.accumulators.empty()) {
+			save_pending_rollup(resolution);
+		}
+		resolution.accumulators.clear();
+		resolution.window = -1;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,345 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the Linux port table backend, the counterpart of the IP helper tables read by
+ * ProcessNetDataGatherer on Windows.
+ *
+ * The TCP and UDP sockets (IPv4 and IPv6) are dumped through NETLINK_SOCK_DIAG, one binary dump per
+ * protocol and family, each giving the addresses, ports and inode of the socket. The owner of an
+ * inode is found in /proc/<pid>/fd, where each socket descriptor links to "socket:[inode]".
+ *
+ * Reading every descriptor of every process is the slow part, so an index of the TCP and UDP socket
+ * inodes of each process is kept between refreshes. A process is only read again when it is new,
+ * when one of its indexed sockets is no longer dumped (closed, and maybe replaced by another on the
+ * same descriptor), or when its number of descriptors changed (the size of /proc/<pid>/fd, Linux 6.2
+ * and later). When a dumped socket is still not in the index (a new socket on a descriptor freed by
+ * something else than a socket, or an older kernel), the processes that were not read in this
+ * refresh are read as well. Sockets still without owner after that are remembered, so that they do
+ * not trigger it again.
+ */
+
+#include "SockDiagPortTable.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "DemeterLogger.h"
+
+using namespace std;
+
+// One dumped socket.
+typedef struct diag_socket {
+	uint64_t inode;
+	flow_key key;
+} diag_socket;
+
+// Socket inodes of a process, as of its last read.
+typedef struct process_sockets {
+	off_t descriptors_count; // Size of /proc/<pid>/fd, 0 when the kernel does not report it.
+	vector<uint64_t> inodes; // Dumped sockets only.
+	bool seen; // Listed in the current refresh.
+	bool read; // Read in the current refresh.
+} process_sockets;
+
+static unordered_map<uint32_t, process_sockets> processes_sockets;
+static unordered_map<uint64_t, uint32_t> inode_owners;
+static unordered_set<uint64_t> unowned_inodes; // Dumped sockets no readable descriptor points to.
+
+/*
+ * Appends the sockets of a protocol and family to sockets with one sock_diag dump. Returns false
+ * when the dump failed. The rest of a failed dump is still read, so that it does not end up in the
+ * next dump on the same socket.
+ */
+static bool dump_sockets(const int netlink, const uint8_t protocol, const uint8_t family, vector<diag_socket>* sockets) {
+	struct {
+		nlmsghdr header;
+		inet_diag_req_v2 request;
+	} message = {};
+	message.header.nlmsg_len = sizeof(message);
+	message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	message.request.sdiag_family = family;
+	message.request.sdiag_protocol = protocol;
+	message.request.idiag_states = ~0u; // Every state.
+
+	sockaddr_nl kernel = {};
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(netlink, &message, sizeof(message), 0, reinterpret_cast<sockaddr*>(&kernel), sizeof(kernel)) < 0) {
+		spdlog::error("Couldn't request the sock_diag dump: {}", strerror(errno));
+		return false;
+	}
+
+	alignas(nlmsghdr) static char buffer[1 << 16];
+	bool failed = false;
+	while (true) {
+		// Once failed, the kernel may have nothing more to send (a rejected request ends with the
+		// error alone), so the rest is read without waiting.
+		ssize_t received = recv(netlink, buffer, sizeof(buffer), failed ? MSG_DONTWAIT : 0);
+		if (received < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (failed && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return false;
+			}
+			spdlog::error("Couldn't read the sock_diag dump: {}", strerror(errno));
+			return false;
+		}
+
+		for (auto header = reinterpret_cast<const nlmsghdr*>(buffer); NLMSG_OK(header, received); header = NLMSG_NEXT(header, received)) {
+			if (header->nlmsg_type == NLMSG_DONE) {
+				return !failed;
+			}
+			if (header->nlmsg_type == NLMSG_ERROR) {
+				const auto error = static_cast<const nlmsgerr*>(NLMSG_DATA(header));
+				spdlog::error("sock_diag dump failed: {}", strerror(-error->error));
+				failed = true;
+				continue;
+			}
+			if (failed) {
+				continue;
+			}
+			if (header->nlmsg_len < NLMSG_LENGTH(sizeof(inet_diag_msg))) {
+				spdlog::error("sock_diag dump holds a truncated message");
+				failed = true;
+				continue;
+			}
+
+			const auto socket = static_cast<const inet_diag_msg*>(NLMSG_DATA(header));
+			if (socket->idiag_inode != 0) { // TIME_WAIT sockets belong to no process.
+				const flow_key key = make_flow_key(protocol, family == AF_INET ? 4 : 6,
+					reinterpret_cast<const uint8_t*>(socket->id.idiag_src), ntohs(socket->id.idiag_sport),
+					reinterpret_cast<const uint8_t*>(socket->id.idiag_dst), ntohs(socket->id.idiag_dport));
+				sockets->push_back({ socket->idiag_inode, key });
+			}
+		}
+	}
+}
+
+/*
+ * Forgets the inodes of a process. A socket shared with another process (inherited, or passed) is
+ * indexed under only one of them, and stays indexed while that one holds it.
+ */
+static void forget_process_sockets(const uint32_t pid, process_sockets* sockets) {
+	for (const uint64_t inode : sockets->inodes) {
+		const auto owner = inode_owners.find(inode);
+		if (owner != inode_owners.end() && owner->second == pid) {
+			inode_owners.erase(owner);
+		}
+	}
+	sockets->inodes.clear();
+}
+
+/*
+ * Reads the socket inodes of a process from its descriptors, and indexes the dumped ones.
+ */
+static void read_process_sockets(const uint32_t pid, const int fd_directory, const unordered_set<uint64_t>& dumped_inodes, process_sockets* sockets) {
+	forget_process_sockets(pid, sockets);
+	sockets->read = true;
+
+	DIR* directory = fdopendir(fd_directory);
+	if (directory == nullptr) {
+		close(fd_directory);
+		return;
+	}
+
+	char link[64];
+	constexpr char prefix[] = "socket:[";
+	while (const dirent* entry = readdir(directory)) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		const ssize_t length = readlinkat(dirfd(directory), entry->d_name, link, sizeof(link) - 1);
+		if (length <= static_cast<ssize_t>(sizeof(prefix) - 1) || memcmp(link, prefix, sizeof(prefix) - 1) != 0) {
+			continue;
+		}
+		link[length] = '\0';
+		const uint64_t inode = strtoull(link + sizeof(prefix) - 1, nullptr, 10);
+		if (!dumped_inodes.contains(inode)) {
+			continue; // Unix or raw sockets, or opened since the dump.
+		}
+		sockets->inodes.push_back(inode);
+		inode_owners[inode] = pid;
+	}
+	closedir(directory);
+}
+
+static int open_fd_directory(const uint32_t pid) {
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/%u/fd", pid);
+	return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Returns true when one of the indexed sockets of a process was not dumped, so was closed.
+ */
+static bool lost_socket(const process_sockets& sockets, const unordered_set<uint64_t>& dumped_inodes) {
+	for (const uint64_t inode : sockets.inodes) {
+		if (!dumped_inodes.contains(inode)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Brings the inode index up to date: forgets the processes that exited, reads the new ones, the
+ * ones that closed an indexed socket and the ones whose number of descriptors changed.
+ */
+static void refresh_inode_index(const unordered_set<uint64_t>& dumped_inodes) {
+	for (auto& [pid, sockets] : processes_sockets) {
+		sockets.seen = false;
+		sockets.read = false;
+	}
+
+	DIR* proc = opendir("/proc");
+	if (proc == nullptr) {
+		spdlog::error("Couldn't list /proc: {}", strerror(errno));
+		return;
+	}
+	while (const dirent* entry = readdir(proc)) {
+		char* end;
+		const unsigned long pid = strtoul(entry->d_name, &end, 10);
+		if (*end != '\0' || end == entry->d_name) {
+			continue;
+		}
+
+		const int fd_directory = open_fd_directory(static_cast<uint32_t>(pid));
+		struct stat status;
+		if (fd_directory < 0 || fstat(fd_directory, &status) != 0) {
+			if (fd_directory >= 0) {
+				close(fd_directory);
+			}
+			continue; // Exited, or not readable.
+		}
+
+		const auto [sockets, added] = processes_sockets.try_emplace(static_cast<uint32_t>(pid));
+		const bool changed = added || (status.st_size != 0 && status.st_size != sockets->second.descriptors_count) || lost_socket(sockets->second, dumped_inodes);
+		sockets->second.seen = true;
+		sockets->second.descriptors_count = status.st_size;
+		if (changed) {
+			read_process_sockets(static_cast<uint32_t>(pid), fd_directory, dumped_inodes, &sockets->second);
+		}
+		else {
+			close(fd_directory);
+		}
+	}
+	closedir(proc);
+
+	for (auto sockets = processes_sockets.begin(); sockets != processes_sockets.end();) {
+		if (!sockets->second.seen) {
+			forget_process_sockets(sockets->first, &sockets->second);
+			sockets = processes_sockets.erase(sockets);
+		}
+		else {
+			++sockets;
+		}
+	}
+}
+
+/*
+ * Reads the processes that were not read in this refresh, for the sockets missing from the index.
+ */
+static void read_unread_processes(const unordered_set<uint64_t>& dumped_inodes) {
+	for (auto& [pid, sockets] : processes_sockets) {
+		if (sockets.read) {
+			continue;
+		}
+		const int fd_directory = open_fd_directory(pid);
+		if (fd_directory >= 0) {
+			read_process_sockets(pid, fd_directory, dumped_inodes, &sockets);
+		}
+	}
+}
+
+/*
+ * Builds a port table from the sockets of the system. Called from the port table thread only.
+ */
+shared_ptr<port_owner_table> build_sock_diag_port_table() {
+	const auto begin = chrono::steady_clock::now();
+	const shared_ptr<port_owner_table> table = new_port_owner_table();
+
+	const int netlink = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (netlink < 0) {
+		spdlog::error("Couldn't open the sock_diag socket: {}", strerror(errno));
+		return table;
+	}
+
+	static vector<diag_socket> sockets;
+	sockets.clear();
+	for (const uint8_t protocol : { IPPROTO_TCP, IPPROTO_UDP }) {
+		for (const uint8_t family : { AF_INET, AF_INET6 }) {
+			dump_sockets(netlink, protocol, family, &sockets);
+		}
+	}
+	close(netlink);
+
+	static unordered_set<uint64_t> dumped_inodes;
+	dumped_inodes.clear();
+	for (const diag_socket& socket : sockets) {
+		dumped_inodes.insert(socket.inode);
+	}
+
+	refresh_inode_index(dumped_inodes);
+	bool missing = false;
+	for (const diag_socket& socket : sockets) {
+		if (!inode_owners.contains(socket.inode) && !unowned_inodes.contains(socket.inode)) {
+			missing = true;
+			break;
+		}
+	}
+	if (missing) {
+		read_unread_processes(dumped_inodes);
+	}
+
+	// Sockets of other users' processes, or held by the kernel only, stay unowned: they must not
+	// send every refresh back to reading every process.
+	unowned_inodes.clear();
+	for (const diag_socket& socket : sockets) {
+		const auto owner = inode_owners.find(socket.inode);
+		if (owner != inode_owners.end()) {
+			add_socket_owner(table.get(), socket.key, owner->second);
+		}
+		else {
+			unowned_inodes.insert(socket.inode);
+		}
+	}
+
+	spdlog::debug("Port table: {} sockets, {} processes, {} us", sockets.size(), processes_sockets.size(),
+		chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count());
+	return table;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,203 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines logic on CPU sockets: which logical processors belong to which socket, how busy
+ * every socket was, and which sockets a process may run on.
+ *
+ * The topology comes from GetLogicalProcessorInformationEx. A socket can span several processor
+ * groups, and a group can hold several sockets, so both are handled through GROUP_AFFINITY masks.
+ */
+
+#include "SocketDataGatherer.h"
+
+#include <map>
+#include <vector>
+
+typedef struct cpu_socket {
+	std::vector<GROUP_AFFINITY> group_masks;
+} cpu_socket;
+
+static std::vector<cpu_socket> sockets;
+static bool topology_loaded = false;
+// Processor times at the last call of get_socket_cpu_usage, per group.
+static std::map<WORD, std::vector<SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION>> last_processor_times;
+
+/*
+ * Reads the sockets of the machine, once. Only the first ENERGY_MAX_SOCKETS sockets are kept.
+ */
+BOOL init_socket_topology() {
+	if (topology_loaded) {
+		return !sockets.empty();
+	}
+	topology_loaded = true;
+
+	DWORD size = 0;
+	GetLogicalProcessorInformationEx(RelationProcessorPackage, nullptr, &size);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+		spdlog::error("GetLogicalProcessorInformationEx failed. Error code: {}", GetLastError());
+		return FALSE;
+	}
+	std::vector<BYTE> buffer(size);
+	if (!GetLogicalProcessorInformationEx(RelationProcessorPackage, reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &size)) {
+		spdlog::error("GetLogicalProcessorInformationEx failed. Error code: {}", GetLastError());
+		return FALSE;
+	}
+
+	for (DWORD offset = 0; offset < size;) {
+		const auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offset);
+		if (info->Relationship == RelationProcessorPackage) {
+			if (sockets.size() < ENERGY_MAX_SOCKETS) {
+				cpu_socket socket;
+				socket.group_masks.assign(info->Processor.GroupMask, info->Processor.GroupMask + info->Processor.GroupCount);
+				sockets.push_back(socket);
+			}
+			else {
+				spdlog::warn("More than {} sockets, the others are not measured separately.", ENERGY_MAX_SOCKETS);
+			}
+		}
+		offset += info->Size;
+	}
+
+	spdlog::info("{} CPU socket(s) found", sockets.size());
+
+	// The first usage is taken against these times rather than against the boot.
+	float usage[ENERGY_MAX_SOCKETS];
+	get_socket_cpu_usage(usage);
+	return !sockets.empty();
+}
+
+int get_sockets_count() {
+	return static_cast<int>(sockets.size());
+}
+
+/*
+ * Moves the calling thread to the processors of a socket (of its first group), so that model
+ * specific registers read by the thread are the socket's. previous receives the affinity to restore.
+ */
+BOOL pin_thread_to_socket(const int socket, GROUP_AFFINITY* previous) {
+	if (socket < 0 || socket >= static_cast<int>(sockets.size()) || sockets[socket].group_masks.empty()) {
+		return FALSE;
+	}
+	if (!SetThreadGroupAffinity(GetCurrentThread(), &sockets[socket].group_masks[0], previous)) {
+		spdlog::error("Could not move the thread to socket {}. Error code: {}", socket, GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void restore_thread_affinity(const GROUP_AFFINITY* previous) {
+	SetThreadGroupAffinity(GetCurrentThread(), previous, nullptr);
+}
+
+/*
+ * Reads the times of every processor of a group. NtQuerySystemInformation only reports the
+ * processors of the group of the calling thread, so the thread visits the group.
+ */
+static BOOL read_group_processor_times(const WORD group, std::vector<SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION>& times) {
+	const DWORD processors_count = GetActiveProcessorCount(group);
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = group;
+	affinity.Mask = processors_count >= 64 ? ~static_cast<KAFFINITY>(0) : (static_cast<KAFFINITY>(1) << processors_count) - 1;
+
+	GROUP_AFFINITY previous;
+	if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous)) {
+		return FALSE;
+	}
+	times.resize(processors_count);
+	const ULONG size = static_cast<ULONG>(times.size() * sizeof(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION));
+	const NTSTATUS status = NtQuerySystemInformation(SystemProcessorPerformanceInformation, times.data(), size, nullptr);
+	restore_thread_affinity(&previous);
+	return status >= 0;
+}
+
+/*
+ * Fills usage with the busy time of every socket since the last call, as a fraction of the time of
+ * every processor of the machine (the sockets sum to the system CPU usage).
+ *
+ * The kernel time includes the idle time.
+ */
+void get_socket_cpu_usage(float* usage) {
+	std::map<WORD, std::vector<double>> busy_times;
+	double total_time = 0;
+
+	for (const auto& socket : sockets) {
+		for (const auto& mask : socket.group_masks) {
+			if (busy_times.contains(mask.Group)) {
+				continue;
+			}
+			std::vector<SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION> times;
+			if (!read_group_processor_times(mask.Group, times)) {
+				continue;
+			}
+
+			std::vector<SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION>& last_times = last_processor_times[mask.Group];
+			last_times.resize(times.size());
+			std::vector<double>& group_busy_times = busy_times[mask.Group];
+			for (SIZE_T processor = 0; processor < times.size(); processor++) {
+				const double idle = static_cast<double>(times[processor].IdleTime.QuadPart - last_times[processor].IdleTime.QuadPart);
+				const double total = static_cast<double>(times[processor].KernelTime.QuadPart - last_times[processor].KernelTime.QuadPart)
+					+ static_cast<double>(times[processor].UserTime.QuadPart - last_times[processor].UserTime.QuadPart);
+				group_busy_times.push_back(total > idle ? total - idle : 0);
+				total_time += total;
+			}
+			last_times = times;
+		}
+	}
+
+	for (SIZE_T socket = 0; socket < sockets.size(); socket++) {
+		double busy_time = 0;
+		for (const auto& mask : sockets[socket].group_masks) {
+			const std::vector<double>& group_busy_times = busy_times[mask.Group];
+			for (SIZE_T processor = 0; processor < group_busy_times.size(); processor++) {
+				if (mask.Mask & (static_cast<KAFFINITY>(1) << processor)) {
+					busy_time += group_busy_times[processor];
+				}
+			}
+		}
+		usage[socket] = total_time > 0 ? static_cast<float>(busy_time / total_time) : 0.0f;
+	}
+}
+
+/*
+ * Returns the sockets a process may run on according to its affinity, one bit per socket. Every
+ * socket is returned when the affinity cannot be read or spans several groups.
+ */
+UINT32 get_process_socket_mask(const HANDLE process_handle) {
+	const UINT32 all_sockets = (static_cast<UINT32>(1) << sockets.size()) - 1;
+	if (process_handle == nullptr) {
+		return all_sockets;
+	}
+
+	USHORT groups_count = 1;
+	USHORT group;
+	DWORD_PTR process_mask, system_mask;
+	if (!GetProcessGroupAffinity(process_handle, &groups_count, &group) || groups_count != 1
+		|| !GetProcessAffinityMask(process_handle, &process_mask, &system_mask) || process_mask == 0) {
+		return all_sockets;
+	}
+
+	UINT32 socket_mask = 0;
+	for (SIZE_T socket = 0; socket < sockets.size(); socket++) {
+		for (const auto& mask : sockets[socket].group_masks) {
+			if (mask.Group == group && (mask.Mask & process_mask) != 0) {
+				socket_mask |= static_cast<UINT32>(1) << socket;
+			}
+		}
+	}
+	return socket_mask != 0 ? socket_mask : all_sockets;
+}
\ No newline at end of file
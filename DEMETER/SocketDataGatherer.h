@@ -0,0 +1,38 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <windows.h>
+#include <winternl.h>
+
+#include "DemeterLogger.h"
+#include "EnergySource.h"
+
+#pragma comment(lib, "ntdll.lib")
+
+BOOL init_socket_topology();
+
+int get_sockets_count();
+
+BOOL pin_thread_to_socket(int, GROUP_AFFINITY*);
+
+void restore_thread_affinity(const GROUP_AFFINITY*);
+
+void get_socket_cpu_usage(float*);
+
+UINT32 get_process_socket_mask(HANDLE);
\ No newline at end of file
@@ -0,0 +1,113 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the state file: the energy calibration, saved once measured and on shutdown,
+ * then restored on startup so that the idle baseline is not measured again at every restart.
+ *
+ * No counter is restored. The energy spent while the agent was stopped would be charged to the
+ * first tick, and a counter wrap during that time cannot be detected; the CPU and disk counters of
+ * a process would spread the downtime over the first tick. Every counter is started from its value
+ * at startup instead (see prime_process_counters), so that the first tick covers its own window.
+ *
+ * File format (every integer is little endian):
+ *
+ *	header: u32 magic, u32 version, u64 save time (FILETIME), u32 flags (1: calibrated),
+ *	        f32 idle baseline (W), u64 time of the idle baseline measurement (FILETIME)
+ *
+ * The file is written next to its path and renamed over it.
+ */
+
+#include "StateFile.h"
+
+#include <fstream>
+
+using namespace std;
+
+typedef struct state_file_header {
+	UINT32 magic;
+	UINT32 version;
+	UINT64 save_time;
+	UINT32 flags;
+	float idle_baseline_watts;
+	UINT64 calibration_time;
+} state_file_header;
+
+constexpr UINT32 STATE_CALIBRATED = 1;
+
+UINT64 get_file_time_now() {
+	FILETIME fnow;
+	GetSystemTimeAsFileTime(&fnow);
+	ULARGE_INTEGER now;
+	memcpy(&now, &fnow, sizeof(FILETIME));
+	return now.QuadPart;
+}
+
+/*
+ * Restores the energy state. Returns FALSE when there is no valid state file, energy is then left
+ * untouched.
+ */
+BOOL load_state_file(const string& path, energy_state* energy) {
+	ifstream file(path, ios::in | ios::binary);
+	if (!file) {
+		return FALSE;
+	}
+
+	state_file_header header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != STATE_FILE_MAGIC) {
+		spdlog::warn("Ignoring the state file {}, it is not a state file.", path);
+		return FALSE;
+	}
+	if (header.version != STATE_FILE_VERSION) {
+		spdlog::warn("Ignoring the state file {}, version {} is not supported.", path, header.version);
+		return FALSE;
+	}
+
+	energy->calibrated = (header.flags & STATE_CALIBRATED) != 0;
+	energy->idle_baseline_watts = header.idle_baseline_watts;
+	energy->calibration_time = header.calibration_time;
+	spdlog::info("State restored from {}", path);
+	return TRUE;
+}
+
+/*
+ * Saves the energy state.
+ */
+BOOL save_state_file(const string& path, const energy_state& energy) {
+	state_file_header header = {};
+	header.magic = STATE_FILE_MAGIC;
+	header.version = STATE_FILE_VERSION;
+	header.save_time = get_file_time_now();
+	header.flags = energy.calibrated ? STATE_CALIBRATED : 0;
+	header.idle_baseline_watts = energy.idle_baseline_watts;
+	header.calibration_time = energy.calibration_time;
+
+	const string temporary_path = path + ".tmp";
+	{
+		ofstream file(temporary_path, ios::out | ios::binary | ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (!file) {
+			spdlog::error("Could not write the state file {}", temporary_path);
+			return FALSE;
+		}
+	}
+	if (!MoveFileExA(temporary_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		spdlog::error("Could not replace the state file {}. Error code: {}", path, GetLastError());
+		return FALSE;
+	}
+	return TRUE;
+}
\ No newline at end of file
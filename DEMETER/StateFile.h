@@ -0,0 +1,39 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <windows.h>
+#include <string>
+
+#include "DemeterLogger.h"
+
+constexpr UINT32 STATE_FILE_MAGIC = 0x54534D44; // "DMST"
+constexpr UINT32 STATE_FILE_VERSION = 3;
+
+// State of the energy measurement kept across restarts.
+typedef struct energy_state {
+	BOOL calibrated; // FALSE when the idle baseline was never measured.
+	float idle_baseline_watts;
+	UINT64 calibration_time; // When the idle baseline was measured (FILETIME).
+} energy_state;
+
+UINT64 get_file_time_now();
+
+BOOL load_state_file(const std::string&, energy_state*);
+
+BOOL save_state_file(const std::string&, const energy_state&);
\ No newline at end of file
@@ -0,0 +1,365 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * This file defines the stream server: a Unix domain socket on which local tools subscribe to a
+ * push feed of the rows of every tick.
+ *
+ * Protocol (every integer is little endian):
+ *
+ * Right after connecting, a subscriber sends one request frame: a u32 length followed by that many
+ * bytes of text, one filter per line. "name=<process name>" restricts the feed to these names
+ * (the line can be repeated), "min_sumc=<mWh>" drops process rows consuming less than that
+ * (aggregate rows are kept). An empty request (length 0) subscribes to everything.
+ *
+ * Then every tick is sent as one frame:
+ *
+ *	u32 length (bytes following this field)
+ *	u32 magic, u32 version, u32 row count
+ *	i64 timestamp, u64 tick number, u64 ticks dropped so far for this subscriber
+ *	rows: u32 flags (1 = aggregate), u32 name length, u64 RAM,
+ *	      15 f32 (CPU, CPUC, NetUp, NetUpC, NetDown, NetDownC, DiskR, DiskW, DiskRC, DiskWC, SumC,
+ *	      CoreC, GpuC, UncoreC, DramC),
+ *	      name bytes
+ *
+ * The main loop never waits on a subscriber: frames are queued and sent by a thread per subscriber.
+ * When a subscriber is too slow and its queue is full, its oldest tick is dropped and counted.
+ */
+
+#include "StreamServer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+using namespace std;
+
+typedef struct subscriber {
+	SOCKET socket;
+	unordered_set<string> names;
+	float min_sum_consumption;
+	mutex queue_lock;
+	condition_variable queue_changed;
+	deque<string> pending_frames;
+	bool closed;
+	UINT64 sent_ticks;
+	UINT64 dropped_ticks;
+} subscriber;
+
+static atomic<SOCKET> listen_socket = INVALID_SOCKET; // INVALID_SOCKET once stopped, checked by the server threads.
+static string listen_path;
+static SIZE_T max_pending_ticks = 4;
+static mutex subscribers_lock;
+static vector<shared_ptr<subscriber>> subscribers;
+static UINT64 tick_number = 0;
+
+constexpr SIZE_T frame_header_size = 4 * sizeof(UINT32) + 3 * sizeof(UINT64);
+constexpr UINT32 max_request_size = 65536;
+
+void set_stream_max_pending_ticks(const SIZE_T max_pending) {
+	max_pending_ticks = max_pending == 0 ? 1 : max_pending;
+}
+
+template <typename T>
+static void append_value(string& buffer, const T value) {
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static void write_value(string& buffer, const SIZE_T offset, const T value) {
+	memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+static bool receive_exact(const SOCKET socket, char* buffer, int length) {
+	while (length > 0) {
+		const int received = recv(socket, buffer, length, 0);
+		if (received <= 0) {
+			return false;
+		}
+		buffer += received;
+		length -= received;
+	}
+	return true;
+}
+
+static bool send_all(const SOCKET socket, const string& buffer) {
+	const char* data = buffer.data();
+	auto remaining = static_cast<int>(buffer.size());
+	while (remaining > 0) {
+		const int sent = send(socket, data, remaining, 0);
+		if (sent == SOCKET_ERROR) {
+			return false;
+		}
+		data += sent;
+		remaining -= sent;
+	}
+	return true;
+}
+
+/*
+ * Reads the request frame of a new subscriber. A subscriber that does not send its request in
+ * time, or sends a malformed one, gets every row.
+ */
+static void read_subscription(subscriber& client) {
+	constexpr DWORD receive_timeout = 2000;
+	setsockopt(client.socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&receive_timeout), sizeof(receive_timeout));
+
+	UINT32 request_size;
+	if (!receive_exact(client.socket, reinterpret_cast<char*>(&request_size), sizeof(request_size))
+		|| request_size > max_request_size) {
+		return;
+	}
+
+	string request(request_size, '\0');
+	if (!receive_exact(client.socket, request.data(), static_cast<int>(request_size))) {
+		return;
+	}
+
+	SIZE_T line_begin = 0;
+	while (line_begin < request.size()) {
+		SIZE_T line_end = request.find('\n', line_begin);
+		if (line_end == string::npos) {
+			line_end = request.size();
+		}
+		const string line = request.substr(line_begin, line_end - line_begin);
+		if (line.starts_with("name=")) {
+			client.names.insert(line.substr(5));
+		}
+		else if (line.starts_with("min_sumc=")) {
+			client.min_sum_consumption = strtof(line.c_str() + 9, nullptr);
+		}
+		line_begin = line_end + 1;
+	}
+}
+
+static bool is_row_selected(const subscriber& client, const process_record& record) {
+	if (!client.names.empty() && !client.names.contains(record.name)) {
+		return false;
+	}
+	return record.aggregate || record.sum_consumption >= client.min_sum_consumption;
+}
+
+static void append_row(string& buffer, const process_record& record) {
+	append_value<UINT32>(buffer, record.aggregate ? 1 : 0);
+	append_value<UINT32>(buffer, static_cast<UINT32>(record.name.size()));
+	append_value<UINT64>(buffer, record.ram);
+	append_value<float>(buffer, record.cpu_usage);
+	append_value<float>(buffer, record.cpu_consumption);
+	append_value<float>(buffer, record.net_up_bandwidth);
+	append_value<float>(buffer, record.net_up_consumption);
+	append_value<float>(buffer, record.net_down_bandwidth);
+	append_value<float>(buffer, record.net_down_consumption);
+	append_value<float>(buffer, record.disk_read_speed);
+	append_value<float>(buffer, record.disk_write_speed);
+	append_value<float>(buffer, record.disk_read_consumption);
+	append_value<float>(buffer, record.disk_write_consumption);
+	append_value<float>(buffer, record.sum_consumption);
+	append_value<float>(buffer, record.core_consumption);
+	append_value<float>(buffer, record.gpu_consumption);
+	append_value<float>(buffer, record.uncore_consumption);
+	append_value<float>(buffer, record.dram_consumption);
+	buffer += record.name;
+}
+
+/*
+ * Sends the queued frames of one subscriber until it disconnects or the server stops.
+ */
+DWORD WINAPI stream_subscriber_loop(const LPVOID parameter) {
+	const auto owner = static_cast<shared_ptr<subscriber>*>(parameter);
+	const shared_ptr<subscriber> client = *owner;
+	delete owner;
+
+	read_subscription(*client);
+	{
+		// Checked under the lock: a server stopped meanwhile would not close this subscriber.
+		lock_guard lock(subscribers_lock);
+		if (listen_socket.load() == INVALID_SOCKET) {
+			closesocket(client->socket);
+			return 0;
+		}
+		subscribers.push_back(client);
+	}
+	spdlog::info("Stream subscriber connected ({} names, min SumC {})", client->names.size(), client->min_sum_consumption);
+
+	while (true) {
+		string frame;
+		{
+			unique_lock lock(client->queue_lock);
+			client->queue_changed.wait(lock, [&client] { return client->closed || !client->pending_frames.empty(); });
+			if (client->closed) {
+				break;
+			}
+			frame = move(client->pending_frames.front());
+			client->pending_frames.pop_front();
+		}
+
+		if (!send_all(client->socket, frame)) {
+			break;
+		}
+
+		lock_guard lock(client->queue_lock);
+		client->sent_ticks++;
+	}
+
+	{
+		lock_guard lock(client->queue_lock);
+		client->closed = true;
+		spdlog::info("Stream subscriber disconnected, {} ticks sent, {} ticks dropped", client->sent_ticks, client->dropped_ticks);
+	}
+	closesocket(client->socket);
+	return 0;
+}
+
+DWORD WINAPI stream_server_loop(LPVOID) {
+	while (true) {
+		const SOCKET client_socket = accept(listen_socket.load(), nullptr, nullptr);
+		if (client_socket == INVALID_SOCKET) {
+			if (listen_socket.load() == INVALID_SOCKET) {
+				return 0; // Server stopped.
+			}
+			continue;
+		}
+
+		const auto client = make_shared<subscriber>();
+		client->socket = client_socket;
+		client->min_sum_consumption = 0;
+		client->closed = false;
+		client->sent_ticks = 0;
+		client->dropped_ticks = 0;
+
+		const HANDLE thread = CreateThread(nullptr, 0, stream_subscriber_loop, new shared_ptr<subscriber>(client), 0, nullptr);
+		if (thread == nullptr) {
+			spdlog::warn("Could not start a stream subscriber thread.");
+			closesocket(client_socket);
+			continue;
+		}
+		CloseHandle(thread);
+	}
+}
+
+/*
+ * Starts listening on the Unix domain socket at path (an existing socket file is replaced).
+ */
+BOOL start_stream_server(const string& path) {
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		spdlog::error("WSAStartup failed for the stream server.");
+		return FALSE;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		spdlog::error("Stream socket path too long: {}", path);
+		return FALSE;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size());
+
+	const SOCKET server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_socket == INVALID_SOCKET) {
+		spdlog::error("Could not create the stream socket: {}", WSAGetLastError());
+		return FALSE;
+	}
+
+	DeleteFileA(path.c_str());
+	if (bind(server_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR
+		|| listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
+		spdlog::error("Could not listen on {} for the stream server: {}", path, WSAGetLastError());
+		closesocket(server_socket);
+		return FALSE;
+	}
+	listen_socket.store(server_socket);
+	listen_path = path;
+
+	CreateThread(nullptr, 0, stream_server_loop, nullptr, 0, nullptr);
+	spdlog::info("Stream server listening on {}", path);
+	return TRUE;
+}
+
+/*
+ * Queues the rows of the tick for every subscriber. Called from the main loop once per tick.
+ */
+void publish_stream_tick(const vector<process_record>& records, const time_t timestamp) {
+	if (listen_socket.load() == INVALID_SOCKET) return;
+
+	tick_number++;
+
+	// Rows are encoded once, each subscriber frame is then assembled from the rows it selected.
+	string encoded_rows;
+	vector<SIZE_T> row_offsets(records.size() + 1);
+	for (SIZE_T i = 0; i < records.size(); i++) {
+		row_offsets[i] = encoded_rows.size();
+		append_row(encoded_rows, records[i]);
+	}
+	row_offsets[records.size()] = encoded_rows.size();
+
+	lock_guard lock(subscribers_lock);
+	erase_if(subscribers, [](const shared_ptr<subscriber>& client) {
+		lock_guard client_lock(client->queue_lock);
+		return client->closed;
+	});
+
+	for (const auto& client : subscribers) {
+		string frame(frame_header_size, '\0');
+		UINT32 row_count = 0;
+		for (SIZE_T i = 0; i < records.size(); i++) {
+			if (is_row_selected(*client, records[i])) {
+				frame.append(encoded_rows, row_offsets[i], row_offsets[i + 1] - row_offsets[i]);
+				row_count++;
+			}
+		}
+
+		lock_guard client_lock(client->queue_lock);
+		if (client->pending_frames.size() >= max_pending_ticks) {
+			client->pending_frames.pop_front();
+			client->dropped_ticks++;
+			if (client->dropped_ticks == 1 || client->dropped_ticks % 100 == 0) {
+				spdlog::warn("Stream subscriber lagging, {} ticks dropped", client->dropped_ticks);
+			}
+		}
+
+		write_value<UINT32>(frame, 0, static_cast<UINT32>(frame.size() - sizeof(UINT32)));
+		write_value<UINT32>(frame, 4, STREAM_FRAME_MAGIC);
+		write_value<UINT32>(frame, 8, STREAM_FRAME_VERSION);
+		write_value<UINT32>(frame, 12, row_count);
+		write_value<INT64>(frame, 16, static_cast<INT64>(timestamp));
+		write_value<UINT64>(frame, 24, tick_number);
+		write_value<UINT64>(frame, 32, client->dropped_ticks);
+
+		client->pending_frames.push_back(move(frame));
+		client->queue_changed.notify_one();
+	}
+}
+
+void stop_stream_server() {
+	const SOCKET socket_to_close = listen_socket.exchange(INVALID_SOCKET);
+	if (socket_to_close == INVALID_SOCKET) return;
+
+	closesocket(socket_to_close);
+
+	lock_guard lock(subscribers_lock);
+	for (const auto& client : subscribers) {
+		lock_guard client_lock(client->queue_lock);
+		client->closed = true;
+		shutdown(client->socket, SD_BOTH);
+		client->queue_changed.notify_one();
+	}
+	DeleteFileA(listen_path.c_str());
+}
\ No newline at end of file
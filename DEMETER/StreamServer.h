@@ -0,0 +1,43 @@
+/*
+ * Demeter - Desktop Energy Meter
+ * Copyright (C) 2023  Constellation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#define _WINSOCKAPI_
+
+#include <windows.h>
+#include <winsock2.h>
+#include <afunix.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#include <string>
+#include <vector>
+
+#include "DemeterLogger.h"
+#include "ProcessRecord.h"
+
+constexpr UINT32 STREAM_FRAME_MAGIC = 0x534D5444; // "DTMS"
+constexpr UINT32 STREAM_FRAME_VERSION = 2;
+
+void set_stream_max_pending_ticks(SIZE_T);
+
+BOOL start_stream_server(const std::string&);
+
+void publish_stream_tick(const std::vector<process_record>&, time_t);
+
+void stop_stream_server();
\ No newline at end of file